@@ -0,0 +1,104 @@
+#!/bin/sh
+# Learns made up text with the plain file system build and prints the
+# best and median of RUNS runs (default 5), from the STATS counters.
+#   sh bench/learn.sh probe [LINES]  hashing time and probe lengths
+#   sh bench/learn.sh overrelax [LINES]  lambda iterations with and without -O
+#   sh bench/learn.sh vexp [LINES]  optimization time with and without -K
+# Run from the top directory. LINES (default 200000) has 12 words each.
+
+. tests/plain.sh
+
+mode=${1:-probe}
+lines=${2:-200000}
+runs=${RUNS:-5}
+
+work=`mktemp -d /tmp/bench.XXXXXX` || exit 1
+trap 'rm -rf $work' 0
+
+build_objects $work/o || exit 1
+build_dbacl $work/learn $work/o -DNUM_CATEGORIES=1 -DLEARN_JOBS=1 || exit 1
+
+# make_zipf SEED LINES: like make_text, but the words come from a
+# vocabulary of 300000 with roughly Zipf frequencies, as in real text
+make_zipf() {
+	awk -v seed=$1 -v lines=$2 'BEGIN {
+		srand(seed);
+		for(l = 0; l < lines; l++) {
+			line = "";
+			for(w = 0; w < 12; w++) {
+				x = int(exp(rand() * log(300000))) * 7919 % 1000003;
+				word = "";
+				do {
+					word = word sprintf("%c", 97 + x % 26);
+					x = int(x / 26);
+				} while( x > 0 );
+				line = line word " ";
+			}
+			print line;
+		}
+	}'
+}
+
+# measure NAME SWITCHES: learns $work/1.txt runs times, and prints the
+# min and median of the learning time outside optimization, in ms
+measure() {
+	name=$1; shift
+	rm -f $work/times
+	for r in `seq $runs`; do
+		(cd $work && ./learn "$@" > stats 2> /dev/null) || {
+			echo "dbacl failed"; return 1
+		}
+		awk '/^total learn time/ { l = $5 } /^optimize time/ { o = $4 }
+			END { print int((l - o) / 1000) }' $work/stats >> $work/times
+	done
+	sort -n $work/times | awk -v name="$name" '{ t[NR] = $1 } END {
+		printf("%-24s hashing ms min %d median %d\n", name, t[1], t[int((NR + 1) / 2)]) }'
+}
+
+# measure_optimize NAME SWITCHES: as measure(), for the optimization
+# time, followed by the lambda iterations, fallbacks and model entropy
+# of the last run
+measure_optimize() {
+	name=$1; shift
+	rm -f $work/times
+	for r in `seq $runs`; do
+		(cd $work && ./learn "$@" > stats 2> /dev/null) || {
+			echo "dbacl failed"; return 1
+		}
+		awk '/^optimize time/ { print int($4 / 1000) }' $work/stats >> $work/times
+	done
+	sort -n $work/times | awk -v name="$name" '{ t[NR] = $1 } END {
+		printf("%-24s optimize ms min %d median %d", name, t[1], t[int((NR + 1) / 2)]) }'
+	awk '/^lambda iterations/ { i = $4 } /^over-relaxation fallbacks/ { f = $4 }
+		END { printf(", %d iterations, %d fallbacks", i, f) }' $work/stats
+	awk '/^# entropy/ { printf(", entropy %s\n", $3) }' $work/1_out
+}
+
+case $mode in
+probe)
+	make_zipf 11 $lines > $work/1.txt
+	measure "zipf" || exit 1
+	grep "learner probe lengths" $work/stats
+	make_text 3 $lines > $work/1.txt
+	measure "mostly unique" || exit 1
+	grep "learner probe lengths" $work/stats
+	;;
+overrelax)
+	make_zipf 11 $lines > $work/1.txt
+	for w in 1 2; do
+		measure_optimize "zipf -w $w" -w $w || exit 1
+		measure_optimize "zipf -w $w -O" -w $w -O || exit 1
+	done
+	;;
+vexp)
+	make_zipf 11 $lines > $work/1.txt
+	for w in 1 2; do
+		measure_optimize "zipf -w $w" -w $w || exit 1
+		measure_optimize "zipf -w $w -K" -w $w -K || exit 1
+	done
+	;;
+*)
+	echo "usage: sh bench/learn.sh probe|overrelax|vexp [LINES]"; exit 1
+	;;
+esac
+exit 0
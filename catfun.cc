@@ -48,6 +48,7 @@ extern long system_pagesize;
 
 #ifdef STATS
 extern unsigned long learner_read_bytes;
+extern unsigned long category_probe_hist[PROBE_HISTOGRAM];
 #endif
 
 /***********************************************************
@@ -376,7 +377,7 @@ void clear_empirical(empirical_t *emp) {
 }
 
 h_item_t *find_in_empirical(empirical_t *emp, hash_value_t id) {
-	register h_item_t *i, *loop;
+	h_item_t *i, *loop;
 	/* start at id */
 	i = loop = &emp->hash[id & (emp->max_tokens - 1)];
 
@@ -464,6 +465,10 @@ void init_category(category_t *cat) {
 	cat->hash = NULL;
 	cat->mmap_offset = 0;
 	cat->mmap_start = NULL;
+	cat->shadow_offset = 0;
+	cat->shadow_region = 0;
+	cat->shadow_generation = 0;
+	cat->id_width = NATIVE_ID_WIDTH;
 }
 
 bool_t create_category_hash(category_t *cat, FILE *input, int protf) {
@@ -478,13 +483,13 @@ bool_t create_category_hash(category_t *cat, FILE *input, int protf) {
 		if( cat->mmap_offset > 0 ) {
 
 			cat->mmap_start =
-					(byte_t *)MMAP(0, sizeof(c_item_t) * cat->max_tokens +
+					(byte_t *)MMAP(0, CATEGORY_ITEM_SIZE(cat) * cat->max_tokens +
 							cat->mmap_offset,
-							protf, MAP_SHARED, fileno(/input), 0);
+							protf, MAP_SHARED, fileno(input), 0);
 			if( cat->mmap_start == MAP_FAILED ) { cat->mmap_start = NULL; }
 			if( cat->mmap_start ) {
 				cat->hash = (c_item_t *)(cat->mmap_start + cat->mmap_offset);
-				MADVISE(cat->hash, sizeof(c_item_t) * cat->max_tokens,
+				MADVISE(cat->hash, CATEGORY_ITEM_SIZE(cat) * cat->max_tokens,
 						MADV_SEQUENTIAL|MADV_WILLNEED);
 				/* lock the pages to prevent swapping - on Linux, this
 	   works without root privs so long as the user limits
@@ -492,7 +497,7 @@ bool_t create_category_hash(category_t *cat, FILE *input, int protf) {
 	   On other OSes, root may me necessary. If we can't
 	   lock, it doesn't really matter, but cross validations
 	   and multiple classifications are a _lot_ faster with locking. */
-				MLOCK(cat->hash, sizeof(c_item_t) * cat->max_tokens);
+				MLOCK(cat->hash, CATEGORY_ITEM_SIZE(cat) * cat->max_tokens);
 				cat->c_options |= (1<<C_OPTION_MMAPPED_HASH);
 			}
 		}
@@ -507,23 +512,24 @@ bool_t create_category_hash(category_t *cat, FILE *input, int protf) {
 
 		cat->c_options &= ~(1<<C_OPTION_MMAPPED_HASH);
 		/* allocate hash table */
-		cat->hash = (c_item_t *)mymalloc(sizeof(c_item_t) * cat->max_tokens);
+		cat->hash = (c_item_t *)mymalloc(CATEGORY_ITEM_SIZE(cat) * cat->max_tokens);
 		if( !cat->hash ) {
 			errormsg(E_ERROR, "not enough memory for category %s\n",
 					cat->filename);
 			return 0;
 		}
 
-		MADVISE(cat->hash, sizeof(c_item_t) * cat->max_tokens,
+		MADVISE(cat->hash, CATEGORY_ITEM_SIZE(cat) * cat->max_tokens,
 				MADV_SEQUENTIAL);
 
 		/* read in hash table */
 		i = cat->max_tokens;
 		j = 0;
 		while(!ferror(input) && !feof(input) && (j < i) ) {
-			j += fread(cat->hash + j, sizeof(c_item_t), i - j, input);
+			j += fread((byte_t *)cat->hash + j * CATEGORY_ITEM_SIZE(cat), 
+					CATEGORY_ITEM_SIZE(cat), i - j, input);
 #ifdef STATS
-			learner_read_bytes +=  sizeof(c_item_t) * (i - j) ;
+			learner_read_bytes +=  CATEGORY_ITEM_SIZE(cat) * (i - j) ;
 #endif
 		}
 
@@ -555,7 +561,7 @@ bool_t nvram_create_category_hash(category_t *cat, FILE *input, int protf, long
 		if( cat->mmap_start == MAP_FAILED || !cat->mmap_start  ) { cat->mmap_start = NULL; }
 		if( cat->mmap_start ) {
 			cat->hash = (c_item_t *)(cat->mmap_start + cat->mmap_offset);
-			MADVISE(cat->hash, sizeof(c_item_t) * cat->max_tokens,
+			MADVISE(cat->hash, CATEGORY_ITEM_SIZE(cat) * cat->max_tokens,
 					MADV_SEQUENTIAL|MADV_WILLNEED);
 			/* lock the pages to prevent swapping - on Linux, this
            works without root privs so long as the user limits
@@ -563,7 +569,7 @@ bool_t nvram_create_category_hash(category_t *cat, FILE *input, int protf, long
            On other OSes, root may me necessary. If we can't
            lock, it doesn't really matter, but cross validations
            and multiple classifications are a _lot_ faster with locking. */
-			MLOCK(cat->hash, sizeof(c_item_t) * cat->max_tokens);
+			MLOCK(cat->hash, CATEGORY_ITEM_SIZE(cat) * cat->max_tokens);
 			cat->c_options |= (1<<C_OPTION_MMAPPED_HASH);
 		}
 	}
@@ -574,14 +580,14 @@ bool_t nvram_create_category_hash(category_t *cat, FILE *input, int protf, long
 
 		cat->c_options &= ~(1<<C_OPTION_MMAPPED_HASH);
 		/* allocate hash table */
-		cat->hash = (c_item_t *)mymalloc(sizeof(c_item_t) * cat->max_tokens);
+		cat->hash = (c_item_t *)mymalloc(CATEGORY_ITEM_SIZE(cat) * cat->max_tokens);
 		if( !cat->hash ) {
 			errormsg(E_ERROR, "not enough memory for category %s\n",
 					cat->filename);
 			return 0;
 		}
 
-		MADVISE(cat->hash, sizeof(c_item_t) * cat->max_tokens,
+		MADVISE(cat->hash, CATEGORY_ITEM_SIZE(cat) * cat->max_tokens,
 				MADV_SEQUENTIAL);
 
 		/* read in hash table */
@@ -592,7 +598,8 @@ bool_t nvram_create_category_hash(category_t *cat, FILE *input, int protf, long
 		
 
 		while(!ferror(input) && !feof(input) && (j < i) ) {
-			j += fread(cat->hash + j, sizeof(c_item_t), i - j, input);
+			j += fread((byte_t *)cat->hash + j * CATEGORY_ITEM_SIZE(cat), 
+					CATEGORY_ITEM_SIZE(cat), i - j, input);
 		}
 
 		if( j < i ) {
@@ -609,7 +616,7 @@ bool_t nvram_create_category_hash(category_t *cat, FILE *input, int protf, long
 void free_category_hash(category_t *cat) {
 	if( cat->hash ) {
 		if( cat->mmap_start != NULL ) {
-			MUNMAP(cat->mmap_start, cat->max_tokens * sizeof(c_item_t) +
+			MUNMAP(cat->mmap_start, cat->max_tokens * CATEGORY_ITEM_SIZE(cat) +
 					cat->mmap_offset);
 			cat->mmap_start = NULL;
 			cat->mmap_offset = 0;
@@ -671,6 +678,7 @@ void init_purely_random_text_category(category_t *cat) {
 	cat->divergence = 0.0;
 	cat->delta = 0.0;
 	cat->renorm = 0.0;
+	cat->id_width = NATIVE_ID_WIDTH;
 	cat->hash = NULL;
 	cat->mmap_start = NULL;
 	cat->mmap_offset = 0;
@@ -679,35 +687,77 @@ void init_purely_random_text_category(category_t *cat) {
 	cat->m_options = 0;
 }
 
-c_item_t *find_in_category(category_t *cat, hash_value_t id) {
-	register c_item_t *i, *loop;
+/* if the category was saved in Robin Hood order (C_OPTION_ROBINHOOD),
+   a miss can stop as soon as we meet an item which is closer to its
+   home slot than we are to ours. Otherwise we must go on until
+   we find an empty slot. The ids of cat must be ID wide. */
+template <typename ID>
+static c_item_w<ID> *find_in_category_w(category_t *cat, ID id) {
+	c_item_w<ID> *i, *loop, *base;
+	hash_count_t n, mask;
+	bool_t robinhood;
 
 	if( cat->hash ) {
 		/* start at id */
-		i = loop = &cat->hash[id & (cat->max_tokens - 1)];
+		base = (c_item_w<ID> *)cat->hash;
+		mask = cat->max_tokens - 1;
+		i = loop = &base[id & mask];
+		robinhood = (cat->c_options & (1<<C_OPTION_ROBINHOOD)) ? 1 : 0;
+		n = 0;
 
 		while( FILLEDP(i) ) {
-			if( EQUALP(NTOH_ID(i->id),id) ) {
+			if( EQUALP(ntoh_id_w<ID>(i->id),id) ) {
+				CATEGORY_PROBE_STATS(n);
 				return i; /* found id */
+			} else if( robinhood &&
+					(PROBE_DISTANCE((hash_count_t)(i - base), 
+							ntoh_id_w<ID>(i->id), mask) < n) ) {
+				CATEGORY_PROBE_STATS(n);
+				return NULL; /* can't be further along */
 			} else {
 				i++; /* not found */
+				n++;
 				/* wrap around */
-				i = (i >= &cat->hash[cat->max_tokens]) ? cat->hash : i;
+				i = (i >= &base[cat->max_tokens]) ? base : i;
 				if( i == loop ) {
 					return NULL; /* when hash table is full */
 				}
 			}
 		}
+		CATEGORY_PROBE_STATS(n);
 		return i;
 	} else {
 		return NULL;
 	}
 }
 
+c_item_t *find_in_category(category_t *cat, hash_value_t id) {
+	return find_in_category_w<hash_value_t>(cat, id);
+}
+
+/* the lambda of tok in a category whose ids aren't hash_value_t, whose
+   hash value is computed once per token in *wid. Sets *kid to the
+   id found, or 0 */
+template <typename ID>
+static weight_t find_lambda_w(category_t *cat, char *tok, 
+		ID *wid, unsigned long *kid) {
+	c_item_w<ID> *k;
+
+	if( !*wid ) {
+		*wid = hash_full_token_w<ID>(tok);
+	}
+	k = find_in_category_w<ID>(cat, *wid);
+	*kid = k ? (unsigned long)ntoh_id_w<ID>(k->id) : 0;
+	return k ? UNPACK_LAMBDA(NTOH_LAMBDA(k->lam)) : 0.0;
+}
+
 /* for each loaded category, this calculates the score.
    Tokens have the format
-   DIAMOND t1 DIAMOND t2 ... tn DIAMOND CLASSEP class NUL */
-void score_word(char *tok, token_type_t tt, regex_count_t re) {
+   DIAMOND t1 DIAMOND t2 ... tn DIAMOND CLASSEP class NUL.
+   There is one instance for each setting of the options it tests, so
+   those tests cost nothing per token. */
+template <bool calcentropy, bool dump>
+static void score_word_t(char *tok, token_type_t tt, regex_count_t re) {
 	category_count_t i = 0;
 	weight_t multinomial_correction = 0.0;
 	weight_t shannon_correction = 0.0;
@@ -715,8 +765,11 @@ void score_word(char *tok, token_type_t tt, regex_count_t re) {
 	bool_t apply;
 	alphabet_size_t pp, pc;
 	hash_value_t id;
+	u_int32_t id32 = 0;
+	u_int64_t id64 = 0;
+	unsigned long kid = 0;
 	char *q;
-	register c_item_t *k = NULL;
+	c_item_t *k = NULL;
 	h_item_t *h = NULL;
 
 	/* we skip "empty" tokens */
@@ -725,7 +778,7 @@ void score_word(char *tok, token_type_t tt, regex_count_t re) {
 
 		id = hash_full_token(tok);
 
-		if( (m_options & (1<<M_OPTION_CALCENTROPY)) ) {
+		if( calcentropy ) {
 			/* add the token to the hash */
 
 			h = find_in_empirical(&empirical, id);
@@ -805,9 +858,16 @@ void score_word(char *tok, token_type_t tt, regex_count_t re) {
 			if( apply ) {
 
 				/* if token found, add its lambda weight */
-				k = find_in_category(&cat[i], id);
-				if( k ) {
-					lambda = UNPACK_LAMBDA(NTOH_LAMBDA(k->lam));
+				if( cat[i].id_width == NATIVE_ID_WIDTH ) {
+					k = find_in_category(&cat[i], id);
+					if( k ) {
+						lambda = UNPACK_LAMBDA(NTOH_LAMBDA(k->lam));
+					}
+					kid = k ? (unsigned long)NTOH_ID(k->id) : 0;
+				} else if( cat[i].id_width == 32 ) {
+					lambda = find_lambda_w<u_int32_t>(&cat[i], tok, &id32, &kid);
+				} else {
+					lambda = find_lambda_w<u_int64_t>(&cat[i], tok, &id64, &kid);
 				}
 
 				if( tt.order == 1 ) {
@@ -909,7 +969,7 @@ void score_word(char *tok, token_type_t tt, regex_count_t re) {
 
 			}
 
-			if( u_options & (1<<U_OPTION_DUMP) ) {
+			if( dump ) {
 				if( u_options & (1<<U_OPTION_SCORES) ) {
 					fprintf(stdout, " %8.2f * %-6.1f\t",
 							-cat[i].score/cat[i].complexity,
@@ -921,13 +981,13 @@ void score_word(char *tok, token_type_t tt, regex_count_t re) {
 							"%7.2f %7.2f %7.2f %7.2f %8lx\t",
 							lambda, ref, apply ? -cat[i].renorm : 0.0,
 									multinomial_correction,
-									(long unsigned int)((k && apply) ? NTOH_ID(k->id) : 0));
+									(long unsigned int)(apply ? kid : 0));
 				}
 			}
 
 		}
 
-		if( u_options & (1<<U_OPTION_DUMP) ) {
+		if( dump ) {
 			print_token(stdout, tok);
 			if( re > 0 ) {
 				fprintf(stdout, "<re=%d>\n", re);
@@ -939,6 +999,22 @@ void score_word(char *tok, token_type_t tt, regex_count_t re) {
 	}
 }
 
+static word_fun_t const score_word_funs[4] = {
+	score_word_t<false,false>, score_word_t<false,true>,
+	score_word_t<true,false>, score_word_t<true,true>
+};
+
+/* picks the instance of score_word_t() for the current options. The
+   options it depends on must not change while scoring. */
+word_fun_t select_score_word() {
+	return score_word_funs[((m_options & (1<<M_OPTION_CALCENTROPY)) ? 2 : 0) +
+			((u_options & (1<<U_OPTION_DUMP)) ? 1 : 0)];
+}
+
+void score_word(char *tok, token_type_t tt, regex_count_t re) {
+	select_score_word()(tok, tt, re);
+}
+
 /*
  * Returns 2 * min[ F(obs), 1 - F(obs) ], and calls it
  * the "confidence". In reality, this is a type of p-value,
@@ -1054,6 +1130,24 @@ error_code_t load_category_header(FILE *input, category_t *cat) {
 					cat->m_options = (options_t)lint_val1;
 				}
 
+			} else if( strncmp(buf, MAGIC10, strlen(MAGIC10)) == 0 ) {
+
+				cat->c_options |= (1<<C_OPTION_ROBINHOOD);
+
+			} else if( strncmp(buf, MAGIC11, strlen(MAGIC11)) == 0 ) {
+
+				cat->c_options |= (1<<C_OPTION_SHADOW);
+
+			} else if( strncmp(buf, MAGIC12, 12) == 0 ) {
+
+				if( (sscanf(buf, MAGIC12, &cat->id_width) < 1) ||
+						((cat->id_width != 32) && (cat->id_width != 64) &&
+								(cat->id_width != NATIVE_ID_WIDTH)) ) {
+					errormsg(E_ERROR, "unsupported hash width in %s\n",
+							cat->fullfilename);
+					return 0;
+				}
+
 			}
 
 			/* finished with current line, get next one */
@@ -1105,6 +1199,154 @@ error_code_t load_category_header(FILE *input, category_t *cat) {
 }
 
 
+/* chains the checksum of a shadow region over n more bytes. This is
+   FNV-1a, one byte at a time, so the writers and the loaders can feed
+   the region in blocks of any size and still agree */
+u_int32_t shadow_checksum(const byte_t *p, size_t n, u_int32_t h) {
+	while( n-- > 0 ) {
+		h = (h ^ *p++) * 16777619U;
+	}
+	return h;
+}
+
+/* the checksum of a region is that of its data, then of its record
+   with the checksum field zeroed */
+u_int32_t shadow_record_checksum(const shadow_record_t *rec, u_int32_t h) {
+	shadow_record_t r = *rec;
+
+	r.checksum = 0;
+	return shadow_checksum((byte_t *)&r, sizeof(r), h);
+}
+
+/* returns the region which should be tried first: the one with the
+   latest generation, or -1 if neither record looks like one */
+static int first_shadow_region(shadow_record_t *rec) {
+	if( rec[0].magic != SHADOW_MAGIC ) {
+		return (rec[1].magic == SHADOW_MAGIC) ? 1 : -1;
+	} else if( rec[1].magic != SHADOW_MAGIC ) {
+		return 0;
+	}
+	return ((int32_t)(rec[1].generation - rec[0].generation) > 0) ? 1 : 0;
+}
+
+static void apply_shadow_record(category_t *cat, shadow_record_t *rec) {
+	cat->divergence = rec->divergence;
+	cat->logZ = rec->logZ;
+	cat->renorm = cat->delta * cat->logZ;
+	cat->shannon = rec->shannon;
+	cat->alpha = rec->alpha;
+	cat->beta = rec->beta;
+	cat->mu = rec->mu;
+	cat->s2 = rec->s2;
+	cat->model_full_token_count = (token_count_t)rec->full_token_count;
+	cat->model_unique_token_count = (token_count_t)rec->unique_token_count;
+	cat->model_num_docs = (document_count_t)rec->num_docs;
+}
+
+/* input is just past the headers. Finds the valid region with the
+   latest generation, takes its statistics, and leaves input at its
+   digrams. */
+bool_t select_shadow_region(category_t *cat, FILE *input) {
+	shadow_record_t rec[2];
+	size_t size = SHADOW_REGION_SIZE(cat->max_tokens, CATEGORY_ITEM_SIZE(cat));
+	size_t n, m;
+	long base;
+	off_t off;
+	u_int32_t h;
+	byte_t *buf;
+	int r, k;
+
+	base = ftell(input);
+	buf = (byte_t *)malloc(BUFSIZ * 16);
+	if( (base < 0) || !buf ) {
+		if( buf ) { free(buf); }
+		return 0;
+	}
+	for(r = 0; r < 2; r++) {
+		if( pread(fileno(input), &rec[r], sizeof(rec[r]), base + r * size) !=
+				(ssize_t)sizeof(rec[r]) ) {
+			rec[r].magic = 0;
+		}
+	}
+
+	r = first_shadow_region(rec);
+	for(k = 0; (k < 2) && (r >= 0); k++, r = 1 - r) {
+		if( rec[r].magic != SHADOW_MAGIC ) {
+			continue;
+		}
+		h = 0;
+		off = base + r * size + sizeof(shadow_record_t);
+		for(n = size - sizeof(shadow_record_t); n > 0; n -= m, off += m) {
+			m = (n < BUFSIZ * 16) ? n : BUFSIZ * 16;
+			if( pread(fileno(input), buf, m, off) != (ssize_t)m ) {
+				break;
+			}
+			h = shadow_checksum(buf, m, h);
+		}
+		if( (n == 0) && (shadow_record_checksum(&rec[r], h) == rec[r].checksum) ) {
+			break;
+		}
+	}
+	free(buf);
+
+	if( (k == 2) || (r < 0) ) {
+		errormsg(E_ERROR, "no valid region in category %s\n",
+				cat->fullfilename);
+		return 0;
+	}
+	if( (k > 0) && (u_options & (1<<U_OPTION_VERBOSE)) ) {
+		errormsg(E_WARNING, "the last update of %s was incomplete, using the one before\n",
+				cat->fullfilename);
+	}
+	apply_shadow_record(cat, &rec[r]);
+	cat->shadow_offset = base;
+	cat->shadow_region = r;
+	cat->shadow_generation = rec[r].generation;
+	return (fseek(input, base + r * size + sizeof(shadow_record_t), SEEK_SET) == 0);
+}
+
+/* as select_shadow_region(), for a category in memory. *offset is
+   just past the headers, and becomes the offset of the digrams */
+bool_t nvram_select_shadow_region(category_t *cat, char *start, 
+		size_t datasize, long *offset) {
+	shadow_record_t rec[2];
+	size_t size = SHADOW_REGION_SIZE(cat->max_tokens, CATEGORY_ITEM_SIZE(cat));
+	u_int32_t h;
+	int r, k;
+
+	if( *offset + 2 * size > datasize ) {
+		errormsg(E_ERROR, "category %s is truncated\n", cat->fullfilename);
+		return 0;
+	}
+	for(r = 0; r < 2; r++) {
+		memcpy(&rec[r], start + *offset + r * size, sizeof(rec[r]));
+	}
+
+	r = first_shadow_region(rec);
+	for(k = 0; (k < 2) && (r >= 0); k++, r = 1 - r) {
+		if( rec[r].magic != SHADOW_MAGIC ) {
+			continue;
+		}
+		h = shadow_checksum((byte_t *)start + *offset + r * size + 
+				sizeof(shadow_record_t), size - sizeof(shadow_record_t), 0);
+		if( shadow_record_checksum(&rec[r], h) == rec[r].checksum ) {
+			break;
+		}
+	}
+
+	if( (k == 2) || (r < 0) ) {
+		errormsg(E_ERROR, "no valid region in category %s\n",
+				cat->fullfilename);
+		return 0;
+	}
+	apply_shadow_record(cat, &rec[r]);
+	cat->shadow_offset = *offset;
+	cat->shadow_region = r;
+	cat->shadow_generation = rec[r].generation;
+	*offset += r * size + sizeof(shadow_record_t);
+	return 1;
+}
+
 error_code_t explicit_load_category(category_t *cat, char *openf, int protf) {
 	hash_count_t i, j;
 
@@ -1125,6 +1367,12 @@ error_code_t explicit_load_category(category_t *cat, char *openf, int protf) {
 			return 0;
 		}
 
+		if( (cat->c_options & (1<<C_OPTION_SHADOW)) &&
+				!select_shadow_region(cat, input) ) {
+			fclose(input);
+			return 0;
+		}
+
 #ifdef DEBUG
 		LOG(stderr, "INPUT VALUE %ld \n", ftell(input));
 #endif
@@ -1216,6 +1464,11 @@ error_code_t nvram_explicit_load_category(category_t *cat, char *openf,
 			return 0;
 		}
 		offset = ftell(fp);
+		if( (cat->c_options & (1<<C_OPTION_SHADOW)) &&
+				!nvram_select_shadow_region(cat, start_addr, datasize, &offset) ) {
+			fclose(fp);
+			return 0;
+		}
 		/*if (!nvram_load_category_header(cat, datasize, mmap_addr, &offset)){
 			
 			LOG(stderr,"nvram_load_category_header failed \n");
@@ -1481,6 +1734,24 @@ error_code_t nvram_load_category_header(category_t *cat, size_t datasize, char *
 				if( sscanf(buf, MAGIC4_i, &lint_val1, &shint_val, &shint_val2, scratchbuf) == 4 ) {
 					cat->m_options = (options_t)lint_val1;
 				}
+			} else if( strncmp(buf, MAGIC10, strlen(MAGIC10)) == 0 ) {
+
+				cat->c_options |= (1<<C_OPTION_ROBINHOOD);
+
+			} else if( strncmp(buf, MAGIC11, strlen(MAGIC11)) == 0 ) {
+
+				cat->c_options |= (1<<C_OPTION_SHADOW);
+
+			} else if( strncmp(buf, MAGIC12, 12) == 0 ) {
+
+				if( (sscanf(buf, MAGIC12, &cat->id_width) < 1) ||
+						((cat->id_width != 32) && (cat->id_width != 64) &&
+								(cat->id_width != NATIVE_ID_WIDTH)) ) {
+					errormsg(E_ERROR, "unsupported hash width in %s\n",
+							cat->fullfilename);
+					return 0;
+				}
+
 			}
 
 			LOG(stderr, "OFFSET %d \n", *offset);
@@ -1576,6 +1847,23 @@ error_code_t open_category(category_t *cat) {
 	return explicit_load_category(cat, (char *)"r+b", PROT_READ|PROT_WRITE);
 }
 
+/* reads only the headers of a category and, if it has shadow regions,
+   which one is active. That's all shadow_save_learner() needs */
+error_code_t open_category_header(category_t *cat) {
+	FILE *input;
+	error_code_t ok;
+
+	input = fopen(cat->fullfilename, "rb");
+	if( !input ) {
+		return 0;
+	}
+	ok = load_category_header(input, cat) &&
+		(!(cat->c_options & (1<<C_OPTION_SHADOW)) || 
+		 select_shadow_region(cat, input));
+	fclose(input);
+	return ok;
+}
+
 error_code_t reload_category(category_t *cat) {
 	if( cat ) {
 		/* myfree the hash, but keep the cat->fullfilename */
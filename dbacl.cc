@@ -57,6 +57,11 @@
 #include <time.h>
 #include <locale.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/file.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
 
 #if defined HAVE_LANGINFO_H
 #include <langinfo.h>
@@ -70,6 +75,11 @@
 #include "util.h"
 #include "dbacl.h" /* make sure this is last */
 #include "nvmalloc_wrap.h"
+#include "nv_map.h"
+
+#if defined SSE2_PROBE
+#include <emmintrin.h>
+#endif
 
 #include <sys/mman.h>
 
@@ -105,6 +115,7 @@ struct MAPLIST maplist_arr[256];
 int temp_file;
 int online_fd;
 extern size_t region_size;
+extern size_t output_size;
 
 extern signal_cleanup_t cleanup;
 
@@ -137,7 +148,6 @@ extern char *extn;
 extern token_order_t ngram_order; /* defaults to 1 */
 
 /* for counting emails */
-bool_t not_header; 
 extern MBOX_State mbox;
 extern XML_State xml;
 
@@ -156,6 +166,14 @@ int exit_code = 0; /* default */
 
 int overflow_warning = 0;
 int digramic_overflow_warning = 0;
+/* the -l learner, when -Y models are learned alongside it. It alone
+   counts digrams, the models get a copy of its digrams */
+learner_t *main_learner = NULL;
+extra_model_t extra_models[MAX_EXTRA_MODELS];
+int extra_model_count = 0;
+token_order_t main_ngram_order = 1;
+/* the instance of hash_word_and_learn_t() for the options */
+learn_word_fun_t learn_word = hash_word_and_learn;
 int skewed_constraints_warning = 0;
 
 extern long system_pagesize;
@@ -168,6 +186,11 @@ extern unsigned long learner_write_bytes;
 extern unsigned long learner_read_bytes;
 extern long glob_read_time;
 extern unsigned int hash_tokens;
+extern unsigned long learner_probe_hist[PROBE_HISTOGRAM];
+extern unsigned long minimize_iterations;
+extern unsigned long lambda_cache_seeded;
+extern long optimize_time;
+extern unsigned long minimize_fallbacks;
 #endif
 
 /* tolerance for the error in divergence - this can be changed with -q.
@@ -182,6 +205,9 @@ double qtol_lam = CLIP_LAMBDA_TOL(0.05);
 double qtol_logz = 0.05;
 bool_t qtol_multipass = 0;
 
+/* number of threads used for learning, can be changed with -J */
+int learn_threads = 1;
+
 
 
 /***********************************************************
@@ -204,9 +230,9 @@ static void usage(/*@unused@*/ char **argv) {
   LOG(stderr, 
 	  "\n");
   LOG(stderr, 
-	  "dbacl [-vnirNDL] [-h size] [-T type] -l CATEGORY \n");
+	  "dbacl [-vnirNDLKOBbkWC] [-h size] [-J threads] [-T type] -l CATEGORY \n");
   LOG(stderr, 
-	  "      [-g regex]... [FILE]...\n");
+	  "      [-Y order:bits:smoothing:CATEGORY]... [-g regex]... [FILE]...\n");
   LOG(stderr, 
 	  "\n");
   LOG(stderr, 
@@ -301,7 +327,7 @@ void line_score_categories(char *textbuf) {
       if( *textbuf ) {
 	for(i = 0; i < cat_count; i++) {
 	  if( u_options & (1<<U_OPTION_VERBOSE) ) {
-	    LOG(stdout, "%s %6.2" FMT_printf_score_t " * %-4.1f ", 
+	    LOG(stdout, "%s %6.2" FMT_printf_score_t " * %-4.1" FMT_printf_score_t " ", 
 		    cat[i].filename, 
 		    -nats2bits(cat[i].score/cat[i].complexity), 
 		    cat[i].complexity);
@@ -416,13 +442,13 @@ void score_categories() {
       if( u_options & (1<<U_OPTION_VERBOSE) ) {
 	if( u_options & (1<<U_OPTION_VAR) ) {
 	  LOG(stdout, "%s ( %5.2" FMT_printf_score_t 
-		  " # %5.2" FMT_printf_score_t " )* %-.1f ", 
+		  " # %5.2" FMT_printf_score_t " )* %-.1" FMT_printf_score_t " ", 
 		  cat[i].filename, 
 		  -nats2bits(cat[i].score/cat[i].complexity),
 		  nats2bits(sqrt(cat[i].score_s2/cat[i].complexity)),
 		  cat[i].complexity);
 	} else {
-	  LOG(stdout, "%s %5.2" FMT_printf_score_t " * %-.1f ", 
+	  LOG(stdout, "%s %5.2" FMT_printf_score_t " * %-.1" FMT_printf_score_t " ", 
 		  cat[i].filename, 
 		  -nats2bits(cat[i].score/cat[i].complexity),
 		  cat[i].complexity);
@@ -450,7 +476,7 @@ void score_categories() {
 	  }
 	  LOG(stdout, "%s %5.2" FMT_printf_score_t " ", 
 		  cat[i].filename, 
-		  (double)cat[i].model_full_token_count/cat[i].model_num_docs);
+		  (score_t)cat[i].model_full_token_count/cat[i].model_num_docs);
 	}
       }
       if( !no_title ) { LOG(stdout, "\n"); }
@@ -471,7 +497,7 @@ void score_categories() {
 	    LOG(stdout, " # %5.2" FMT_printf_score_t,
 		    nats2bits(sqrt(cat[i].score_s2/cat[i].complexity)));
 	  }
-	  LOG(stdout, " )* %-6.1f", cat[i].complexity);
+	  LOG(stdout, " )* %-6.1" FMT_printf_score_t, cat[i].complexity);
 	  if( u_options & (1<<U_OPTION_CONFIDENCE) ) {
 	    LOG(stdout, " @ %5.1f%% ", 
 		    (float)gamma_pvalue(&cat[i], cat[i].score_div)/10);
@@ -608,6 +634,10 @@ bool_t myrename(const char *src, const char *dest) {
 }
 
 
+/* with shadow regions, the statistics which change on each save live
+   in the region records, and the header only carries zeros */
+#define HEADER_STAT(x) ((u_options & (1<<U_OPTION_SHADOW)) ? 0 : (x))
+
 bool_t write_category_headers(learner_t *learner, FILE *output) {
   regex_count_t c;
   char scratchbuf[MAGIC_BUFSIZE];
@@ -627,21 +657,22 @@ bool_t write_category_headers(learner_t *learner, FILE *output) {
 		 (m_options & (1<<M_OPTION_REFMODEL)) ? "(ref)" : ""));
   ok = ok &&
     (0 < fprintf(output, 
-		 MAGIC2_o, learner->divergence, learner->logZ, 
+		 MAGIC2_o, HEADER_STAT(learner->divergence), 
+		 HEADER_STAT(learner->logZ), 
 		 (short int)learner->max_order,
 		 (m_options & (1<<M_OPTION_MULTINOMIAL)) ? "multinomial" : "hierarchical" ));
   ok = ok &&
     (0 < fprintf(output, MAGIC3, 
 		 (short int)learner->max_hash_bits, 
-		 (long int)learner->full_token_count, 
-		 (long int)learner->unique_token_count,
-		 (long int)(learner->doc.count)));
+		 (long int)HEADER_STAT(learner->full_token_count), 
+		 (long int)HEADER_STAT(learner->unique_token_count),
+		 (long int)HEADER_STAT(learner->doc.count)));
 
   ok = ok &&
     (0 < fprintf(output, MAGIC8_o,
-		 learner->shannon, 
-		 learner->alpha, learner->beta,
-		 learner->mu, learner->s2));
+		 HEADER_STAT(learner->shannon), 
+		 HEADER_STAT(learner->alpha), HEADER_STAT(learner->beta),
+		 HEADER_STAT(learner->mu), HEADER_STAT(learner->s2)));
 
   /* print out any regexes we might need */
   for(c = 0; c < regex_count; c++) {
@@ -663,6 +694,18 @@ bool_t write_category_headers(learner_t *learner, FILE *output) {
     (0 < fprintf(output, MAGIC4_o, m_options, 
 		 print_model_options(m_options, scratchbuf)));
 
+  /* the learner hash is saved slot for slot, so it keeps its order */
+  ok = ok &&
+    (0 < fprintf(output, MAGIC10));
+
+  ok = ok &&
+    (0 < fprintf(output, MAGIC12, NATIVE_ID_WIDTH));
+
+  if( u_options & (1<<U_OPTION_SHADOW) ) {
+    ok = ok &&
+      (0 < fprintf(output, MAGIC11));
+  }
+
   ok = ok &&
     (0 < fprintf(output, MAGIC6)); 
 
@@ -729,7 +772,8 @@ bool_t nvram_write_category_headers(learner_t *learner, FILE *output, char *inpu
   ok = ok &&
   (0 <
   sprintf(buffer1,
-                 MAGIC2_o, learner->divergence, learner->logZ,
+                 MAGIC2_o, HEADER_STAT(learner->divergence), 
+                 HEADER_STAT(learner->logZ),
                  (short int)learner->max_order,
                  (m_options & (1<<M_OPTION_MULTINOMIAL)) ? "multinomial" : "hierarchical" ));
 
@@ -739,9 +783,9 @@ bool_t nvram_write_category_headers(learner_t *learner, FILE *output, char *inpu
    ok = ok &&
    (0 < sprintf(buffer2, MAGIC3,
                  (short int)learner->max_hash_bits,
-                 (long int)learner->full_token_count,
-                 (long int)learner->unique_token_count,
-                 (long int)(learner->doc.count)));
+                 (long int)HEADER_STAT(learner->full_token_count),
+                 (long int)HEADER_STAT(learner->unique_token_count),
+                 (long int)HEADER_STAT(learner->doc.count)));
 
   strcat(buffer9,buffer2);
 
@@ -749,9 +793,9 @@ bool_t nvram_write_category_headers(learner_t *learner, FILE *output, char *inpu
   ok = ok &&
    (0 <
    sprintf(buffer3, MAGIC8_o,
-                 learner->shannon,
-                 learner->alpha, learner->beta,
-                 learner->mu, learner->s2));
+                 HEADER_STAT(learner->shannon),
+                 HEADER_STAT(learner->alpha), HEADER_STAT(learner->beta),
+                 HEADER_STAT(learner->mu), HEADER_STAT(learner->s2)));
 
 
    strcat(buffer9,buffer3);
@@ -789,6 +833,16 @@ bool_t nvram_write_category_headers(learner_t *learner, FILE *output, char *inpu
 
     strcat(buffer9,buffer7);
 
+  /* the learner hash is saved slot for slot, so it keeps its order */
+    strcat(buffer9,MAGIC10);
+
+    sprintf(buffer10, MAGIC12, NATIVE_ID_WIDTH);
+    strcat(buffer9,buffer10);
+
+    if( u_options & (1<<U_OPTION_SHADOW) ) {
+      strcat(buffer9,MAGIC11);
+    }
+
 
   ok = ok &&
     (0 < sprintf(buffer8, MAGIC6));
@@ -811,18 +865,286 @@ bool_t nvram_write_category_headers(learner_t *learner, FILE *output, char *inpu
   typedef weight_t myweight_t;
 #endif
 
+void *convert_items_fun(void *arg) {
+  convert_job_t *job = (convert_job_t *)arg;
+  c_item_t *ci = job->out;
+  hash_count_t t;
+
+  for(t = job->lo; t < job->hi; t++, ci++) {
+    /* write each element so that it's easy to read back in a
+       c_item_t array */
+    SET(ci->id,job->learner->hash[t].id);
+    ci->lam = job->learner->hash[t].lam;
+
+    ci->id = HTON_ID(ci->id);
+    ci->lam = HTON_LAMBDA(ci->lam);
+  }
+  return NULL;
+}
+
+/* fills out[] with the slots lo..hi-1 in category file format, using up
+   to learn_threads threads */
+void convert_learner_items(learner_t *learner, c_item_t *out,
+			   hash_count_t lo, hash_count_t hi) {
+  convert_job_t job[MAX_LEARN_THREADS];
+  pthread_t tid[MAX_LEARN_THREADS];
+  int n, t;
+
+  n = ((hi - lo) < MINIMIZE_THREADED_MIN) ? 1 : learn_threads;
+  for(t = 0; t < n; t++) {
+    job[t].learner = learner;
+    job[t].lo = lo + (hash_count_t)(((unsigned long long)(hi - lo) * t)/n);
+    job[t].hi = lo + (hash_count_t)(((unsigned long long)(hi - lo) * (t + 1))/n);
+    job[t].out = out + (job[t].lo - lo);
+  }
+  for(t = 1; t < n; t++) {
+    if( 0 != pthread_create(&tid[t], NULL, convert_items_fun, &job[t]) ) {
+      convert_items_fun(&job[t]);
+      job[t].learner = NULL;
+    }
+  }
+  convert_items_fun(&job[0]);
+  for(t = 1; t < n; t++) {
+    if( job[t].learner ) {
+      pthread_join(tid[t], NULL);
+    }
+  }
+}
+
+/* writes all the iovecs, coping with short writes */
+static bool_t writev_all(int fd, struct iovec *iov, int iovcnt) {
+  ssize_t n;
+
+  while( iovcnt > 0 ) {
+    n = writev(fd, iov, iovcnt);
+    if( n < 0 ) {
+      if( errno == EINTR ) {
+	continue;
+      }
+      return 0;
+    }
+#ifdef STATS
+    learner_write_bytes += n;
+#endif
+    for(; (iovcnt > 0) && ((size_t)n >= iov->iov_len); iov++, iovcnt--) {
+      n -= iov->iov_len;
+    }
+    if( iovcnt > 0 ) {
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  return 1;
+}
+
+/* writes the digrams and the token weights after the headers, in
+   blocks of SAVE_BLOCK_ITEMS slots. The output is the same as writing
+   each c_item_t in turn. If sum isn't NULL, the shadow checksum of the
+   output is chained onto it. */
+static bool_t write_learner_arrays(learner_t *learner, FILE *output, 
+				   u_int32_t *sum) {
+  static myweight_t shval[ASIZE * ASIZE];
+  c_item_t small[1024];
+  c_item_t *block;
+  hash_count_t t, m, b;
+  alphabet_size_t i, j;
+  struct iovec iov[2];
+  int k;
+  bool_t ok = 1;
+
+  if( fflush(output) != 0 ) {
+    return 0;
+  }
+
+  /* character frequencies */
+  for(i = 0; i < ASIZE; i++) {
+    for(j = 0; j < ASIZE; j++) {
+      shval[i * ASIZE + j] = HTON_DIGRAM(PACK_DIGRAMS(learner->dig[i][j]));
+    }
+  }
+
+  m = (learner->max_tokens < SAVE_BLOCK_ITEMS) ? 
+    learner->max_tokens : SAVE_BLOCK_ITEMS;
+  block = (c_item_t *)malloc(m * sizeof(c_item_t));
+  if( !block ) {
+    block = small;
+    m = sizeof(small)/sizeof(c_item_t);
+  }
+
+  MADVISE(learner->hash, sizeof(l_item_t) * learner->max_tokens,
+	  MADV_SEQUENTIAL|MADV_WILLNEED);
+
+  /* token/feature weights, the digrams go out with the first block */
+  k = 0;
+  iov[k].iov_base = shval;
+  iov[k++].iov_len = ASIZE * ASIZE * SIZEOF_DIGRAMS;
+  for(t = 0; ok && ((t < learner->max_tokens) || (k > 0)); t += b) {
+    b = ((learner->max_tokens - t) < m) ? (learner->max_tokens - t) : m;
+    if( b > 0 ) {
+      convert_learner_items(learner, block, t, t + b);
+      iov[k].iov_base = block;
+      iov[k++].iov_len = b * sizeof(c_item_t);
+    }
+    if( sum ) {
+      for(int h = 0; h < k; h++) {
+	*sum = shadow_checksum((byte_t *)iov[h].iov_base, iov[h].iov_len, *sum);
+      }
+    }
+    ok = writev_all(fileno(output), iov, k);
+    k = 0;
+  }
+
+  if( block != small ) {
+    free(block);
+  }
+  return ok;
+}
+
+static void fill_shadow_record(shadow_record_t *rec, u_int32_t gen,
+			       learner_t *learner, u_int32_t sum) {
+  memset(rec, 0, sizeof(*rec));
+  rec->magic = SHADOW_MAGIC;
+  rec->generation = gen;
+  rec->divergence = learner->divergence;
+  rec->logZ = learner->logZ;
+  rec->shannon = learner->shannon;
+  rec->alpha = learner->alpha;
+  rec->beta = learner->beta;
+  rec->mu = learner->mu;
+  rec->s2 = learner->s2;
+  rec->full_token_count = learner->full_token_count;
+  rec->unique_token_count = learner->unique_token_count;
+  rec->num_docs = learner->doc.count;
+  rec->checksum = shadow_record_checksum(rec, sum);
+}
+
+/* writes both regions of a new category after its headers: region 0
+   holds the model, region 1 is left without a valid record */
+static bool_t write_shadow_regions(learner_t *learner, FILE *output) {
+  shadow_record_t rec;
+  size_t size = SHADOW_REGION_SIZE(learner->max_tokens, sizeof(c_item_t));
+  u_int32_t sum = 0;
+  long base;
+
+  memset(&rec, 0, sizeof(rec));
+  if( (fflush(output) != 0) || ((base = ftell(output)) < 0) ||
+      (fwrite(&rec, sizeof(rec), 1, output) != 1) ||
+      !write_learner_arrays(learner, output, &sum) ) {
+    return 0;
+  }
+  fill_shadow_record(&rec, 1, learner, sum);
+  /* the data must be on disk before the record which vouches for it */
+  return (fdatasync(fileno(output)) == 0) &&
+    (pwrite(fileno(output), &rec, sizeof(rec), base) == 
+     (ssize_t)sizeof(rec)) &&
+    (ftruncate(fileno(output), (off_t)(base + 2 * size)) == 0);
+}
+
+/* writes n bytes at offset off, but only the pages which don't
+   already hold them. old is scratch space of BUFSIZ * 16 bytes. */
+static bool_t write_changed_pages(int fd, const byte_t *p, size_t n, 
+				  off_t off, byte_t *old) {
+  size_t m, q, r, page = (size_t)system_pagesize;
+  ssize_t got;
+
+  while( n > 0 ) {
+    m = BUFSIZ * 16 - (size_t)(off % page);
+    m = (n < m) ? n : m;
+    got = pread(fd, old, m, off);
+    for(q = 0; q < m; q += r) {
+      r = page - (size_t)((off + q) % page);
+      r = (m - q < r) ? (m - q) : r;
+      if( ((ssize_t)(q + r) > got) || memcmp(old + q, p + q, r) ) {
+	if( pwrite(fd, p + q, r, off + q) != (ssize_t)r ) {
+	  return 0;
+	}
+#ifdef STATS
+	learner_write_bytes += r;
+#endif
+      }
+    }
+    p += m;
+    off += m;
+    n -= m;
+  }
+  return 1;
+}
+
+/* overwrites the inactive region of a category with shadow regions,
+   then makes it the active one by writing its record last. If we
+   crash before the record is on disk, the old region stays valid. */
+static error_code_t shadow_save_learner(learner_t *learner, category_t *xcat) {
+  static myweight_t shval[ASIZE * ASIZE];
+  shadow_record_t rec;
+  size_t size = SHADOW_REGION_SIZE(learner->max_tokens, sizeof(c_item_t));
+  c_item_t *block;
+  byte_t *old;
+  hash_count_t t, m, b;
+  alphabet_size_t i, j;
+  u_int32_t sum;
+  off_t base, off;
+  int fd;
+  bool_t ok;
+
+  m = (learner->max_tokens < SAVE_BLOCK_ITEMS) ? 
+    learner->max_tokens : SAVE_BLOCK_ITEMS;
+  block = (c_item_t *)malloc(m * sizeof(c_item_t));
+  old = (byte_t *)malloc(BUFSIZ * 16);
+  fd = open(learner->filename, O_RDWR);
+  ok = block && old && (fd != -1);
+
+  base = xcat->shadow_offset + (1 - xcat->shadow_region) * (off_t)size;
+  off = base + sizeof(shadow_record_t);
+
+  for(i = 0; i < ASIZE; i++) {
+    for(j = 0; j < ASIZE; j++) {
+      shval[i * ASIZE + j] = HTON_DIGRAM(PACK_DIGRAMS(learner->dig[i][j]));
+    }
+  }
+  sum = shadow_checksum((byte_t *)shval, ASIZE * ASIZE * SIZEOF_DIGRAMS, 0);
+  ok = ok && 
+    write_changed_pages(fd, (byte_t *)shval, ASIZE * ASIZE * SIZEOF_DIGRAMS, 
+			off, old);
+  off += ASIZE * ASIZE * SIZEOF_DIGRAMS;
+
+  for(t = 0; ok && (t < learner->max_tokens); t += b) {
+    b = ((learner->max_tokens - t) < m) ? (learner->max_tokens - t) : m;
+    convert_learner_items(learner, block, t, t + b);
+    sum = shadow_checksum((byte_t *)block, b * sizeof(c_item_t), sum);
+    ok = write_changed_pages(fd, (byte_t *)block, b * sizeof(c_item_t), 
+			     off, old);
+    off += b * sizeof(c_item_t);
+  }
+
+  /* the region must be complete before its record says so */
+  ok = ok && (fdatasync(fd) == 0);
+  if( ok ) {
+    fill_shadow_record(&rec, xcat->shadow_generation + 1, learner, sum);
+    ok = (pwrite(fd, &rec, sizeof(rec), base) == (ssize_t)sizeof(rec)) &&
+      (fdatasync(fd) == 0);
+  }
+
+  if( fd != -1 ) { close(fd); }
+  if( block ) { free(block); }
+  if( old ) { free(old); }
+
+  if( !ok ) {
+    errormsg(E_WARNING, "could not update %s in place\n", learner->filename);
+  } else if( u_options & (1<<U_OPTION_VERBOSE) ) {
+    LOG(stdout, "updating region %d of category file %s\n",
+	1 - xcat->shadow_region, learner->filename);
+  }
+  return ok;
+}
+
 error_code_t save_learner(learner_t *learner) {
 
   alphabet_size_t i, j;
-  hash_count_t t;
   FILE *output;
   char *tempname = NULL;
 
   bool_t ok;
-  size_t n;
-  c_item_t ci;
   c_item_t *ci_ptr;
-  myweight_t shval;
   myweight_t *shval_ptr = NULL;
 
   long mmap_offset = 0;
@@ -846,7 +1168,8 @@ error_code_t save_learner(learner_t *learner) {
      Also, we don't try to create the file - if the file doesn't exist,
      we won't gain much time by using mmap on that single occasion. */
   //NVRAM changesdangerous
-  if( *online && (u_options & (1<<U_OPTION_MMAP)) )
+  if( *online && (u_options & (1<<U_OPTION_MMAP)) &&
+      !(u_options & (1<<U_OPTION_SHADOW)) )
   {
     ok = (bool_t)0;
     //output = fopen(learner->filename, "r+b");
@@ -911,16 +1234,7 @@ error_code_t save_learner(learner_t *learner) {
       /* token/feature weights */
       ci_ptr = (c_item_t *)(mmap_start + mmap_offset +
                             (ASIZE * ASIZE * SIZEOF_DIGRAMS));
-      for(t = 0; t < learner->max_tokens; t++) {
-        /* write each element so that it's easy to read back in a
-           c_item_t array */
-        SET(ci_ptr->id,learner->hash[t].id);
-        ci_ptr->lam = learner->hash[t].lam;
-
-        ci_ptr->id = HTON_ID(ci_ptr->id);
-        ci_ptr->lam = HTON_LAMBDA(ci_ptr->lam);
-        ci_ptr++;
-      }
+      convert_learner_items(learner, ci_ptr, 0, learner->max_tokens);
 
     skip_mmap:
       fclose(output);
@@ -953,57 +1267,12 @@ error_code_t save_learner(learner_t *learner) {
     }
     ok = ok && write_category_headers(learner, output);
     /* end of readable stuff */
-    if( ok ) {
-      /* now write arrays: this is far(!) from efficient, but the bits
-         we need are not nicely tucked into a block of memory, and due
-         to the sizes involved when dealing with possibly millions of tokens, we
-         can't afford to mymymalloc a brand new block just to pack everything 
-         nicely. At least, the file buffering should mitigate the performance
-         hit, and we prefer to learn slowly and classify fast. */
-
-      /* character frequencies */
-      for(i = 0; i < ASIZE; i++) {
-        for(j = 0; j < ASIZE; j++) {
-          shval = HTON_DIGRAM(PACK_DIGRAMS(learner->dig[i][j]));
-          // LOG(stderr,"learner->dig[i][j] %u \n", PACK_DIGRAMS(learner->dig[i][j]));	 
-          for(n = 0; n < 1; ) {
-#ifdef STATS
-            learner_write_bytes += SIZEOF_DIGRAMS;
-#endif
-            if( 0 > (n = fwrite(&shval, SIZEOF_DIGRAMS, (size_t)1, output)) ) {
-              ok = 0;
-              goto skip_remaining;
-            }
-          }
-        }
-      }
-
-      MADVISE(learner->hash, sizeof(l_item_t) * learner->max_tokens,
-              MADV_SEQUENTIAL|MADV_WILLNEED);
-
-      /* token/feature weights */
-      for(t = 0; t < learner->max_tokens; t++) {
-        /* write each element so that it's easy to read back in a c_item_t array */
-        SET(ci.id,learner->hash[t].id);
-        ci.lam = learner->hash[t].lam;
-
-        ci.id = HTON_ID(ci.id);
-        ci.lam = HTON_LAMBDA(ci.lam);
-
-        for(n = 0; n < 1; ) {
-
-#ifdef STATS
-            learner_write_bytes += sizeof(ci); 
-#endif
-        if( 0 > (n = fwrite(&ci, sizeof(ci), (size_t)1, output)) ) {
-            ok = 0;
-            goto skip_remaining;
-          }
-        }
-      }
+    if( u_options & (1<<U_OPTION_SHADOW) ) {
+      ok = ok && write_shadow_regions(learner, output);
+    } else {
+      ok = ok && write_learner_arrays(learner, output, NULL);
     }
 
-  skip_remaining:
 
     fclose(output);
 
@@ -1031,6 +1300,86 @@ error_code_t save_learner(learner_t *learner) {
 }
 
 
+/* copies n bytes to q, skipping the pages which already hold them */
+static void copy_changed_pages(byte_t *q, const byte_t *p, size_t n) {
+  size_t r, page = (size_t)system_pagesize;
+
+  for(; n > 0; p += r, q += r, n -= r) {
+    r = page - (size_t)((unsigned long)q % page);
+    r = (n < r) ? n : r;
+    if( memcmp(q, p, r) ) {
+      memcpy(q, p, r);
+#ifdef STATS
+      learner_write_bytes += r;
+#endif
+    }
+  }
+}
+
+/* as write_shadow_regions(), for the mapped output. If the output
+   already holds this category, only its inactive region is written,
+   and then its record. */
+static bool_t nvram_write_shadow_regions(learner_t *learner, byte_t *start,
+					 char *hdr, int len) {
+  static myweight_t shval[ASIZE * ASIZE];
+  shadow_record_t rec;
+  category_t xcat;
+  size_t size = SHADOW_REGION_SIZE(learner->max_tokens, sizeof(c_item_t));
+  long offset = len;
+  c_item_t *block;
+  byte_t *q;
+  hash_count_t t, m, b;
+  alphabet_size_t i, j;
+  u_int32_t sum, gen = 0;
+  int r = 0;
+
+  m = (learner->max_tokens < SAVE_BLOCK_ITEMS) ? 
+    learner->max_tokens : SAVE_BLOCK_ITEMS;
+  block = (c_item_t *)malloc(m * sizeof(c_item_t));
+  if( !block ) {
+    return 0;
+  }
+
+  if( memcmp(start, hdr, (size_t)len) == 0 ) {
+    memset(&xcat, 0, sizeof(xcat));
+    xcat.fullfilename = learner->filename;
+    xcat.max_tokens = learner->max_tokens;
+    if( nvram_select_shadow_region(&xcat, (char *)start, output_size, &offset) ) {
+      r = 1 - xcat.shadow_region;
+      gen = xcat.shadow_generation;
+    }
+  } else {
+    memcpy(start, hdr, (size_t)len);
+    memset(start + len + size, 0, sizeof(shadow_record_t));
+  }
+
+  q = start + len + r * size + sizeof(shadow_record_t);
+  for(i = 0; i < ASIZE; i++) {
+    for(j = 0; j < ASIZE; j++) {
+      shval[i * ASIZE + j] = HTON_DIGRAM(PACK_DIGRAMS(learner->dig[i][j]));
+    }
+  }
+  sum = shadow_checksum((byte_t *)shval, ASIZE * ASIZE * SIZEOF_DIGRAMS, 0);
+  copy_changed_pages(q, (byte_t *)shval, ASIZE * ASIZE * SIZEOF_DIGRAMS);
+  q += ASIZE * ASIZE * SIZEOF_DIGRAMS;
+
+  for(t = 0; t < learner->max_tokens; t += b) {
+    b = ((learner->max_tokens - t) < m) ? (learner->max_tokens - t) : m;
+    convert_learner_items(learner, block, t, t + b);
+    sum = shadow_checksum((byte_t *)block, b * sizeof(c_item_t), sum);
+    copy_changed_pages(q, (byte_t *)block, b * sizeof(c_item_t));
+    q += b * sizeof(c_item_t);
+  }
+  free(block);
+
+  /* the region must be complete before its record says so */
+  fill_shadow_record(&rec, gen + 1, learner, sum);
+  __sync_synchronize();
+  memcpy(start + len + r * size, &rec, sizeof(rec));
+  __sync_synchronize();
+  return 1;
+}
+
 /* writes the learner to a file for easily readable category */
 /* the category file is first constructed as a temporary file,
    then renamed if no problems occured. Because renames are 
@@ -1039,15 +1388,11 @@ error_code_t save_learner(learner_t *learner) {
 error_code_t nvram_save_learner(learner_t *learner) {
 
   alphabet_size_t i, j;
-  hash_count_t t;
   FILE *output;
   char *tempname = NULL;
 
   bool_t ok;
-  size_t n;
-  c_item_t ci;
   c_item_t *ci_ptr;
-  myweight_t shval;
   myweight_t *shval_ptr = NULL;
 
   long mmap_offset = 0;
@@ -1063,6 +1408,14 @@ error_code_t nvram_save_learner(learner_t *learner) {
   if( u_options & (1<<U_OPTION_VERBOSE) ) {
     LOG(stdout, "saving category to file %s\n", learner->filename);
   }
+
+  if( (u_options & (1<<U_OPTION_SHADOW)) &&
+      (2048 + 2 * SHADOW_REGION_SIZE(learner->max_tokens, sizeof(c_item_t)) > output_size) ) {
+    errormsg(E_WARNING, 
+	     "no room for shadow regions in the output, writing %s once\n",
+	     learner->filename);
+    u_options &= ~(1<<U_OPTION_SHADOW);
+  }
   
   /* don't overwrite data files */
   /*if( !check_magic_write(learner->filename, (char *)MAGIC1, 10) ) {
@@ -1119,6 +1472,11 @@ error_code_t nvram_save_learner(learner_t *learner) {
       //MADVISE(mmap_start, mmap_length, MADV_SEQUENTIAL|MADV_WILLNEED);
       //LOG(stderr, "mmap_len %d, mmap_length %d buff_alloc %s\n",mmap_len,mmap_length, buff_alloc);
 
+      if( u_options & (1<<U_OPTION_SHADOW) ) {
+        ok = nvram_write_shadow_regions(learner, mmap_start, buff_alloc, mmap_len);
+        goto skip_mmap;
+      }
+
       if(mmap_len){
 
            memcpy(mmap_start, buff_alloc, mmap_len);
@@ -1142,20 +1500,10 @@ error_code_t nvram_save_learner(learner_t *learner) {
       /* token/feature weights */
       ci_ptr = (c_item_t *)(mmap_start + mmap_offset +
                             (ASIZE * ASIZE * SIZEOF_DIGRAMS));
-      for(t = 0; t < learner->max_tokens; t++) {
-
-        /* write each element so that it's easy to read back in a
-           c_item_t array */
-        SET(ci_ptr->id,learner->hash[t].id);
-        ci_ptr->lam = learner->hash[t].lam;
-
-        ci_ptr->id = HTON_ID(ci_ptr->id);
-        ci_ptr->lam = HTON_LAMBDA(ci_ptr->lam);
-        ci_ptr++;
+      convert_learner_items(learner, ci_ptr, 0, learner->max_tokens);
 #ifdef STATS
-            learner_write_bytes += sizeof(ci_ptr);
+      learner_write_bytes += sizeof(c_item_t) * learner->max_tokens;
 #endif
-      }
 
 
     skip_mmap:
@@ -1193,49 +1541,12 @@ error_code_t nvram_save_learner(learner_t *learner) {
     ok = ok && write_category_headers(learner, output);
 
     /* end of readable stuff */
-    if( ok ) {
-      /* now write arrays: this is far(!) from efficient, but the bits
-	 we need are not nicely tucked into a block of memory, and due
-	 to the sizes involved when dealing with possibly millions of tokens, we
-	 can't afford to mymymalloc a brand new block just to pack everything 
-	 nicely. At least, the file buffering should mitigate the performance
-	 hit, and we prefer to learn slowly and classify fast. */
-
-      /* character frequencies */
-      for(i = 0; i < ASIZE; i++) {
-	for(j = 0; j < ASIZE; j++) {
-	  shval = HTON_DIGRAM(PACK_DIGRAMS(learner->dig[i][j]));
-	  for(n = 0; n < 1; ) {
-	    if( 0 > (n = fwrite(&shval, SIZEOF_DIGRAMS, (size_t)1, output)) ) {
-	      ok = 0;
-	      goto skip_remaining;
-	    } 
-	  }	    
-	}
-      }
-
-      MADVISE(learner->hash, sizeof(l_item_t) * learner->max_tokens, 
-	      MADV_SEQUENTIAL|MADV_WILLNEED);
-
-      /* token/feature weights */
-      for(t = 0; t < learner->max_tokens; t++) {
-	/* write each element so that it's easy to read back in a c_item_t array */
-	SET(ci.id,learner->hash[t].id);
-	ci.lam = learner->hash[t].lam;
-
-	ci.id = HTON_ID(ci.id);
-	ci.lam = HTON_LAMBDA(ci.lam);
-
-	for(n = 0; n < 1; ) {
-	  if( 0 > (n = fwrite(&ci, sizeof(ci), (size_t)1, output)) ) {
-	    ok = 0;
-	    goto skip_remaining;
-	  } 
-	}
-      }
+    if( u_options & (1<<U_OPTION_SHADOW) ) {
+      ok = ok && write_shadow_regions(learner, output);
+    } else {
+      ok = ok && write_learner_arrays(learner, output, NULL);
     }
 
-  skip_remaining:
 #ifdef DEBUG
     LOG(stderr,"Closing output file \n");
 #endif
@@ -1287,6 +1598,23 @@ error_code_t fast_partial_save_learner(learner_t *learner, category_t *xcat) {
   c_item_t *ci_ptr;
   myweight_t *shval_ptr;
 
+  /* the header of a category with shadow regions never changes, and
+     the data must only ever go to the inactive region */
+  if( xcat->id_width != NATIVE_ID_WIDTH ) {
+    return 0;
+  } else if( xcat->c_options & (1<<C_OPTION_SHADOW) ) {
+    if( (u_options & (1<<U_OPTION_SHADOW)) &&
+	(xcat->m_options == learner->m_options) &&
+	(xcat->max_order == learner->max_order) &&
+	(xcat->max_hash_bits == learner->max_hash_bits) &&
+	(xcat->max_tokens == learner->max_tokens) ) {
+      return shadow_save_learner(learner, xcat);
+    }
+    return 0;
+  } else if( u_options & (1<<U_OPTION_SHADOW) ) {
+    return 0;
+  }
+
   if( xcat->mmap_start && 
       (xcat->m_options == learner->m_options) &&
       (xcat->max_order == learner->max_order) &&
@@ -1421,7 +1749,22 @@ size_t tmp_read_block(learner_t *learner, byte_t *buf, size_t bufsiz,
 /* must unmap/ftruncate/remap if using mmap, don't touch mmap_cursor */
 bool_t tmp_grow(learner_t *learner) {
   long offset;
-  if( learner->tmp.file &&
+  byte_t *arena;
+  if( learner->tmp.arena &&
+      ((learner->tmp.used + 2 * MAX_TOKEN_LEN) >= learner->tmp.avail) ) {
+    arena = (byte_t *)realloc(learner->tmp.arena, 
+			      learner->tmp.avail + TOKEN_LIST_GROW);
+    if( !arena ) {
+      errormsg(E_FATAL,
+	       "not enough memory? I couldn't allocate %li bytes\n",
+	       (long int)(learner->tmp.avail + TOKEN_LIST_GROW));
+    }
+    learner->tmp.avail += TOKEN_LIST_GROW;
+    learner->tmp.arena = arena;
+    learner->tmp.mmap_start = arena;
+    learner->tmp.mmap_length = learner->tmp.avail;
+    return (bool_t)1;
+  } else if( learner->tmp.file &&
       ((learner->tmp.used + 2 * MAX_TOKEN_LEN) >= learner->tmp.avail) ) {
 
     if( learner->tmp.mmap_start ) {
@@ -1509,6 +1852,11 @@ void tmp_write_token(learner_t *learner, const char *tok) {
 }
 
 void tmp_close(learner_t *learner) {
+  if( learner->tmp.arena ) {
+    free(learner->tmp.arena);
+    learner->tmp.arena = NULL;
+    learner->tmp.mmap_start = NULL;
+  }
   if( learner->tmp.mmap_start ) {
     //MUNLOCK(learner->tmp.mmap_start, learner->tmp.mmap_length);
     //MUNMAP(learner->tmp.mmap_start, learner->tmp.mmap_length);
@@ -1550,6 +1898,7 @@ bool_t emplist_grow(emplist_t *emp) {
 	   "disabling emp.stack. Not enough memory? I couldn't allocate %li bytes\n", 
 	   (sizeof(l_item_t *) * ((long int)emp->max) * 2));
   m_options &= ~(1<<M_OPTION_CALCENTROPY);
+  learn_word = select_learn_word();
 
   return 0;
 }
@@ -1599,7 +1948,38 @@ void emplist_add_to_reservoir(emplist_t *reservoir, document_count_t docno,
 /***********************************************************
  * LEARNER FUNCTIONS                                       *
  ***********************************************************/
+/* releases the table left behind by grow_learner_hash(). If the
+   online dump was mmapped, that's the table which was mapped.
+   Otherwise the table came from mymalloc() or calloc(), and must
+   be free()d: myfree() doesn't release anything. */
+void myfree_old_learner_hash(learner_t *learner) {
+  if( learner->old.hash ) {
+    if( learner->mmap_start != NULL ) {
+      MUNMAP(learner->mmap_start, 
+	     learner->mmap_hash_offset + 
+	     learner->old.max_tokens * sizeof(l_item_t));
+      learner->mmap_start = NULL;
+      learner->mmap_learner_offset = 0;
+      learner->mmap_hash_offset = 0;
+    } else {
+      if( u_options & (1<<U_OPTION_MMAP) ) {
+	MUNLOCK(learner->old.hash, 
+		sizeof(l_item_t) * learner->old.max_tokens);
+      }
+      free(learner->old.hash);
+    }
+    learner->old.hash = NULL;
+  }
+  if( learner->old.ids ) {
+    free(learner->old.ids);
+    learner->old.ids = NULL;
+  }
+  learner->old.max_tokens = 0;
+  learner->old.cursor = 0;
+}
+
 void myfree_learner_hash(learner_t *learner) {
+  myfree_old_learner_hash(learner);
   if( learner->hash ) {
     if( learner->mmap_start != NULL ) {
       MUNMAP(learner->mmap_start, 
@@ -1610,10 +1990,100 @@ void myfree_learner_hash(learner_t *learner) {
       learner->hash = NULL;
     }
     if( learner->hash ) {
-      myfree(learner->hash);
+      free(learner->hash);
       learner->hash = NULL;
     }
   }
+  if( learner->ids ) {
+    free(learner->ids);
+    learner->ids = NULL;
+  }
+  myfree_order_index(learner);
+  myfree_ref_cache(learner);
+  if( learner->mins ) {
+    free(learner->mins);
+    learner->mins = NULL;
+  }
+  if( learner->side.item ) {
+    free(learner->side.item);
+  }
+  memset(&learner->side, 0, sizeof(learner->side));
+}
+
+/* learner->order_index lists the filled hash slots, grouped by token
+   order: the slots of order r are order_index[order_start[r]] up to
+   order_index[order_start[r+1] - 1]. The minimization passes walk this
+   instead of the (mostly empty) hash. The index is stale as soon as
+   the hash changes. */
+void build_order_index(learner_t *learner) {
+  hash_count_t c, n;
+  token_order_t r;
+
+  myfree_order_index(learner);
+  learner->order_index = (hash_count_t *)
+    malloc((learner->unique_token_count + 1) * sizeof(hash_count_t));
+  if( !learner->order_index ) {
+    /* the passes fall back on scanning the hash */
+    return;
+  }
+
+  for(r = 0; r <= MAX_SUBMATCH; r++) {
+    learner->order_start[r] = 0;
+  }
+  for(c = 0; c < learner->max_tokens; c++) {
+    if( FILLEDP(&learner->hash[c]) && 
+	(learner->hash[c].typ.order < MAX_SUBMATCH) ) {
+      learner->order_start[learner->hash[c].typ.order + 1]++;
+    }
+  }
+  for(r = 1; r <= MAX_SUBMATCH; r++) {
+    learner->order_start[r] += learner->order_start[r - 1];
+  }
+  if( learner->order_start[MAX_SUBMATCH] > learner->unique_token_count ) {
+    /* shouldn't happen, but don't write past the end */
+    myfree_order_index(learner);
+    return;
+  }
+  for(c = 0; c < learner->max_tokens; c++) {
+    if( FILLEDP(&learner->hash[c]) && 
+	(learner->hash[c].typ.order < MAX_SUBMATCH) ) {
+      r = learner->hash[c].typ.order;
+      n = learner->order_start[r]++;
+      learner->order_index[n] = c;
+    }
+  }
+  /* the fill loop moved each start to the next one */
+  for(r = MAX_SUBMATCH; r > 0; r--) {
+    learner->order_start[r] = learner->order_start[r - 1];
+  }
+  learner->order_start[0] = 0;
+}
+
+void myfree_order_index(learner_t *learner) {
+  if( learner->order_index ) {
+    free(learner->order_index);
+    learner->order_index = NULL;
+  }
+}
+
+/* learner->ids mirrors learner->hash[].id, so that probing only
+   touches 4 bytes per slot. It must be rebuilt whenever the hash
+   is loaded or resized. */
+void build_learner_ids(learner_t *learner) {
+  hash_count_t c;
+  hash_value_t *ids;
+
+  ids = (hash_value_t *)realloc(learner->ids, 
+				learner->max_tokens * sizeof(hash_value_t));
+  if( !ids ) {
+    errormsg(E_FATAL,
+	     "not enough memory? I couldn't allocate %li bytes\n",
+	     (sizeof(hash_value_t) * ((long int)learner->max_tokens)));
+  }
+  for(c = 0; c < learner->max_tokens; c++) {
+    ids[c] = learner->hash[c].id;
+  }
+  learner->ids = ids;
 }
 
 bool_t create_learner_hash(learner_t *learner, FILE *input) {
@@ -1644,6 +2114,15 @@ bool_t create_learner_hash(learner_t *learner, FILE *input) {
       /* first we overwrite the learner struct with the contents of
 	 the mmapped region */
       memcpy(learner, mmap_start + mmap_learner_offset, sizeof(learner_t));
+      learner->ids = NULL; /* stale pointers from the dump */
+      learner->order_index = NULL;
+      memset(&learner->ref, 0, sizeof(learner->ref));
+      learner->mins = NULL;
+      memset(&learner->side, 0, sizeof(learner->side));
+      learner->tmp.arena = NULL;
+      memset(&learner->old, 0, sizeof(learner->old));
+      memset(&learner->admit, 0, sizeof(learner->admit));
+      learner->doc.not_header = 1; /* the new input starts afresh */
       
       MUNMAP(mmap_start, mmap_hash_offset);
 
@@ -1683,6 +2162,16 @@ bool_t create_learner_hash(learner_t *learner, FILE *input) {
 	return 0;
       }
     }
+    learner->hash = NULL; /* stale pointers from the dump */
+    learner->ids = NULL;
+    learner->order_index = NULL;
+    memset(&learner->ref, 0, sizeof(learner->ref));
+    learner->mins = NULL;
+    memset(&learner->side, 0, sizeof(learner->side));
+    learner->tmp.arena = NULL;
+    memset(&learner->old, 0, sizeof(learner->old));
+    memset(&learner->admit, 0, sizeof(learner->admit));
+    learner->doc.not_header = 1; /* the new input starts afresh */
 
     /* allocate hash table normally */
     learner->hash = (l_item_t *)mymalloc(learner->max_tokens * sizeof(l_item_t));
@@ -1707,16 +2196,39 @@ bool_t create_learner_hash(learner_t *learner, FILE *input) {
     }
 
   }
+  if( learner->hash ) {
+    build_learner_ids(learner);
+  }
   return (learner->hash != NULL);
 }
 
+/* moves up to step slots of the previous table into the current one.
+   The previous table is left untouched until it is released, so
+   find_in_learner() can still look up the slots we haven't reached. */
+void migrate_learner_hash(learner_t *learner, hash_count_t step) {
+  hash_count_t c;
+  l_item_t *i;
+
+  while( learner->old.hash && (step-- > 0) ) {
+    c = learner->old.cursor++;
+    if( FILLEDP(&learner->old.hash[c]) ) {
+      i = insert_in_learner(learner, learner->old.hash[c].id);
+      /* guaranteed to succeed since hash is larger than original */
+      memcpy(i, &learner->old.hash[c], sizeof(l_item_t));
+    }
+    if( learner->old.cursor >= learner->old.max_tokens ) {
+      myfree_old_learner_hash(learner);
+    }
+  }
+}
+
 /* returns true if the hash could be grown, false otherwise.
-   When the hash is grown, the old values must be redistributed.
-   To do this, we reuse the l_item.lam member as a flag, since this
-   is only needed later during minimization */
+   Growing only allocates a table of twice the size, the old
+   values are redistributed a few at a time by migrate_learner_hash()
+   as more tokens are learned, so that no single token pays for the
+   whole table. */
 bool_t grow_learner_hash(learner_t *learner) {
-  hash_count_t c, new_size;
-  l_item_t *i, temp_item;
+  l_item_t *i;
 
   if( !(u_options & (1<<U_OPTION_GROWHASH)) ) {
     return 0;
@@ -1732,101 +2244,35 @@ bool_t grow_learner_hash(learner_t *learner) {
 
       */
 
-      /* there are two cases - if learner is mmapped, we must mymalloc a
-       * new hash, otherwise we can realloc. An easy way to reduce the
-       * first case to the second is to create a throwaway hash with
-       * the old size and copy the mmapped contents to it. 
-       */
-      if( learner->mmap_start ) {
-	if( (i = (l_item_t *)mymalloc(learner->max_tokens * 
-				    sizeof(l_item_t))) == NULL ) {
-	  errormsg(E_WARNING,
-		   "failed to mymalloc hash table for growing.\n");
-	  return 0;
-	}
-	memcpy(i, learner->hash, sizeof(l_item_t) * learner->max_tokens);
-	myfree_learner_hash(learner);
-	learner->hash = i;
-
-	/* there's a MUNLOCK call below, so in theory we should
-	   balance this out by calling MLOCK here, since the i pointed
-	   region was never locked. However mlock/munlock calls do not nest,
-	   so there's no need. 
-	*/
-/* 	if( u_options & (1<<U_OPTION_MMAP) ) { */
-/* 	  MLOCK(learner->hash, sizeof(l_item_t) * learner->max_tokens); */
-/* 	} */
-      }
-
-
-      if( u_options & (1<<U_OPTION_MMAP) ) {
-	MUNLOCK(learner->hash, sizeof(l_item_t) * learner->max_tokens);
+      /* we can only keep one old table around */
+      if( learner->old.hash ) {
+	migrate_learner_hash(learner, learner->old.max_tokens);
       }
 
-      /* grow the memory around the hash */
-      if( (i = (l_item_t *)realloc(learner->hash, 
-		       sizeof(l_item_t) * 
-		       (1<<(learner->max_hash_bits+1)))) == NULL ) {
+      if( (i = (l_item_t *)calloc((1<<(learner->max_hash_bits+1)), 
+				  sizeof(l_item_t))) == NULL ) {
 	errormsg(E_WARNING,
 		"failed to grow hash table.\n");
 	return 0;
       }
-      /* we need the old value of learner->max_tokens for a while yet */
+
+      learner->old.hash = learner->hash;
+      learner->old.ids = learner->ids;
+      learner->old.max_tokens = learner->max_tokens;
+      learner->old.cursor = 0;
+
+      learner->hash = i; 
+      learner->ids = NULL;
       learner->max_hash_bits++;
+      learner->max_tokens = (1<<learner->max_hash_bits);
+      build_learner_ids(learner);
 
       if( u_options & (1<<U_OPTION_MMAP) ) {
-	MLOCK(i, sizeof(l_item_t) * (1<<learner->max_hash_bits));
+	MLOCK(i, sizeof(l_item_t) * learner->max_tokens);
       }
 
-      MADVISE(i, sizeof(l_item_t) * (1<<learner->max_hash_bits), MADV_SEQUENTIAL);
-
-      /* realloc doesn't initialize the memory */
-      memset(&((l_item_t *)i)[learner->max_tokens], 0, 
-	     ((1<<learner->max_hash_bits) - learner->max_tokens) * 
-	     sizeof(l_item_t));
-      learner->hash = i; 
-      
-      /* now mark every used slot */
-      for(c = 0; c < learner->max_tokens; c++) {
-	if( FILLEDP(&learner->hash[c]) ) {
-	  SETMARK(&learner->hash[c]);
-	}
-      }
+      MADVISE(i, sizeof(l_item_t) * learner->max_tokens, MADV_RANDOM);
 
-      MADVISE(i, sizeof(l_item_t) * (1<<learner->max_hash_bits), MADV_RANDOM);
-
-      /* now relocate each marked slot and clear it */
-      new_size = (1<<learner->max_hash_bits) - 1;
-      for(c = 0; c < learner->max_tokens; c++) {
-	while( MARKEDP(&learner->hash[c]) ) {
-	  /* find where it belongs */
-	  i = &learner->hash[learner->hash[c].id & new_size];
-	  while( FILLEDP(i) && !MARKEDP(i) ) {
-	    i++;
-	    i = (i > &learner->hash[new_size]) ? learner->hash : i;
-	  } /* guaranteed to exit since hash is larger than original */
-
-	  /* clear the mark - this must happen after we look for i,
-	   since it should be possible to find i == learner->hash[c] */
-	  UNSETMARK(&learner->hash[c]); 
-
-	  /* now refile */
-	  if( i != &learner->hash[c] ) {
-	    if( MARKEDP(i) ) {
-	      /* swap */
-	      memcpy(&temp_item, i, sizeof(l_item_t));
-	      memcpy(i, &learner->hash[c], sizeof(l_item_t));
-	      memcpy(&learner->hash[c], &temp_item, sizeof(l_item_t));
-	    } else {
-	      /* copy and clear */
-	      memcpy(i, &learner->hash[c], sizeof(l_item_t));
-	      memset(&learner->hash[c], 0, sizeof(l_item_t));
-	    }
-	  } 
-	  /* now &learner->hash[c] is marked iff there was a swap */
-	}
-      }
-      learner->max_tokens = (1<<learner->max_hash_bits);
     } else {
       u_options &= ~(1<<U_OPTION_GROWHASH); /* it's the law */
       errormsg(E_WARNING,
@@ -1855,11 +2301,7 @@ bool_t read_online_learner_struct(learner_t *learner, char *path) {
    * it mmap()s it for speed. Note we open for read/write, because the
    * file might be left open and reused later.
    */
-#ifdef NVRAM
-
-#else
-  input = fopen(path, "r+b");
-#endif
+  input = fopen(path, "r+b");
 
   if( input ) {
 
@@ -2143,25 +2585,123 @@ token_count_t binomial(token_count_t n, double p) {
   return x;
 }
 
+/* the side table holds the document statistics of each token seen,
+   keyed by id so it needn't follow the items around the hash. It is
+   an open addressing table of side.max items, at most half full.
+   side_reserve() makes room for n more tokens, and must be called
+   before side_in_learner(), which never grows the table */
+bool_t side_reserve(learner_t *learner, hash_count_t n) {
+  hash_count_t j, k, m;
+  l_side_t *t;
+
+  if( 2 * (learner->side.count + n) <= learner->side.max ) {
+    return 1;
+  }
+  m = learner->side.max ? learner->side.max : SIDE_MIN_ITEMS;
+  while( 2 * (learner->side.count + n) > m ) {
+    m *= 2;
+  }
+  t = (l_side_t *)calloc(m, sizeof(l_side_t));
+  if( !t ) {
+    return 0;
+  }
+  for(j = 0; j < learner->side.max; j++) {
+    if( FILLEDP(&learner->side.item[j]) ) {
+      for(k = learner->side.item[j].id & (m - 1); FILLEDP(&t[k]); 
+	  k = (k + 1) & (m - 1)) {
+	/* empty loop */
+      }
+      t[k] = learner->side.item[j];
+    }
+  }
+  if( learner->side.item ) {
+    free(learner->side.item);
+  }
+  learner->side.item = t;
+  learner->side.max = m;
+  return 1;
+}
+
+l_side_t *side_in_learner(learner_t *learner, hash_value_t id) {
+  hash_count_t k, mask = learner->side.max - 1;
+  l_side_t *s;
+
+  for(k = id & mask; ; k = (k + 1) & mask) {
+    s = &learner->side.item[k];
+    if( !FILLEDP(s) ) {
+      SET(s->id, id);
+      learner->side.count++;
+      return s;
+    } else if( EQUALP(s->id, id) ) {
+      return s;
+    }
+  }
+}
+
+l_side_t *find_side_in_learner(learner_t *learner, hash_value_t id) {
+  hash_count_t k, mask = learner->side.max - 1;
+  l_side_t *s;
+
+  if( learner->side.max == 0 ) {
+    return NULL;
+  }
+  for(k = id & mask; ; k = (k + 1) & mask) {
+    s = &learner->side.item[k];
+    if( !FILLEDP(s) ) {
+      return NULL;
+    } else if( EQUALP(s->id, id) ) {
+      return s;
+    }
+  }
+}
+
+/* side items of the current document's features */
+static l_side_t **emp_side = NULL;
+static hash_count_t emp_side_max = 0;
+
 void update_shannon_partials(learner_t *learner) {
   hash_count_t i;
   weight_t ell, lell;
+  l_side_t **np, *s;
 
   if( m_options & (1<<M_OPTION_CALCENTROPY) ) {
 
     learner->doc.emp.shannon = 0;
     if( learner->doc.emp.top > 0 ) {
-      /* assume all marks are zero to start with */
+      if( emp_side_max < learner->doc.emp.top ) {
+	np = (l_side_t **)realloc(emp_side, 
+				  learner->doc.emp.max * sizeof(l_side_t *));
+	if( np ) {
+	  emp_side = np;
+	  emp_side_max = learner->doc.emp.max;
+	}
+      }
+      if( (emp_side_max < learner->doc.emp.top) ||
+	  !side_reserve(learner, learner->doc.emp.top) ) {
+	errormsg(E_WARNING,
+		 "disabling document statistics, not enough memory.\n");
+	m_options &= ~(1<<M_OPTION_CALCENTROPY);
+	learn_word = select_learn_word();
+	learner->doc.emp.top = 0;
+	return;
+      }
+
+      /* every occurrence of a feature is on the stack */
+      for(i = 0; i < learner->doc.emp.top; i++) {
+	emp_side[i] = side_in_learner(learner, learner->doc.emp.stack[i]);
+	emp_side[i]->eff++;
+      }
+
       for(i = 0; i < learner->doc.emp.top; i++) {
-	l_item_t *p = find_in_learner(learner, learner->doc.emp.stack[i]);
-	if( p && !MARKEDP(p) ) {
-	  ell = ((weight_t)p->tmp.read.eff)/learner->doc.emp.top;
+	s = emp_side[i];
+	if( s->eff > 0 ) {
+	  ell = ((weight_t)s->eff)/learner->doc.emp.top;
 
-	  /* it would be nice to be able to digitize p->B, but ell is
+	  /* it would be nice to be able to digitize s->B, but ell is
 	     often smaller than the smallest value, and if there are
 	     many documents, there could simultaneously be overflow on the most
-	     frequent features. So we need p->B to be a floating point type. */
-	  p->B += ell;
+	     frequent features. So we need s->B to be a floating point type. */
+	  s->B += ell;
 
 	  /* the standard entropy convention is that 0*inf = 0. here, if
 	   * ell is so small that log(ell) is infinite, we pretend ell
@@ -2174,7 +2714,8 @@ void update_shannon_partials(learner_t *learner) {
 	    learner->doc.emp.shannon += ell * lell;
 	  }
 
-	  SETMARK(p);
+	  /* clears the empirical count, and counts the feature once */
+	  s->eff = 0;
 	}
       }
 
@@ -2182,15 +2723,6 @@ void update_shannon_partials(learner_t *learner) {
 			       learner->doc.count, 
 			       &learner->doc.emp);
 
-      /* clear the empirical counts and marks */
-      for(i = 0; i < learner->doc.emp.top; i++) {
-	l_item_t *p = find_in_learner(learner, learner->doc.emp.stack[i]);
-	if( p && MARKEDP(p) ) {
-	  p->tmp.read.eff = 0;
-	  UNSETMARK(p);
-	}
-      }
-
       learner->doc.A += -learner->doc.emp.shannon;
     }
 
@@ -2200,8 +2732,45 @@ void update_shannon_partials(learner_t *learner) {
   }
 }
 
-void calc_shannon(learner_t *learner) {
+/* the hash sums of calc_shannon(). This is always one sequential
+   loop, even with -J: the entropy and confidence statistics must not
+   depend on the number of threads, and a partitioned sum would round
+   differently from the serial one. */
+static void shannon_pass(shannon_job_t *job) {
+  learner_t *learner = job->learner;
   l_item_t *i, *e;
+  l_side_t *q;
+  double Lambda;
+  score_t mu = 0.0, jensen = 0.0, shannon = 0.0;
+
+  e = learner->hash + learner->max_tokens;
+  if( job->calcentropy ) {
+    for(i = learner->hash; i != e; i++) {
+      if( NOTNULL(i->lam) && (q = find_side_in_learner(learner, i->id)) ) {
+	Lambda = UNPACK_LAMBDA(i->lam);
+	if( i->typ.order == 1 ) {
+	  Lambda += UNPACK_RWEIGHTS(MINVARS(learner, i).dref) - learner->logZ;
+	}
+	mu += (Lambda * q->B);
+	jensen += (Lambda * Lambda * q->B);
+      }
+    }
+  } else {
+    for(i = learner->hash; i != e; i++) {
+      if( FILLEDP(i) && 
+	  (i->typ.order == learner->max_order) ) {
+	shannon += log((weight_t)i->count) * (weight_t)i->count; 
+      }
+    }
+  }
+  job->mu = mu;
+  job->jensen = jensen;
+  job->shannon = shannon;
+}
+
+void calc_shannon(learner_t *learner) {
+  l_item_t *i;
+  shannon_job_t job;
   document_count_t c, n;
   hash_count_t q;
   emplist_t *empl;
@@ -2220,20 +2789,15 @@ void calc_shannon(learner_t *learner) {
 
     effective_count = learner->doc.count;
     /* shannon was computed during update */
-    jensen = 0.0;
-    e = learner->hash + learner->max_tokens;
-    for(i = learner->hash; i != e; i++) {
-      if( NOTNULL(i->lam) ) {
-	Lambda = UNPACK_LAMBDA(i->lam);
-	if( i->typ.order == 1 ) {
-	  Lambda += UNPACK_RWEIGHTS(i->tmp.min.dref) - learner->logZ;
-	}
-	learner->mu += (Lambda * i->B);
-	jensen += (Lambda * Lambda * i->B);
-      }
-    }
-
-    learner->mu /= effective_count;
+    job.learner = learner;
+    job.calcentropy = 1;
+    shannon_pass(&job);
+    learner->mu = job.mu;
+    jensen = job.jensen;
+
+    /* the side table only covers the documents since it was loaded */
+    learner->mu /= (learner->side.docs > 0) ? 
+      (score_t)learner->side.docs : effective_count;
     learner->shannon = -(learner->doc.A/effective_count);
     learner->mu = -(learner->shannon + learner->mu);
 
@@ -2252,7 +2816,7 @@ void calc_shannon(learner_t *learner) {
 	  if( i && NOTNULL(i->lam) ) {
 	    Lambda = UNPACK_LAMBDA(i->lam);
 	    if( i->typ.order == 1 ) {
-	      Lambda += UNPACK_RWEIGHTS(i->tmp.min.dref) - learner->logZ;
+	      Lambda += UNPACK_RWEIGHTS(MINVARS(learner, i).dref) - learner->logZ;
 	    }
 	    score += Lambda;
 	  }
@@ -2290,14 +2854,10 @@ void calc_shannon(learner_t *learner) {
 
   } else {
 
-    learner->shannon = 0.0;
-    e = learner->hash + learner->max_tokens;
-    for(i = learner->hash; i != e; i++) {
-      if( FILLEDP(i) && 
-	  (i->typ.order == learner->max_order) ) {
-	learner->shannon += log((weight_t)i->count) * (weight_t)i->count; 
-      }
-    }
+    job.learner = learner;
+    job.calcentropy = 0;
+    shannon_pass(&job);
+    learner->shannon = job.shannon;
     learner->shannon = 
       -( learner->shannon/learner->full_token_count -
 	 log((weight_t)learner->full_token_count) );
@@ -2322,13 +2882,16 @@ void calc_shannon(learner_t *learner) {
 }
 
 void reset_mbox_messages(learner_t *learner, MBOX_State *mbox) {
-  not_header = 1;
+  learner->doc.not_header = 1;
   learner->doc.count = 0;
   learner->doc.nullcount = 0; /* first header doesn't count */
   learner->doc.skip = 0;
 }
 
-void count_mbox_messages(learner_t *learner, Mstate mbox_state, char *textbuf) {
+/* skip is the -D decision for a document starting on this line, it
+   is made once for all the models */
+void count_mbox_messages(learner_t *learner, Mstate mbox_state, char *textbuf,
+			 bool_t skip) {
 
   if( !textbuf ) { 
     update_shannon_partials(learner);
@@ -2336,10 +2899,8 @@ void count_mbox_messages(learner_t *learner, Mstate mbox_state, char *textbuf) {
   } else {
     switch(mbox_state) {
     case msHEADER:
-      if(not_header) {
-	if( u_options & (1<<U_OPTION_DECIMATE) ) {
-	  learner->doc.skip = ( rand() > (int)(RAND_MAX>>decimation) );
-	} 
+      if(learner->doc.not_header) {
+	learner->doc.skip = skip;
 	if( !learner->doc.skip ) {
 	  if( m_options & (1<<M_OPTION_CALCENTROPY) &&
 	      (learner->doc.emp.top == 0) ) {
@@ -2347,12 +2908,13 @@ void count_mbox_messages(learner_t *learner, Mstate mbox_state, char *textbuf) {
 	  }
 	  update_shannon_partials(learner);
 	  learner->doc.count++;
+	  learner->side.docs++;
 	}
       }
-      not_header = 0;
+      learner->doc.not_header = 0;
       break;
     default:
-      not_header = 1;
+      learner->doc.not_header = 1;
       break;
     }
   }
@@ -2360,40 +2922,292 @@ void count_mbox_messages(learner_t *learner, Mstate mbox_state, char *textbuf) {
 }
 
 
-l_item_t *find_in_learner(learner_t *learner, hash_value_t id) {
-    register l_item_t *i, *loop;
-    /* start at id */
-    i = loop = &learner->hash[id & (learner->max_tokens - 1)];
+/* probes a learner table through its ids array, which holds the same
+   keys as the table but is much denser. Tables are kept in Robin Hood
+   order (see insert_in_learner()), so a probe can stop as soon as it
+   meets a slot whose occupant is closer to its home than we are to ours.
+   Returns NULL if id isn't in the table. */
+static l_item_t *probe_learner_ids(hash_value_t *ids, l_item_t *hash,
+				   hash_count_t max_tokens, hash_value_t id) {
+    hash_count_t k, n, mask;
+#if defined SSE2_PROBE
+    __m128i key, zero, v;
+    int m;
+
+    key = _mm_set1_epi32((int)id);
+    zero = _mm_setzero_si128();
+#endif
 
-    while( FILLEDP(i) ) {
-	if( EQUALP(i->id,id) ) {
-	    return i; /* found id */
-	} else {
-	    i++; /* not found */
-	    /* wrap around */
-	    i = (i >= &learner->hash[learner->max_tokens]) ? learner->hash : i; 
-	    if( i == loop ) {
-		return NULL; /* when hash table is full */
+    /* start at id */
+    mask = max_tokens - 1;
+    k = id & mask;
+    /* the caller nearly always touches the slot next, most often the
+       home slot, so fetch it while we look at the ids */
+    __builtin_prefetch(&hash[k], 1);
+
+    for(n = 0; n < max_tokens; ) {
+#if defined SSE2_PROBE
+	if( k + 4 <= max_tokens ) {
+	    v = _mm_loadu_si128((__m128i *)&ids[k]);
+	    m = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi32(v, key),
+					       _mm_cmpeq_epi32(v, zero)));
+	    if( m ) {
+		/* four mask bits per id */
+		k += (__builtin_ctz(m)>>2);
+		n += (__builtin_ctz(m)>>2);
+		LEARNER_PROBE_STATS(n);
+		return ids[k] ? &hash[k] : NULL;
 	    }
+	    /* it's enough to check the displacement of the last id */
+	    if( PROBE_DISTANCE(k + 3, ids[k + 3], mask) < n + 3 ) {
+		LEARNER_PROBE_STATS(n + 3);
+		return NULL;
+	    }
+	    k = (k + 4) & mask;
+	    n += 4;
+	    continue;
+	}
+#endif
+	if( !ids[k] || (PROBE_DISTANCE(k, ids[k], mask) < n) ) {
+	    LEARNER_PROBE_STATS(n);
+	    return NULL; /* not found */
+	} else if( EQUALP(ids[k],id) ) {
+	    LEARNER_PROBE_STATS(n);
+	    return &hash[k]; /* found id */
 	}
+	/* wrap around */
+	k = (k + 1) & mask;
+	n++;
+    }
+
+    return NULL; /* when hash table is full */
+}
+
+l_item_t *find_in_learner(learner_t *learner, hash_value_t id) {
+  l_item_t *i;
+
+  i = probe_learner_ids(learner->ids, learner->hash, learner->max_tokens, id);
+  if( !i && learner->old.hash ) {
+    /* while growing, id may not have been migrated yet */
+    i = probe_learner_ids(learner->old.ids, learner->old.hash, 
+			  learner->old.max_tokens, id);
+  }
+  return i;
+}
+
+/* inserts id, which must not already be in the table, and returns
+   the (zeroed) slot it was given, or NULL when the table is full.
+   This is Robin Hood insertion: whenever the item being placed has
+   travelled further from its home than the occupant of a slot, they
+   swap places and we carry on with the occupant. This keeps probe
+   lengths short and nearly uniform even at HASH_FULL load. */
+l_item_t *insert_in_learner(learner_t *learner, hash_value_t id) {
+  hash_count_t k, n, d, e, mask;
+  hash_value_t cid;
+  l_item_t carry, temp_item;
+  l_item_t *slot = NULL;
+
+  if( learner->unique_token_count >= learner->max_tokens ) {
+    return NULL;
+  }
+
+  mask = learner->max_tokens - 1;
+  k = id & mask;
+  cid = id;
+  memset(&carry, 0, sizeof(l_item_t));
+  SET(carry.id,id);
+
+  for(n = d = 0; n < learner->max_tokens; n++, d++) {
+    if( !learner->ids[k] ) {
+      memcpy(&learner->hash[k], &carry, sizeof(l_item_t));
+      learner->ids[k] = cid;
+      return slot ? slot : &learner->hash[k];
+    }
+    e = PROBE_DISTANCE(k, learner->ids[k], mask);
+    if( e < d ) {
+      /* swap */
+      memcpy(&temp_item, &learner->hash[k], sizeof(l_item_t));
+      memcpy(&learner->hash[k], &carry, sizeof(l_item_t));
+      memcpy(&carry, &temp_item, sizeof(l_item_t));
+      learner->ids[k] = cid;
+      cid = carry.id;
+      /* the first swap is where the new item comes to rest */
+      slot = slot ? slot : &learner->hash[k];
+      d = e;
+    }
+    k = (k + 1) & mask;
+  }
+
+  return NULL; /* not reached, the table has a free slot */
+}
+
+/* the -B sketch rows must hash independently, or colliding ids
+   collide in every row. Each row scrambles the id with its own seed */
+static const u_int32_t admit_seeds[ADMIT_SKETCH_DEPTH] = {
+  0x9e3779b1U, 0x7f4a7c15U, 0xf39cc060U, 0x5ced1a93U
+};
+
+static hash_count_t admit_row_slot(hash_value_t id, int d) {
+  u_int32_t x = (u_int32_t)id ^ admit_seeds[d];
+
+  x ^= x >> 16;
+  x *= 0x85ebca6bU;
+  x ^= x >> 13;
+  x *= 0xc2b2ae35U;
+  x ^= x >> 16;
+  return (d<<ADMIT_SKETCH_BITS) + (x >> (32 - ADMIT_SKETCH_BITS));
+}
+
+/* removes the item in slot k, shifting the items after it back
+   towards their home slots so no tombstone is needed */
+static void delete_in_learner(learner_t *learner, hash_count_t k) {
+  hash_count_t n, mask;
+
+  mask = learner->max_tokens - 1;
+  for(n = (k + 1) & mask; 
+      learner->ids[n] && (PROBE_DISTANCE(n, learner->ids[n], mask) > 0);
+      n = (n + 1) & mask) {
+    memcpy(&learner->hash[k], &learner->hash[n], sizeof(l_item_t));
+    learner->ids[k] = learner->ids[n];
+    k = n;
+  }
+  memset(&learner->hash[k], 0, sizeof(l_item_t));
+  learner->ids[k] = 0;
+}
+
+/* called for an id which doesn't fit in the full learner hash, n is
+   the number of new occurrences. Returns true if room was made for
+   it, in which case *prior is the estimated number of earlier
+   occurrences which the new item should be credited with. */
+bool_t admit_in_learner(learner_t *learner, hash_value_t id, 
+			token_count_t n, token_count_t *prior) {
+  token_count_t *c[ADMIT_SKETCH_DEPTH];
+  token_count_t est;
+  hash_count_t k, v, mask;
+  l_item_t *i;
+  int d;
+
+  if( !learner->admit.sketch ) {
+    learner->admit.sketch = (token_count_t *)
+      calloc(ADMIT_SKETCH_DEPTH<<ADMIT_SKETCH_BITS, sizeof(token_count_t));
+    if( !learner->admit.sketch ) {
+      u_options &= ~(1<<U_OPTION_ADMIT);
+      learn_word = select_learn_word();
+      errormsg(E_WARNING, 
+	       "not enough memory for the admission sketch, "
+	       "new tokens will be ignored.\n");
+      return 0;
+    }
+  }
+
+  /* conservative update: only raise the counters which are the minimum */
+  est = K_TOKEN_COUNT_MAX;
+  for(d = 0; d < ADMIT_SKETCH_DEPTH; d++) {
+    c[d] = learner->admit.sketch + admit_row_slot(id, d);
+    est = (*c[d] < est) ? *c[d] : est;
+  }
+  est = (est <= K_TOKEN_COUNT_MAX - n) ? est + n : K_TOKEN_COUNT_MAX;
+  for(d = 0; d < ADMIT_SKETCH_DEPTH; d++) {
+    if( *c[d] < est ) { *c[d] = est; }
+  }
+
+  /* the rarest item near the home slot */
+  mask = learner->max_tokens - 1;
+  v = learner->max_tokens;
+  for(k = id & mask; k != ((id + ADMIT_EVICT_WINDOW) & mask); k = (k + 1) & mask) {
+    if( learner->ids[k] && 
+	((v == learner->max_tokens) || (learner->hash[k].count < learner->hash[v].count)) ) {
+      v = k;
     }
+  }
+  if( (v == learner->max_tokens) || (learner->hash[v].count >= est) ) {
+    return 0;
+  }
+
+  i = &learner->hash[v];
+  learner->unique_token_count--;
+  learner->fixed_order_unique_token_count[i->typ.order]--;
+  learner->fixed_order_token_count[i->typ.order] -= i->count;
+  learner->full_token_count -= i->count;
+  delete_in_learner(learner, v);
+  learner->admit.evictions++;
+
+  *prior = est - n;
+  return 1;
+}
+
+/* after evictions the token list holds tokens which are no longer in
+   the hash, and tokens which were readmitted twice. This keeps the
+   first copy of each token still in the hash, and resets the sketch. */
+void compact_token_list(learner_t *learner) {
+  char tok[(MAX_TOKEN_LEN+1)*MAX_SUBMATCH+EXTRA_TOKEN_LEN];
+  byte_t *p, *e, *w, *t;
+  byte_t *seen;
+  l_item_t *k;
+  hash_count_t slot;
+  size_t len;
+
+  if( learner->admit.sketch ) {
+    free(learner->admit.sketch);
+    learner->admit.sketch = NULL;
+  }
+  if( !learner->admit.evictions ) {
+    return;
+  }
+  learner->admit.evictions = 0;
 
-    /* empty slot, so not found */
+  /* only the in memory list can be rewritten in place */
+  if( !learner->tmp.mmap_start || 
+      !(seen = (byte_t *)calloc(learner->max_tokens/8 + 1, 1)) ) {
+    errormsg(E_WARNING, 
+	     "could not compact the token list, results may be skewed.\n");
+    return;
+  }
+
+  p = w = learner->tmp.mmap_start + learner->tmp.mmap_offset;
+  e = p + learner->tmp.used;
+  while( p < e ) {
+    for(t = p; (t < e) && (*t != TOKENSEP); t++);
+    len = t - p;
+    if( len < sizeof(tok) ) {
+      memcpy(tok, p, len);
+      tok[len] = 0;
+      k = find_in_learner(learner, hash_full_token(tok));
+      if( k && (get_token_order(tok) == k->typ.order) ) {
+	slot = k - learner->hash;
+	if( !(seen[slot>>3] & (1<<(slot & 7))) ) {
+	  seen[slot>>3] |= (1<<(slot & 7));
+	  memmove(w, p, len);
+	  w += len;
+	  *w++ = TOKENSEP;
+	}
+      }
+    }
+    p = t + 1;
+  }
+  free(seen);
 
-    return i; 
+  learner->tmp.used = w - (learner->tmp.mmap_start + learner->tmp.mmap_offset);
+  learner->tmp.mmap_cursor = learner->tmp.mmap_offset + learner->tmp.used;
 }
 
 
 /* places the token in the global hash and writes the
    token to a temporary file for later, then updates
    the digram frequencies. Tokens have the format 
-   DIAMOND t1 DIAMOND t2 ... tn DIAMOND CLASSEP class NUL */
-void hash_word_and_learn(learner_t *learner, 
-			 char *tok, token_type_t tt, regex_count_t re) {
+   DIAMOND t1 DIAMOND t2 ... tn DIAMOND CLASSEP class NUL.
+   There is one instance for each setting of the options it tests, 
+   picked by select_learn_word(). */
+template <bool multinomial, bool calcentropy, bool decimate, 
+	  bool sortcount, bool admitting>
+static void hash_word_and_learn_t(learner_t *learner, 
+				  char *tok, token_type_t tt, regex_count_t re) {
   hash_value_t id;
   l_item_t *i;
   char *s;
   alphabet_size_t p,q;
+  token_count_t prior = 0;
+  bool_t admit = 0;
 
   for(s = tok; s && *s == DIAMOND; s++);
   if( s && (*s != EOTOKEN) ) { 
@@ -2402,43 +3216,44 @@ void hash_word_and_learn(learner_t *learner,
       return; /* for there be troubles ahead */
     }
 
-    if( m_options & (1<<M_OPTION_MULTINOMIAL) ) { tt.order = 1; }
+    if( multinomial ) { tt.order = 1; }
 
-    if( u_options & (1<<U_OPTION_DECIMATE) ) {
-      if( m_options & (1<<M_OPTION_MBOX_FORMAT) ) {
-	if( learner->doc.skip ) {
-	  return;
-	}
-      } else {
-	if( rand() > (int)(RAND_MAX>>decimation) ) {
-	  return;
-	}
-      }
+    /* without mbox format, learner_word_fun() already decimated */
+    if( decimate && learner->doc.skip ) {
+      return;
+    }
+
+    if( learner->old.hash ) {
+      migrate_learner_hash(learner, GROW_MIGRATE_STEP);
     }
 
     id = hash_full_token(tok);
+    if( sortcount && 
+	sort_count_token(id, tt, tok) ) {
+      goto count_digrams; /* counted when the runs are merged */
+    }
     i = find_in_learner(learner, id);
 
-    if( i && !FILLEDP(i) &&
+    if( !i &&
 	((100 * learner->unique_token_count) >= 
-	 (HASH_FULL * learner->max_tokens)) && grow_learner_hash(learner) ) {
-      i = find_in_learner(learner,id);
-      /* new i, go through all tests again */
+	 (HASH_FULL * learner->max_tokens)) ) {
+      grow_learner_hash(learner);
     }
 
-    if( i ) {
-
-      if( FILLEDP(i) ) {
-
-	/* redundant :-) */
+    if( admitting && !i && !learner->old.hash &&
+	((100 * learner->unique_token_count) >= 
+	 (HASH_FULL * learner->max_tokens)) ) {
+      admit = admit_in_learner(learner, id, 1, &prior);
+    }
 
-      } else if( /* !FILLEDP(i) && */
-		((100 * learner->unique_token_count) < 
-		 (HASH_FULL * learner->max_tokens) ) ) {
+    if( !i && (admit ||
+	       ((100 * learner->unique_token_count) < 
+		(HASH_FULL * learner->max_tokens))) ) {
 
-	/* fill the hash and write to file */
+      /* fill the hash and write to file */
 
-	SET(i->id,id);
+      i = insert_in_learner(learner, id);
+      if( i ) {
 
 	if( learner->unique_token_count < K_TOKEN_COUNT_MAX )
 	  { learner->unique_token_count++; } else { overflow_warning = 1; }
@@ -2462,17 +3277,26 @@ void hash_word_and_learn(learner_t *learner,
 	tmp_grow(learner); /* just in case we're full */
 	tmp_write_token(learner, tok);
       }
+    }
+
+    if( i ) {
+
+      if( prior > 0 ) {
+	/* credit the occurrences seen while it was left out */
+	i->count = (prior < K_ITEM_COUNT_MAX) ? prior : K_ITEM_COUNT_MAX;
+	learner->fixed_order_token_count[i->typ.order] += prior;
+	learner->full_token_count += prior;
+      }
 
-      if( i->count < K_TOKEN_COUNT_MAX ) { 
+      if( i->count < K_ITEM_COUNT_MAX ) { 
 	i->count++; 
+	i->dirty = 1;
 	if( learner->t_max < i->count ) {
 	  learner->t_max = i->count;
 	}
-	if( m_options & (1<<M_OPTION_CALCENTROPY) ) {
+	if( calcentropy ) {
 	  if( (learner->doc.emp.top < learner->doc.emp.max) ||
 	      emplist_grow(&learner->doc.emp) ) {
-	    i->tmp.read.eff++; /* this can never overflow before i->count */
-	    UNSETMARK(i); /* needed for calculating shannon */
 	    learner->doc.emp.stack[learner->doc.emp.top++] = i->id;
 	  }
 	}
@@ -2490,7 +3314,9 @@ void hash_word_and_learn(learner_t *learner,
 
     }
 
-    if( digramic_overflow_warning ) {
+  count_digrams:
+    if( digramic_overflow_warning ||
+	(main_learner && (learner != main_learner)) ) {
       return;
     }
 
@@ -2498,20 +3324,18 @@ void hash_word_and_learn(learner_t *learner,
     /* now update digram frequency counts */
     if( tt.order == 1 ) { /* count each token only once */
       p = *tok++;
+      s = tok;
       /* finally update character frequencies */
       while( *tok != EOTOKEN ) {
 	q = (unsigned char)*tok;
-	if( learner->dig[p][q] < K_DIGRAM_COUNT_MAX ) 
-	  { learner->dig[p][q]++; } else { digramic_overflow_warning = 1; }
+	learner->digrams.count[p][q]++;
 	p = q;
 	tok++;
       }
 
-      if( digramic_overflow_warning ) {
-	errormsg(E_WARNING,
-		"ran out of integers (too much data), "
-		"reference measure may be skewed.\n");
-	m_options |= (1<<M_OPTION_WARNING_BAD);
+      learner->digrams.pending += (tok - s);
+      if( learner->digrams.pending >= DIGRAM_FLUSH_COUNT ) {
+	flush_digram_counts(learner);
       }
     }
 
@@ -2524,132 +3348,1083 @@ void hash_word_and_learn(learner_t *learner,
   }
 }
 
+#define LEARN_WORD_INSTANCES(m,c,d) \
+  hash_word_and_learn_t<m,c,d,false,false>, \
+  hash_word_and_learn_t<m,c,d,false,true>, \
+  hash_word_and_learn_t<m,c,d,true,false>, \
+  hash_word_and_learn_t<m,c,d,true,true>
+
+static learn_word_fun_t const learn_word_funs[32] = {
+  LEARN_WORD_INSTANCES(false,false,false), LEARN_WORD_INSTANCES(false,false,true),
+  LEARN_WORD_INSTANCES(false,true,false), LEARN_WORD_INSTANCES(false,true,true),
+  LEARN_WORD_INSTANCES(true,false,false), LEARN_WORD_INSTANCES(true,false,true),
+  LEARN_WORD_INSTANCES(true,true,false), LEARN_WORD_INSTANCES(true,true,true)
+};
+
+/* picks the instance of hash_word_and_learn_t() for the current
+   options. It must be picked again whenever one of them changes. */
+learn_word_fun_t select_learn_word() {
+  return learn_word_funs[((m_options & (1<<M_OPTION_MULTINOMIAL)) ? 16 : 0) +
+			 ((m_options & (1<<M_OPTION_CALCENTROPY)) ? 8 : 0) +
+			 ((u_options & (1<<U_OPTION_DECIMATE)) ? 4 : 0) +
+			 ((u_options & (1<<U_OPTION_SORTCOUNT)) ? 2 : 0) +
+			 ((u_options & (1<<U_OPTION_ADMIT)) ? 1 : 0)];
+}
 
+void hash_word_and_learn(learner_t *learner, 
+			 char *tok, token_type_t tt, regex_count_t re) {
+  select_learn_word()(learner, tok, tt, re);
+}
 
-/* initialize global learner object */
-void init_learner(learner_t *learner) {
-  alphabet_size_t i, j;
-  regex_count_t c;
-  token_order_t z;
-
-  /* some constants */
-   learner->max_tokens = default_max_tokens;
-  learner->max_hash_bits = default_max_hash_bits;
-  learner->full_token_count = 0;
-  learner->unique_token_count = 0;
-  learner->t_max = 0;
-  learner->b_count = 0;
-  learner->logZ = 0.0;
-  learner->shannon = 0.0;
-  learner->alpha = 0.0;
-  learner->beta = 0.0;
-  learner->mu = 0.0;
-  learner->s2 = 0.0;
-  learner->max_order = 0;
-
-  learner->doc.A = 0.0;
-  learner->doc.C = 0.0;
-  learner->doc.count = 0;
-  learner->doc.nullcount = 0;
-  learner->doc.emp.top = 0;
-  learner->doc.emp.max = 0;
-  learner->doc.emp.stack = NULL;
-  memset(learner->doc.reservoir, 0, RESERVOIR_SIZE * sizeof(emplist_t));
 
-  learner->m_options = m_options;
-  learner->u_options = u_options;
 
-  learner->mmap_start = NULL;
-  learner->mmap_learner_offset = 0;
-  learner->mmap_hash_offset = 0;
-  learner->hash = NULL;
+/***********************************************************
+ * TOKEN INTERNING                                         *
+ ***********************************************************/
 
-  /* init character frequencies */
-  for(i = 0; i < ASIZE; i++) { 
-    for(j = 0; j < ASIZE; j++) { 
-      learner->dig[i][j] = 0.0;
-    }
-  }
+intern_table_t *interner = NULL;
 
-  for(c = 0; c < MAX_RE + 1; c++) {
-    learner->regex_token_count[c] = 0;
-  }
+/* maps a shared interner. This must be called before the category
+   learners are forked, so they all inherit the mapping. Without it,
+   build_ref_cache() hashes every suffix itself. */
+bool_t intern_init(hash_count_t slots, size_t text) {
+  size_t len;
+  byte_t *m;
 
-  for(z = 0; z < MAX_SUBMATCH; z++) {
-    learner->fixed_order_token_count[z] = 0;
-    learner->fixed_order_unique_token_count[z] = 0;
+  if( interner ) {
+    return 1;
   }
-
-  if( m_options & (1<<M_OPTION_MBOX_FORMAT) ) {
-    reset_mbox_messages(learner, &mbox);
+  len = sizeof(intern_table_t) + slots * sizeof(intern_entry_t) + text;
+  m = (byte_t *)mmap(0, len, PROT_READ|PROT_WRITE, 
+		     MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+  if( m == MAP_FAILED ) {
+    errormsg(E_WARNING, "could not map the token interner\n");
+    return 0;
   }
+  /* the mapping is already zeroed */
+  interner = (intern_table_t *)m;
+  interner->max = slots;
+  interner->text_max = text;
+  interner->entry = (intern_entry_t *)(m + sizeof(intern_table_t));
+  interner->text = (char *)(interner->entry + slots);
+  return 1;
+}
 
-  if( !(*online && read_online_learner_struct(learner,online)) ) {
-    /* if we're here, we must do what read_online_... didn't do */
-
-#ifdef DEBUG
-    LOG(stderr, "learner->max_tokens %d \n", learner->max_tokens *  sizeof(l_item_t));
-#endif
-
-    /* allocate and zero room for hash */
-    learner->hash = (l_item_t *)calloc(learner->max_tokens, sizeof(l_item_t));
-    if( !learner->hash ) {
-      errormsg(E_FATAL,
-	       "not enough memory? I couldn't allocate %li bytes\n",
-	       (sizeof(l_item_t) * ((long int)learner->max_tokens)));
-    }
+/* true if the published entry ie is the token tok of length len */
+static bool_t intern_equal(intern_entry_t *ie, hash_value_t id,
+			   const char *tok, size_t len) {
+  return (ie->id == id) && (ie->len == len) &&
+    (memcmp(interner->text + ie->text, tok, len) == 0);
+}
 
-#ifdef NVRAM
+/* waits for a slot being filled by another learner, and returns
+   its final state */
+static unsigned int intern_settled(intern_entry_t *ie) {
+  unsigned int st;
 
-   learner->tmp.file = fdopen(temp_file,"w+");
-#else
-    /* open temporary file for writing tokens */
-    learner->tmp.file = 
-      mytmpfile(learner->filename ? learner->filename : progname, 
-		&learner->tmp.filename);
-#endif
-    /* set this: in case of a fatal signal, we can unlink the temprile */
-    cleanup.tempfile = learner->tmp.filename;
+  while( (st = __atomic_load_n(&ie->state, __ATOMIC_ACQUIRE)) == INTERN_BUSY ) {
+    sched_yield();
+  }
+  return st;
+}
 
-    learner->tmp.iobuf = NULL;   /* can't reuse in_iobuf or out_iobuf */
-    learner->tmp.offset = 0;
-    learner->tmp.avail = 0;
-    learner->tmp.used = 0;
-    learner->tmp.mmap_start = NULL;
-    learner->tmp.mmap_offset = 0;
-    learner->tmp.mmap_length = 0;
-    learner->tmp.mmap_cursor = 0;
+/* returns the entry for the token tok, whose hash_full_token() is id,
+   or NULL */
+intern_entry_t *intern_find(const char *tok, hash_value_t id) {
+  hash_count_t k, n, mask;
+  size_t len;
+  intern_entry_t *ie;
 
-    if( learner->tmp.file ) {
-#if defined HAVE_POSIX_MEMALIGN
-      /* buffer must exist until after fclose() */
-      if( 0 != posix_memalign(&learner->tmp.iobuf, system_pagesize, 
-			      BUFFER_MAG * system_pagesize) ) {
-	learner->tmp.iobuf = NULL;
-      }
-#elif defined HAVE_MEMALIGN
-      /* buffer can't be myfree()'d */
-      learner->tmpiobuf = (void *)memalign(system_pagesize, 
-					   BUFFER_MAG * system_pagesize);
-#elif defined HAVE_VALLOC
-      /* buffer can't be myfree()'d */
-      learner->tmpiobuf = (void *)valloc(BUFFER_MAG * system_pagesize);
-#endif
-      if( learner->tmp.iobuf ) {
-	setvbuf(learner->tmp.file, (char *)learner->tmp.iobuf, (int)_IOFBF, 
-		(size_t)(BUFFER_MAG * system_pagesize));
+  if( !interner ) {
+    return NULL;
+  }
+  len = strlen(tok);
+  mask = interner->max - 1;
+  for(k = id & mask, n = 0; n < interner->max; k = (k + 1) & mask, n++) {
+    ie = &interner->entry[k];
+    switch( intern_settled(ie) ) {
+    case INTERN_EMPTY:
+      return NULL;
+    case INTERN_READY:
+      if( intern_equal(ie, id, tok, len) ) {
+	return ie;
       }
+      break;
+    default:
+      break;
     }
-
   }
+  return NULL;
+}
 
-  if( u_options & (1<<U_OPTION_MMAP) ) {
-    MLOCK(learner->hash, sizeof(l_item_t) * learner->max_tokens);
+/* interns tok, whose hash_full_token() is id, and returns its entry,
+   or NULL if the interner is missing or full. No lock is taken: a
+   slot is claimed by moving it out of INTERN_EMPTY, and the text space
+   is reserved by bumping text_used. Tokens with the same id get
+   separate entries. */
+intern_entry_t *intern_token(const char *tok, hash_value_t id) {
+  intern_entry_t *ie;
+  hash_count_t k, n, mask;
+  unsigned int st;
+  size_t len, off;
+  const char *t, *e;
+
+  if( !interner || !id ) {
+    return NULL;
   }
 
-  MADVISE(learner->hash, sizeof(l_item_t) * learner->max_tokens, 
+  len = strlen(tok);
+  mask = interner->max - 1;
+  for(k = id & mask, n = 0; n < interner->max; ) {
+    ie = &interner->entry[k];
+    st = intern_settled(ie);
+    if( st == INTERN_READY ) {
+      if( intern_equal(ie, id, tok, len) ) {
+	return ie;
+      }
+    } else if( st == INTERN_EMPTY ) {
+      if( !__atomic_compare_exchange_n(&ie->state, &st, INTERN_BUSY, 0,
+				       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) ) {
+	continue; /* someone else took it, look again */
+      }
+      off = __atomic_fetch_add(&interner->text_used, len + 1, __ATOMIC_RELAXED);
+      if( (len > 0xfffe) || (off + len + 1 > interner->text_max) ||
+	  (100 * (__atomic_add_fetch(&interner->count, 1, __ATOMIC_RELAXED)) >= 
+	   HASH_FULL * interner->max) ) {
+	/* full, the slot stays in the probe chains but never matches */
+	__atomic_store_n(&ie->state, INTERN_DEAD, __ATOMIC_RELEASE);
+	return NULL;
+      }
+      memcpy(interner->text + off, tok, len + 1);
+      ie->text = (unsigned int)off;
+      ie->len = (unsigned short)len;
+      ie->id = id;
+
+      /* same suffixes as build_ref_cache() */
+      ie->nsuf = 0;
+      e = tok[0] ? strchr(tok + 1, EOTOKEN) : NULL;
+      for( t = tok + 1; e && (t + 1 < e); t++ ) {
+	if( *t == DIAMOND ) {
+	  if( ie->nsuf >= INTERN_SUFFIXES ) {
+	    ie->nsuf = INTERN_NOSUF;
+	    break;
+	  }
+	  ie->suf[ie->nsuf++] = hash_partial_token(t, e - t, e);
+	}
+      }
+      __atomic_store_n(&ie->state, INTERN_READY, __ATOMIC_RELEASE);
+      return ie;
+    }
+    k = (k + 1) & mask;
+    n++;
+  }
+  return NULL;
+}
+
+hash_count_t intern_count() {
+  return interner ? interner->count : 0;
+}
+
+/***********************************************************
+ * SORTED COUNTING                                         *
+ ***********************************************************/
+
+/* the current run, and the spill file holding the finished runs */
+static struct {
+  sort_rec_t *rec;
+  sort_rec_t *aux;
+  hash_count_t nrec;
+  char *text;
+  size_t ntext;
+  FILE *spill;
+  off_t *run;
+  int runs;
+  int max_runs;
+} sortc = { NULL, NULL, 0, NULL, 0, NULL, NULL, 0, 0 };
+
+/* sorts, aggregates and spills the current run */
+static void sort_count_flush_run() {
+  sort_rec_t *a, *b, *t;
+  hash_count_t n, k, c[256];
+  sort_item_t item;
+  off_t *r;
+  unsigned int shift;
+
+  if( sortc.nrec == 0 ) {
+    return;
+  }
+
+  /* stable LSD radix sort by id, equal ids stay in input order */
+  a = sortc.rec;
+  b = sortc.aux;
+  for(shift = 0; shift < 8 * sizeof(hash_value_t); shift += 8) {
+    memset(c, 0, sizeof(c));
+    for(n = 0; n < sortc.nrec; n++) {
+      c[(a[n].id >> shift) & 0xff]++;
+    }
+    for(n = 0, k = 0; n < 256; n++) {
+      hash_count_t m = c[n];
+      c[n] = k;
+      k += m;
+    }
+    for(n = 0; n < sortc.nrec; n++) {
+      b[c[(a[n].id >> shift) & 0xff]++] = a[n];
+    }
+    t = a; a = b; b = t;
+  }
+
+  if( !sortc.spill && !(sortc.spill = tmpfile()) ) {
+    errormsg(E_FATAL, "could not create a temporary file for sorted counting\n");
+  }
+  if( sortc.runs + 1 >= sortc.max_runs ) {
+    r = (off_t *)realloc(sortc.run, (2 * sortc.max_runs + 16) * sizeof(off_t));
+    if( !r ) {
+      errormsg(E_FATAL, "not enough memory for sorted counting\n");
+    }
+    sortc.run = r;
+    sortc.max_runs = 2 * sortc.max_runs + 16;
+  }
+  sortc.run[sortc.runs++] = ftello(sortc.spill);
+
+  /* one item per id, with the type and text of its first occurrence */
+  for(n = 0; n < sortc.nrec; n = k) {
+    for(k = n + 1; (k < sortc.nrec) && (a[k].id == a[n].id); k++);
+    memset(&item, 0, sizeof(item));
+    item.id = a[n].id;
+    item.typ = a[n].typ;
+    item.count = (k - n < K_TOKEN_COUNT_MAX) ? 
+      (token_count_t)(k - n) : K_TOKEN_COUNT_MAX;
+    item.len = (unsigned short)strlen(sortc.text + a[n].off);
+    if( (fwrite(&item, sizeof(item), 1, sortc.spill) != 1) ||
+	(fwrite(sortc.text + a[n].off, 1, item.len, sortc.spill) != item.len) ) {
+      errormsg(E_FATAL, "could not write to the sorted counting file\n");
+    }
+  }
+  sortc.run[sortc.runs] = ftello(sortc.spill);
+
+  sortc.nrec = 0;
+  sortc.ntext = 0;
+}
+
+/* records one occurrence of a token, returns false if this isn't
+   possible, and the token should be learned directly */
+bool_t sort_count_token(hash_value_t id, token_type_t tt, const char *tok) {
+  size_t len = strlen(tok) + 1;
+
+  if( m_options & (1<<M_OPTION_CALCENTROPY) ) {
+    return 0; /* the document statistics need the hash slots */
+  }
+  if( !sortc.rec ) {
+    sortc.rec = (sort_rec_t *)malloc(SORT_RUN_RECORDS * sizeof(sort_rec_t));
+    sortc.aux = (sort_rec_t *)malloc(SORT_RUN_RECORDS * sizeof(sort_rec_t));
+    sortc.text = (char *)malloc(SORT_RUN_TEXT);
+    if( !sortc.rec || !sortc.aux || !sortc.text ) {
+      errormsg(E_WARNING, 
+	       "not enough memory for sorted counting, using the hash.\n");
+      u_options &= ~(1<<U_OPTION_SORTCOUNT);
+      learn_word = select_learn_word();
+      if( sortc.rec ) { free(sortc.rec); sortc.rec = NULL; }
+      if( sortc.aux ) { free(sortc.aux); sortc.aux = NULL; }
+      if( sortc.text ) { free(sortc.text); sortc.text = NULL; }
+      return 0;
+    }
+  }
+
+  if( (sortc.nrec >= SORT_RUN_RECORDS) || (sortc.ntext + len > SORT_RUN_TEXT) ) {
+    sort_count_flush_run();
+  }
+
+  sortc.rec[sortc.nrec].id = id;
+  sortc.rec[sortc.nrec].typ = tt;
+  sortc.rec[sortc.nrec].off = (unsigned int)sortc.ntext;
+  sortc.nrec++;
+  memcpy(sortc.text + sortc.ntext, tok, len);
+  sortc.ntext += len;
+  return 1;
+}
+
+/* makes sure at least len unread bytes are buffered */
+static bool_t sort_reader_fill(sort_reader_t *r, size_t len) {
+  ssize_t n;
+  if( r->have - r->at >= len ) {
+    return 1;
+  }
+  memmove(r->buf, r->buf + r->at, r->have - r->at);
+  r->have -= r->at;
+  r->at = 0;
+  while( (r->have < len) && (r->pos < r->end) ) {
+    n = pread(fileno(sortc.spill), r->buf + r->have, 
+	      ((size_t)(r->end - r->pos) < SORT_READ_BUF - r->have) ?
+	      (size_t)(r->end - r->pos) : SORT_READ_BUF - r->have, r->pos);
+    if( n <= 0 ) {
+      return 0;
+    }
+    r->have += n;
+    r->pos += n;
+  }
+  return (r->have >= len);
+}
+
+/* reads the next item of the run, or marks the reader as done */
+static void sort_reader_next(sort_reader_t *r) {
+  size_t len;
+  r->live = sort_reader_fill(r, sizeof(sort_item_t));
+  if( r->live ) {
+    memcpy(&r->item, r->buf + r->at, sizeof(sort_item_t));
+    r->at += sizeof(sort_item_t);
+    len = (r->item.len < SORT_TOKEN_MAX) ? r->item.len : SORT_TOKEN_MAX;
+    r->live = sort_reader_fill(r, r->item.len);
+    if( r->live ) {
+      memcpy(r->tok, r->buf + r->at, len);
+      r->tok[len] = 0;
+      r->at += r->item.len;
+    }
+  }
+}
+
+static void sort_readers_rewind(sort_reader_t *rd) {
+  int k;
+  for(k = 0; k < sortc.runs; k++) {
+    rd[k].pos = sortc.run[k];
+    rd[k].end = sortc.run[k + 1];
+    rd[k].at = rd[k].have = 0;
+    sort_reader_next(&rd[k]);
+  }
+}
+
+/* merges the next id from all runs, returns the reader holding its
+   first occurrence (with the total count), or NULL at the end */
+static sort_reader_t *sort_readers_merge(sort_reader_t *rd, token_count_t *count) {
+  sort_reader_t *first = NULL;
+  int k;
+
+  for(k = 0; k < sortc.runs; k++) {
+    if( rd[k].live && (!first || (rd[k].item.id < first->item.id)) ) {
+      first = &rd[k];
+    }
+  }
+  if( first ) {
+    *count = 0;
+    for(k = 0; k < sortc.runs; k++) {
+      if( rd[k].live && (rd[k].item.id == first->item.id) ) {
+	*count = (*count <= K_TOKEN_COUNT_MAX - rd[k].item.count) ?
+	  *count + rd[k].item.count : K_TOKEN_COUNT_MAX;
+	if( &rd[k] != first ) {
+	  sort_reader_next(&rd[k]);
+	}
+      }
+    }
+  }
+  return first;
+}
+
+/* index of the highest bit of n, n > 0 */
+static int sort_count_bucket(token_count_t n) {
+  int b = 0;
+  while( n >>= 1 ) { b++; }
+  return b;
+}
+
+/* builds the learner hash from the sorted runs. Ids are inserted in
+   increasing order, which walks the hash sequentially. If there are
+   more new tokens than fit even after growing the hash, the rarest
+   are left out rather than the last ones seen. */
+void sort_count_finish(learner_t *learner) {
+  sort_reader_t *rd, *r;
+  l_item_t *i;
+  token_count_t n;
+  long nnew = 0, dropped = 0, room;
+  long hist[8 * sizeof(token_count_t)];
+  int b, cut;
+
+  if( !sortc.rec ) {
+    return;
+  }
+  sort_count_flush_run();
+  free(sortc.rec); sortc.rec = NULL;
+  free(sortc.aux); sortc.aux = NULL;
+  free(sortc.text); sortc.text = NULL;
+
+  if( sortc.runs > 0 ) {
+    if( fflush(sortc.spill) != 0 ) {
+      errormsg(E_FATAL, "could not write to the sorted counting file\n");
+    }
+    rd = (sort_reader_t *)malloc(sortc.runs * sizeof(sort_reader_t));
+    if( !rd ) {
+      errormsg(E_FATAL, "not enough memory to merge %d sorted runs\n", 
+	       sortc.runs);
+    }
+
+    if( learner->old.hash ) {
+      migrate_learner_hash(learner, learner->old.max_tokens);
+    }
+
+    /* first pass: how many new tokens, and how frequent */
+    memset(hist, 0, sizeof(hist));
+    sort_readers_rewind(rd);
+    while( (r = sort_readers_merge(rd, &n)) ) {
+      if( !find_in_learner(learner, r->item.id) ) {
+	nnew++;
+	hist[sort_count_bucket(n)]++;
+      }
+      sort_reader_next(r);
+    }
+
+    while( (100 * (learner->unique_token_count + nnew) >= 
+	    HASH_FULL * learner->max_tokens) &&
+	   (u_options & (1<<U_OPTION_GROWHASH)) && 
+	   grow_learner_hash(learner) ) {
+      if( learner->old.hash ) {
+	migrate_learner_hash(learner, learner->old.max_tokens);
+      }
+    }
+
+    /* lowest count bucket that can go in whole */
+    room = (HASH_FULL * (long)learner->max_tokens)/100 - 
+      (long)learner->unique_token_count;
+    for(cut = 8 * sizeof(token_count_t) - 1; 
+	(cut > 0) && (hist[cut - 1] <= room); cut--) {
+      room -= hist[cut - 1];
+    }
+
+    /* second pass: fill the hash */
+    sort_readers_rewind(rd);
+    while( (r = sort_readers_merge(rd, &n)) ) {
+      i = find_in_learner(learner, r->item.id);
+      if( !i ) {
+	b = sort_count_bucket(n);
+	if( (b < cut - 1) ||
+	    ((100 * learner->unique_token_count) >= 
+	     (HASH_FULL * learner->max_tokens)) ||
+	    !(i = insert_in_learner(learner, r->item.id)) ) {
+	  dropped++;
+	  sort_reader_next(r);
+	  continue;
+	}
+
+	if( learner->unique_token_count < K_TOKEN_COUNT_MAX )
+	  { learner->unique_token_count++; } else { overflow_warning = 1; }
+
+	i->typ = r->item.typ;
+
+	/* order accounting */
+	learner->max_order = (learner->max_order < i->typ.order) ? 
+	  i->typ.order : learner->max_order;
+
+	if( learner->fixed_order_unique_token_count[i->typ.order] < K_TOKEN_COUNT_MAX ) 
+	  { learner->fixed_order_unique_token_count[i->typ.order]++; } else 
+	    { overflow_warning = 1; }
+
+	tmp_grow(learner); /* just in case we're full */
+	tmp_write_token(learner, r->tok);
+      }
+
+      if( i->count <= K_ITEM_COUNT_MAX - n ) { 
+	i->count += n; 
+	i->dirty = 1;
+	if( learner->t_max < i->count ) {
+	  learner->t_max = i->count;
+	}
+      } else { 
+	i->count = K_ITEM_COUNT_MAX; /* saturate */
+	overflow_warning = 1; 
+      }
+
+      if( learner->full_token_count <= K_TOKEN_COUNT_MAX - n )
+	{ learner->full_token_count += n; } else 
+	  { /* this number is just cosmetic */ }
+
+      if( learner->fixed_order_token_count[i->typ.order] <= K_TOKEN_COUNT_MAX - n ) 
+	{ learner->fixed_order_token_count[i->typ.order] += n; } else 
+	  { skewed_constraints_warning = 1; }
+
+      sort_reader_next(r);
+    }
+    free(rd);
+
+    if( dropped > 0 ) {
+      errormsg(E_WARNING,
+	       "table full, %ld of the rarest tokens ignored - "
+	       "try with option -h %i\n",
+	       dropped, learner->max_hash_bits + 1);
+    }
+    if( u_options & (1<<U_OPTION_VERBOSE) ) {
+      LOG(stdout, "merged %d sorted runs, %ld new tokens\n", sortc.runs, nnew);
+    }
+  }
+
+  if( sortc.spill ) {
+    fclose(sortc.spill);
+    sortc.spill = NULL;
+  }
+  sortc.runs = 0;
+}
+
+/***********************************************************
+ * PARALLEL LEARNING                                       *
+ ***********************************************************/
+
+/* the worker whose table learn_worker_word_fun() should fill */
+static __thread learn_worker_t *current_worker = NULL;
+
+/* returns the index slot for id in the worker's private table */
+static hash_count_t *find_in_worker(learn_worker_t *w, hash_value_t id) {
+  hash_count_t k, mask;
+
+  mask = w->index_max - 1;
+  for(k = id & mask; w->index[k]; k = (k + 1) & mask) {
+    if( EQUALP(w->items[w->index[k] - 1].id, id) ) {
+      break;
+    }
+  }
+  return &w->index[k];
+}
+
+/* the worker index is kept at most half full */
+static void grow_worker_index(learn_worker_t *w) {
+  hash_count_t c, k, mask;
+  hash_count_t *index;
+
+  index = (hash_count_t *)calloc(2 * w->index_max, sizeof(hash_count_t));
+  if( !index ) {
+    errormsg(E_FATAL,
+	     "not enough memory? I couldn't allocate %li bytes\n",
+	     (sizeof(hash_count_t) * 2 * ((long int)w->index_max)));
+  }
+  mask = 2 * w->index_max - 1;
+  for(c = 0; c < w->item_count; c++) {
+    for(k = w->items[c].id & mask; index[k]; k = (k + 1) & mask);
+    index[k] = c + 1;
+  }
+  free(w->index);
+  w->index = index;
+  w->index_max *= 2;
+}
+
+/* this is hash_word_and_learn(), minus everything which depends on 
+   the order in which tokens are seen. That part is done when the
+   worker is merged. */
+void learn_worker_word_fun(char *tok, token_type_t tt, regex_count_t re) {
+  learn_worker_t *w = current_worker;
+  hash_value_t id;
+  hash_count_t *k;
+  w_item_t *i;
+  char *s;
+  long l;
+  alphabet_size_t p,q;
+
+  for(s = tok; s && *s == DIAMOND; s++);
+  if( s && (*s != EOTOKEN) ) { 
+
+    if( m_options & (1<<M_OPTION_MULTINOMIAL) ) { tt.order = 1; }
+
+    id = hash_full_token(tok);
+    k = find_in_worker(w, id);
+    if( !*k ) {
+      if( w->item_count >= w->item_max ) {
+	w->item_max *= 2;
+	w->items = (w_item_t *)realloc(w->items, w->item_max * sizeof(w_item_t));
+	if( !w->items ) {
+	  errormsg(E_FATAL, "not enough memory for parallel learning\n");
+	}
+      }
+      /* token strings end with CLASSEP, the class and a NUL */
+      l = strlen(tok) + 1;
+      while( w->toks_used + l > w->toks_max ) {
+	w->toks_max *= 2;
+	w->toks = (char *)realloc(w->toks, w->toks_max);
+	if( !w->toks ) {
+	  errormsg(E_FATAL, "not enough memory for parallel learning\n");
+	}
+      }
+      i = &w->items[w->item_count];
+      SET(i->id,id);
+      i->count = 0;
+      i->typ = tt;
+      i->tokoff = w->toks_used;
+      memcpy(w->toks + w->toks_used, tok, l);
+      w->toks_used += l;
+      *k = ++w->item_count;
+      if( 2 * w->item_count > w->index_max ) {
+	grow_worker_index(w);
+      }
+    } else {
+      i = &w->items[*k - 1];
+    }
+    i->count++;
+
+    if( tt.order == 1 ) { /* count each token only once */
+      p = *tok++;
+      while( *tok != EOTOKEN ) {
+	q = (unsigned char)*tok;
+	w->dig[p * ASIZE + q]++;
+	p = q;
+	tok++;
+      }
+    }
+  }
+}
+
+/* tokenizes the lines in [w->start, w->end) exactly as
+   nvram_process_file() does for plain text */
+void *learn_worker_fun(void *arg) {
+  learn_worker_t *w = (learn_worker_t *)arg;
+  char tokbuf[(MAX_TOKEN_LEN+1)*MAX_SUBMATCH+EXTRA_TOKEN_LEN];
+  char *q;
+  token_order_t how_many;
+  regex_count_t r;
+  char *p, *e;
+  char *line = NULL;
+  size_t len, line_max = 0;
+
+  current_worker = w;
+  reset_current_token(tokbuf, &q, &how_many);
+
+  for(p = w->start; p < w->end; p = e + 1) {
+    for(e = p; (e < w->end) && (*e != '\n'); e++);
+    len = e - p;
+    if( len + 1 > line_max ) {
+      line_max = 2 * (len + 1);
+      line = (char *)realloc(line, line_max);
+      if( !line ) {
+	errormsg(E_FATAL, "not enough memory for input line (%li bytes)\n",
+		 (long int)line_max);
+      }
+    }
+    memcpy(line, p, len);
+    line[len] = '\0';
+
+    if( *line ) {
+      for(r = 0; r < regex_count; r++) {
+	regex_tokenizer(line, r, learn_worker_word_fun, get_token_type);
+      }
+      if( (m_options & (1<<M_OPTION_USE_STDTOK)) ) {
+	std_tokenizer(line, &q, tokbuf, &how_many, ngram_order,
+		      learn_worker_word_fun, get_token_type);
+      }
+    }
+    reset_current_token(tokbuf, &q, &how_many);
+  }
+
+  if( line ) { free(line); }
+  return NULL;
+}
+
+/* adds a worker's counts to the learner. Workers must be merged in
+   input order: new tokens then reach the hash and the temporary
+   token file in the same order as if we'd learned sequentially. */
+void merge_learn_worker(learner_t *learner, learn_worker_t *w) {
+  hash_count_t c;
+  w_item_t *j;
+  l_item_t *i;
+  alphabet_size_t p,q;
+  token_count_t n;
+
+  for(c = 0; c < w->item_count; c++) {
+    j = &w->items[c];
+    i = find_in_learner(learner, j->id);
+
+    if( !i && ((100 * learner->unique_token_count) < 
+	       (HASH_FULL * learner->max_tokens)) ) {
+      i = insert_in_learner(learner, j->id);
+      if( i ) {
+	if( learner->unique_token_count < K_TOKEN_COUNT_MAX )
+	  { learner->unique_token_count++; } else { overflow_warning = 1; }
+
+	i->typ = j->typ;
+
+	/* order accounting */
+	learner->max_order = (learner->max_order < i->typ.order) ? 
+	  i->typ.order : learner->max_order;
+
+	if( learner->fixed_order_unique_token_count[i->typ.order] < K_TOKEN_COUNT_MAX ) 
+	  { learner->fixed_order_unique_token_count[i->typ.order]++; } else 
+	    { overflow_warning = 1; }
+
+	tmp_grow(learner); /* just in case we're full */
+	tmp_write_token(learner, w->toks + j->tokoff);
+      }
+    }
+
+    if( i ) {
+      n = j->count;
+      if( i->count <= K_ITEM_COUNT_MAX - n ) { 
+	i->count += n; 
+	i->dirty = 1;
+	if( learner->t_max < i->count ) {
+	  learner->t_max = i->count;
+	}
+      } else { 
+	i->count = K_ITEM_COUNT_MAX; /* saturate */
+	overflow_warning = 1; 
+      }
+
+      if( learner->full_token_count <= K_TOKEN_COUNT_MAX - n )
+	{ learner->full_token_count += n; } else 
+	  { /* this number is just cosmetic */ }
+
+      if( learner->fixed_order_token_count[i->typ.order] <= K_TOKEN_COUNT_MAX - n ) 
+	{ learner->fixed_order_token_count[i->typ.order] += n; } else 
+	  { skewed_constraints_warning = 1; }
+    }
+  }
+
+  for(p = 0; p < ASIZE; p++) {
+    for(q = 0; q < ASIZE; q++) {
+      if( learner->dig[p][q] + w->dig[p * ASIZE + q] < K_DIGRAM_COUNT_MAX ) {
+	learner->dig[p][q] += w->dig[p * ASIZE + q];
+      } else {
+	learner->dig[p][q] = K_DIGRAM_COUNT_MAX;
+	digramic_overflow_warning = 1;
+      }
+    }
+  }
+
+  if( digramic_overflow_warning ) {
+    errormsg(E_WARNING,
+	     "ran out of integers (too much data), "
+	     "reference measure may be skewed.\n");
+    m_options |= (1<<M_OPTION_WARNING_BAD);
+  }
+
+  if( overflow_warning ) {
+    errormsg(E_WARNING,
+	     "ran out of integers (too much data), "
+	     "results may be skewed.\n");
+    m_options |= (1<<M_OPTION_WARNING_BAD);
+  }
+}
+
+/* learns the input map with learn_threads workers, each taking a
+   contiguous range of whole lines. Returns false, having done
+   nothing, if the options need state carried from line to line,
+   in which case the caller must process the input sequentially. */
+bool_t parallel_learn_file(learner_t *learner, size_t datasize, 
+			   char *input_map) {
+  learn_worker_t w[MAX_LEARN_THREADS];
+  pthread_t tid[MAX_LEARN_THREADS];
+  int t, n;
+  char *p;
+
+  if( (learn_threads < 2) || !input_map || (datasize == 0) ||
+      (extra_model_count > 0) ||
+      (m_options & (1<<M_OPTION_MBOX_FORMAT)) ||
+      (m_options & (1<<M_OPTION_XML)) ||
+      (m_options & (1<<M_OPTION_HTML)) ||
+      (m_options & (1<<M_OPTION_NGRAM_STRADDLE_NL)) ||
+      (m_options & (1<<M_OPTION_CALCENTROPY)) ||
+      (u_options & (1<<U_OPTION_DECIMATE)) ||
+      (u_options & (1<<U_OPTION_GROWHASH)) ||
+      (u_options & (1<<U_OPTION_ADMIT)) ||
+      (u_options & (1<<U_OPTION_SORTCOUNT)) ||
+      (u_options & (1<<U_OPTION_INDENTED)) ||
+      (u_options & (1<<U_OPTION_APPEND)) ||
+      (u_options & (1<<U_OPTION_DEBUG)) ) {
+    return 0;
+  }
+
+  /* split at line boundaries */
+  p = input_map;
+  for(n = 0; (n < learn_threads) && (p < input_map + datasize); n++) {
+    w[n].start = p;
+    p = input_map + (datasize * (n + 1)) / learn_threads;
+    p = (p < w[n].start) ? w[n].start : p;
+    while( (p < input_map + datasize) && (*p != '\n') ) { p++; }
+    if( p < input_map + datasize ) { p++; }
+    w[n].end = p;
+
+    w[n].item_count = 0;
+    w[n].item_max = 1024;
+    w[n].items = (w_item_t *)malloc(w[n].item_max * sizeof(w_item_t));
+    w[n].index_max = 2 * w[n].item_max;
+    w[n].index = (hash_count_t *)calloc(w[n].index_max, sizeof(hash_count_t));
+    w[n].toks_used = 0;
+    w[n].toks_max = 16 * w[n].item_max;
+    w[n].toks = (char *)malloc(w[n].toks_max);
+    w[n].dig = (token_count_t *)calloc(ASIZE * ASIZE, sizeof(token_count_t));
+    if( !w[n].items || !w[n].index || !w[n].toks || !w[n].dig ) {
+      errormsg(E_FATAL, "not enough memory for parallel learning\n");
+    }
+  }
+
+  for(t = 0; t < n; t++) {
+    if( 0 != pthread_create(&tid[t], NULL, learn_worker_fun, &w[t]) ) {
+      errormsg(E_FATAL, "couldn't start learning thread\n");
+    }
+  }
+
+  for(t = 0; t < n; t++) {
+    pthread_join(tid[t], NULL);
+    merge_learn_worker(learner, &w[t]);
+    free(w[t].items);
+    free(w[t].index);
+    free(w[t].toks);
+    free(w[t].dig);
+  }
+
+  return 1;
+}
+
+
+/* one HyperLogLog register array per token order, see
+   size_learner_from_sample() */
+static byte_t *size_sketch = NULL;
+
+static void size_sketch_word_fun(char *tok, token_type_t tt, 
+				 regex_count_t re) {
+  char *s;
+  u_int64_t x;
+  byte_t r, *reg;
+
+  for(s = tok; s && *s == DIAMOND; s++);
+  if( s && (*s != EOTOKEN) ) {
+    if( m_options & (1<<M_OPTION_MULTINOMIAL) ) { tt.order = 1; }
+    x = (u_int64_t)hash_full_token(tok) * HLL_MIX;
+    r = (byte_t)__builtin_clzll((x << HLL_BITS) | 
+				((u_int64_t)1 << (HLL_BITS - 1))) + 1;
+    reg = size_sketch + 
+      ((tt.order % MAX_SUBMATCH) << HLL_BITS) + (x >> (64 - HLL_BITS));
+    if( *reg < r ) {
+      *reg = r;
+    }
+  }
+}
+
+static double size_sketch_estimate(byte_t *reg) {
+  double m = (double)(1<<HLL_BITS);
+  double sum = 0.0, e;
+  long z, zeros = 0;
+
+  for(z = 0; z < (1<<HLL_BITS); z++) {
+    sum += ldexp(1.0, -(int)reg[z]);
+    if( !reg[z] ) {
+      zeros++;
+    }
+  }
+  e = (0.7213/(1.0 + 1.079/m)) * m * m/sum;
+  if( (e <= 2.5 * m) && (zeros > 0) ) {
+    /* small range correction */
+    e = m * log(m/zeros);
+  }
+  return e;
+}
+
+/* sizes a learner which hasn't seen any tokens yet (-k). The sample
+   is the first 1/SIZE_SAMPLE_DIV of the input map, tokenized exactly
+   as the learner will, in two halves, so that each order's distinct
+   token count d(n) ~ n^beta can be extrapolated to the whole input */
+void size_learner_from_sample(learner_t *learner, FILE *input,
+			      size_t datasize, char *input_map,
+			      int (*line_filter)(MBOX_State *, char *),
+			      void (*character_filter)(XML_State *, char *),
+			      char *(*pre_line_fun)(char *)) {
+  double half[MAX_SUBMATCH], d, beta, total = 0.0;
+  size_t sample, mid;
+  token_order_t z;
+  hash_bit_count_t bits;
+  options_t saved_options;
+
+  if( !input_map || (datasize == 0) || (learner->unique_token_count > 0) ||
+      learner->mmap_start ) {
+    return;
+  }
+  size_sketch = (byte_t *)calloc(MAX_SUBMATCH, (1<<HLL_BITS));
+  if( !size_sketch ) {
+    errormsg(E_WARNING, "not enough memory to estimate the learner size\n");
+    return;
+  }
+
+  sample = datasize/SIZE_SAMPLE_DIV;
+  if( sample < SIZE_SAMPLE_MIN ) {
+    sample = (datasize < SIZE_SAMPLE_MIN) ? datasize : SIZE_SAMPLE_MIN;
+  }
+  mid = sample/2;
+  while( (mid < sample) && (input_map[mid] != '\n') ) { mid++; }
+  if( mid < sample ) { mid++; }
+
+  /* pre_line_fun still skips the unindented lines under -A, but the 
+     sample lines mustn't be echoed under -a, they'll be read again */
+  saved_options = u_options;
+  u_options &= ~(1<<U_OPTION_APPEND);
+  nvram_process_file(input, line_filter, character_filter, 
+		     size_sketch_word_fun, pre_line_fun, NULL, 
+		     mid, input_map);
+  for(z = 0; z < MAX_SUBMATCH; z++) {
+    half[z] = size_sketch_estimate(size_sketch + (z << HLL_BITS));
+  }
+  nvram_process_file(input, line_filter, character_filter, 
+		     size_sketch_word_fun, pre_line_fun, NULL, 
+		     sample - mid, input_map + mid);
+  u_options = saved_options;
+
+  for(z = 1; z < MAX_SUBMATCH; z++) {
+    d = size_sketch_estimate(size_sketch + (z << HLL_BITS));
+    if( d < 1.0 ) {
+      continue;
+    }
+    beta = ((half[z] >= 1.0) && (mid > 0) && (mid < sample)) ?
+      log(d/half[z])/log((double)sample/mid) : 1.0;
+    beta = (beta < 0.3) ? 0.3 : ((beta > 1.0) ? 1.0 : beta);
+    d *= pow((double)datasize/sample, beta);
+    if( u_options & (1<<U_OPTION_VERBOSE) ) {
+      fprintf(stdout, "estimated %.0f distinct tokens of order %d\n", 
+	      d, (int)z);
+    }
+    total += d;
+  }
+  free(size_sketch);
+  size_sketch = NULL;
+
+  total = total * 100.0/SIZE_LOAD_TARGET;
+  for(bits = SIZE_MIN_HASH_BITS; 
+      (bits < MAX_HASH_BITS) && ((double)((hash_count_t)1<<bits) < total);
+      bits++) {
+    /* empty loop */
+  }
+  if( bits != learner->max_hash_bits ) {
+    /* the learner is still empty, only the table and ids go */
+    free(learner->hash);
+    learner->hash = NULL;
+    if( learner->ids ) {
+      free(learner->ids);
+      learner->ids = NULL;
+    }
+    learner->max_hash_bits = bits;
+    learner->max_tokens = ((hash_count_t)1<<bits);
+    learner->hash = (l_item_t *)calloc(learner->max_tokens, sizeof(l_item_t));
+    if( !learner->hash ) {
+      errormsg(E_FATAL,
+	       "not enough memory? I couldn't allocate %li bytes\n",
+	       (sizeof(l_item_t) * ((long int)learner->max_tokens)));
+    }
+    build_learner_ids(learner);
+    if( u_options & (1<<U_OPTION_VERBOSE) ) {
+      fprintf(stdout, "learner hash sized to 2^%d slots\n", (int)bits);
+    }
+  }
+}
+
+/* initialize global learner object */
+void init_learner(learner_t *learner) {
+  alphabet_size_t i, j;
+  regex_count_t c;
+  token_order_t z;
+
+  /* some constants */
+   learner->max_tokens = default_max_tokens;
+  learner->max_hash_bits = default_max_hash_bits;
+  learner->full_token_count = 0;
+  learner->unique_token_count = 0;
+  learner->t_max = 0;
+  learner->b_count = 0;
+  learner->logZ = 0.0;
+  learner->shannon = 0.0;
+  learner->alpha = 0.0;
+  learner->beta = 0.0;
+  learner->mu = 0.0;
+  learner->s2 = 0.0;
+  learner->max_order = 0;
+
+  learner->doc.A = 0.0;
+  learner->doc.C = 0.0;
+  learner->doc.count = 0;
+  learner->doc.nullcount = 0;
+  learner->doc.emp.top = 0;
+  learner->doc.emp.max = 0;
+  learner->doc.emp.stack = NULL;
+  memset(learner->doc.reservoir, 0, RESERVOIR_SIZE * sizeof(emplist_t));
+
+  learner->m_options = m_options;
+  learner->u_options = u_options;
+
+  learner->mmap_start = NULL;
+  learner->mmap_learner_offset = 0;
+  learner->mmap_hash_offset = 0;
+  learner->hash = NULL;
+  learner->ids = NULL;
+  learner->order_index = NULL;
+  memset(&learner->ref, 0, sizeof(learner->ref));
+  learner->mins = NULL;
+  memset(&learner->side, 0, sizeof(learner->side));
+  learner->tmp.arena = NULL;
+  memset(&learner->old, 0, sizeof(learner->old));
+  memset(&learner->admit, 0, sizeof(learner->admit));
+  learner->warm = 0;
+
+  /* init character frequencies */
+  for(i = 0; i < ASIZE; i++) { 
+    for(j = 0; j < ASIZE; j++) { 
+      learner->dig[i][j] = 0.0;
+    }
+  }
+
+  for(c = 0; c < MAX_RE + 1; c++) {
+    learner->regex_token_count[c] = 0;
+  }
+
+  for(z = 0; z < MAX_SUBMATCH; z++) {
+    learner->fixed_order_token_count[z] = 0;
+    learner->fixed_order_unique_token_count[z] = 0;
+  }
+
+  if( m_options & (1<<M_OPTION_MBOX_FORMAT) ) {
+    reset_mbox_messages(learner, &mbox);
+  }
+
+  if( !(*online && read_online_learner_struct(learner,online)) ) {
+    /* if we're here, we must do what read_online_... didn't do */
+
+#ifdef DEBUG
+    LOG(stderr, "learner->max_tokens %d \n", learner->max_tokens *  sizeof(l_item_t));
+#endif
+
+    /* allocate and zero room for hash */
+    learner->hash = (l_item_t *)calloc(learner->max_tokens, sizeof(l_item_t));
+    if( !learner->hash ) {
+      errormsg(E_FATAL,
+	       "not enough memory? I couldn't allocate %li bytes\n",
+	       (sizeof(l_item_t) * ((long int)learner->max_tokens)));
+    }
+    build_learner_ids(learner);
+
+    /* the token strings are kept in memory, laid out as in the
+       online file: each token followed by TOKENSEP */
+    learner->tmp.file = NULL;
+    learner->tmp.filename = NULL;
+    learner->tmp.iobuf = NULL;
+    learner->tmp.offset = 0;
+    learner->tmp.avail = TOKEN_LIST_GROW;
+    learner->tmp.used = 0;
+    learner->tmp.arena = (byte_t *)malloc(learner->tmp.avail);
+    if( !learner->tmp.arena ) {
+      errormsg(E_FATAL,
+	       "not enough memory? I couldn't allocate %li bytes\n",
+	       (long int)learner->tmp.avail);
+    }
+    learner->tmp.mmap_start = learner->tmp.arena;
+    learner->tmp.mmap_offset = 0;
+    learner->tmp.mmap_length = learner->tmp.avail;
+    learner->tmp.mmap_cursor = 0;
+
+  }
+
+  if( u_options & (1<<U_OPTION_MMAP) ) {
+    MLOCK(learner->hash, sizeof(l_item_t) * learner->max_tokens);
+  }
+
+  MADVISE(learner->hash, sizeof(l_item_t) * learner->max_tokens, 
 	  MADV_SEQUENTIAL);
 
+  /* after the online dump is read, which has stale pointers */
+  learner->digrams.pending = 0;
+  learner->digrams.count = 
+    (token_count_t (*)[ASIZE])calloc(ASIZE * ASIZE, sizeof(token_count_t));
+  if( !learner->digrams.count ) {
+    errormsg(E_FATAL,
+	     "not enough memory? I couldn't allocate %li bytes\n",
+	     (long int)(ASIZE * ASIZE * sizeof(token_count_t)));
+  }
+
   if( m_options & (1<<M_OPTION_CALCENTROPY) ) {
     learner->doc.emp.max = system_pagesize/sizeof(hash_count_t);
     learner->doc.emp.stack = 
@@ -2669,6 +4444,11 @@ void myfree_learner(learner_t *learner) {
 
   myfree_learner_hash(learner);
 
+  if( learner->digrams.count ) {
+    free(learner->digrams.count);
+    learner->digrams.count = NULL;
+  }
+
   if( learner->doc.emp.stack ) { 
     myfree(learner->doc.emp.stack); 
     learner->doc.emp.stack = NULL;
@@ -2716,15 +4496,49 @@ void myfree_learner(learner_t *learner) {
    * It's not really needed, since the uniform measure can be used
    * for spam filtering.
 */
+/* adds the integer digram counts into learner->dig, which must be
+   done before anything reads learner->dig */
+void flush_digram_counts(learner_t *learner) {
+  alphabet_size_t i, j;
+  weight_t *d;
+  token_count_t *c;
+
+  if( learner->digrams.pending == 0 ) {
+    return;
+  }
+  for(i = 0; i < ASIZE; i++) {
+    d = learner->dig[i];
+    c = learner->digrams.count[i];
+    for(j = 0; j < ASIZE; j++) {
+      if( d[j] + c[j] < K_DIGRAM_COUNT_MAX ) {
+	d[j] += c[j];
+      } else {
+	d[j] = K_DIGRAM_COUNT_MAX;
+	digramic_overflow_warning = 1;
+      }
+      c[j] = 0;
+    }
+  }
+  learner->digrams.pending = 0;
+
+  if( digramic_overflow_warning ) {
+    errormsg(E_WARNING,
+	     "ran out of integers (too much data), "
+	     "reference measure may be skewed.\n");
+    m_options |= (1<<M_OPTION_WARNING_BAD);
+  }
+}
+
 void make_dirichlet_digrams(learner_t *learner) {
   alphabet_size_t i, j;
-  token_count_t k;
-  float G[ASIZE];
-  float H[ASIZE];
+  token_count_t k, n;
+  double G[ASIZE];
+  double H[ASIZE];
   float V[ASIZE];
   float F[ASIZE];
   double prev_alpha;
   double K, t;
+  double row[ASIZE];
 
   /* initialize */
   dirichlet.alpha = 1.0;
@@ -2739,9 +4553,19 @@ void make_dirichlet_digrams(learner_t *learner) {
     V[j] = 0.0;
     F[j] = 0.0;
     for(i = AMIN; i < ASIZE; i++) {
-      for(k = AMIN; k < (token_count_t)learner->dig[i][j]; k++) {
-	G[j] += 1.0/k;
-	H[j] += 1.0/((double)k*k);
+      /* sums of 1/k and 1/k^2 for k = AMIN..count-1, with -K the
+	 asymptotic expansion is close enough */
+      k = (token_count_t)learner->dig[i][j];
+      if( k > AMIN ) {
+	if( u_options & (1<<U_OPTION_VEXP) ) {
+	  G[j] += harmonic_sum(k - 1) - harmonic_sum(AMIN - 1);
+	  H[j] += harmonic2_sum(k - 1) - harmonic2_sum(AMIN - 1);
+	} else {
+	  for(n = AMIN; n < k; n++) {
+	    G[j] += 1.0/n;
+	    H[j] += 1.0/((double)n*n);
+	  }
+	}
       }
       if( learner->dig[i][j] > 0 ) { 
 	V[j]++; 
@@ -2798,9 +4622,17 @@ void make_dirichlet_digrams(learner_t *learner) {
     for(j = AMIN; j < ASIZE; j++) {
       t += learner->dig[i][j];
     }
+    if( u_options & (1<<U_OPTION_VEXP) ) {
+      for(j = AMIN; j < ASIZE; j++) {
+	row[j] = ((weight_t)learner->dig[i][j] + dirichlet.u[j]) / 
+	  (t + dirichlet.alpha);
+      }
+      vlog(row + AMIN, ASIZE - AMIN);
+    }
     for(j = AMIN; j < ASIZE; j++) {
       /* note: simulate the effect of digitizing the digrams */
-      learner->dig[i][j] = 
+      learner->dig[i][j] = (u_options & (1<<U_OPTION_VEXP)) ?
+	UNPACK_DIGRAMS(PACK_DIGRAMS(row[j])) :
 	UNPACK_DIGRAMS(PACK_DIGRAMS(log(((weight_t)learner->dig[i][j] + 
 					 dirichlet.u[j]) / 
 					(t + dirichlet.alpha)))); 
@@ -2832,8 +4664,8 @@ void make_uniform_digrams(learner_t *learner) {
  * 0.6 works well generally. I don't understand this :-( 
  */
 void transpose_digrams(learner_t *learner) {
-  register alphabet_size_t i, j;
-  register weight_t t;
+  alphabet_size_t i, j;
+  weight_t t;
 
   /* we skip transitions involving DIAMOND, TOKENSEP */
   /* code below uses fact that DIAMOND == 0x01 */
@@ -2849,7 +4681,7 @@ void transpose_digrams(learner_t *learner) {
 
 void recompute_ed(learner_t *learner, weight_t *plogzon, weight_t *pdiv, 
 		  int i, weight_t lam[ASIZE], weight_t Xi) {
-  register alphabet_size_t j;
+  alphabet_size_t j;
   weight_t logA = log((weight_t)(ASIZE - AMIN));
   weight_t logzon, div;
   weight_t maxlogz, maxlogz2, tmp;
@@ -2893,10 +4725,11 @@ void recompute_ed(learner_t *learner, weight_t *plogzon, weight_t *pdiv,
 
 void make_entropic_digrams(learner_t *learner) {
   weight_t lam[ASIZE];
+  double logdig[ASIZE];
   weight_t lam_delta, old_lam, logt, maxlogt;
   weight_t Xi, logXi, logzon, div, old_logzon, old_div;
   weight_t logA = log((weight_t)(ASIZE - AMIN));
-  register alphabet_size_t i, j;
+  alphabet_size_t i, j;
   int itcount;
 
   for(i = AMIN; i < ASIZE; i++) {
@@ -2908,6 +4741,17 @@ void make_entropic_digrams(learner_t *learner) {
       lam[j] = 0.0;
     }
     logXi = log(Xi);
+    /* the iterations below only need the logs */
+    if( u_options & (1<<U_OPTION_VEXP) ) {
+      for(j = AMIN; j < ASIZE; j++) {
+	logdig[j] = (learner->dig[i][j] > 0.0) ? learner->dig[i][j] : 1.0;
+      }
+      vlog(logdig + AMIN, ASIZE - AMIN);
+    } else {
+      for(j = AMIN; j < ASIZE; j++) {
+	logdig[j] = (learner->dig[i][j] > 0.0) ? log(learner->dig[i][j]) : 0.0;
+      }
+    }
 
     recompute_ed(learner, &logzon, &div, i, lam, Xi);
 
@@ -2924,7 +4768,7 @@ void make_entropic_digrams(learner_t *learner) {
 	if( learner->dig[i][j] > 0.0 ) {
 
 	  old_lam = lam[j];
-	  lam[j] = log(learner->dig[i][j]) - logXi + logA + logzon;
+	  lam[j] = logdig[j] - logXi + logA + logzon;
 
 	  if( isnan(lam[j]) ) {
 
@@ -3018,8 +4862,8 @@ void interpolate_digrams(weight_t N, weight_t count[], weight_t p[]) {
 
 
 weight_t calc_learner_digramic_excursion(learner_t *learner, char *tok) {
-  register alphabet_size_t p, q;
-  register weight_t t = 0.0;
+  alphabet_size_t p, q;
+  weight_t t = 0.0;
 
   /* now update digram frequency counts */
   p = (unsigned char)*tok++;
@@ -3033,87 +4877,258 @@ weight_t calc_learner_digramic_excursion(learner_t *learner, char *tok) {
   return t;
 }
 
-/* calculates the rth-order divergence but needs normalizing constant
-   note: this isn't the full divergence from digref, just the bits
-   needed for the r-th optimization - fwd indicates the traversal
-   direction in the hash (alternate between them to reduce numerical
-   errors */
-score_t learner_divergence(learner_t *learner, 
-			   score_t logzonr, score_t Xi,
-			   token_order_t r, bool_t fwd) {
-  register l_item_t *i, *e;
-  register token_count_t c = 0;
-  score_t t = 0.0;
+/* adds the sum of exp(a[j]) - exp(b[j]) to s, using the vector kernel */
+static void vexp_sum_diff(double *a, double *b, int n, 
+			  score_t *s, score_t *comp) {
+  int j;
+  vexp(a, n);
+  vexp(b, n);
+  for(j = 0; j < n; j++) {
+    a[j] -= b[j];
+  }
+  KAHAN_ADD(*s, *comp, (score_t)pairwise_sum(a, n));
+}
 
-  e = fwd ? (learner->hash + learner->max_tokens) : learner->hash - 1;
-  for(i = fwd ? learner->hash : learner->hash + learner->max_tokens - 1; 
-      i != e; fwd ? i++ : i--) {
-    if( FILLEDP(i) && (i->typ.order == r) ) {
+/* runs one pass of minimize_learner_divergence() over hash partition p */
+static void minimize_partition(minimize_job_t *job, int p) {
+  learner_t *learner = job->learner;
+  l_item_t *i;
+  hash_count_t n, b, e;
+  token_order_t r = job->r;
+  score_t R = (score_t)r;
+  score_t s = 0.0, comp = 0.0, m, tmp;
+  score_t old_lam, new_lam;
+  token_count_t lzero = 0;
+  bool_t nan = 0;
+  double va[VEXP_BLOCK], vb[VEXP_BLOCK];
+  int nv = 0;
+
+  b = job->lo + (hash_count_t)(((unsigned long long)(job->hi - job->lo) * p)/
+				MINIMIZE_PARTITIONS);
+  e = job->lo + (hash_count_t)(((unsigned long long)(job->hi - job->lo) * (p + 1))/
+				MINIMIZE_PARTITIONS);
+  m = (job->pass == mpLAMBDA) ? 0.0 : log(0.0);
+
+  for(n = job->fwd ? b : e; job->fwd ? (n < e) : (n > b); job->fwd ? n++ : n--) {
+    if( learner->order_index ) {
+      i = learner->hash + learner->order_index[job->fwd ? n : n - 1];
+    } else {
+      i = learner->hash + (job->fwd ? n : n - 1);
+    }
+    if( !FILLEDP(i) ) {
+      continue;
+    }
+    if( job->pass == mpEXTRA_BITS ) {
+      if( i->typ.order < r ) {
+	KAHAN_ADD(s, comp, UNPACK_LAMBDA(i->lam) * (score_t)i->count);
+      }
+      continue;
+    } 
+    if( i->typ.order != r ) {
+      continue;
+    }
+    switch(job->pass) {
+    case mpMAXLOGZ:
+      tmp = R * UNPACK_LAMBDA(i->lam) + R * UNPACK_LWEIGHTS(MINVARS(learner, i).ltrms) + 
+	UNPACK_RWEIGHTS(MINVARS(learner, i).dref);
+      if( m < tmp ) {
+	m = tmp;
+      }
+      break;
+    case mpSUMZ:
+      tmp = R * UNPACK_LWEIGHTS(MINVARS(learner, i).ltrms) + 
+	UNPACK_RWEIGHTS(MINVARS(learner, i).dref) - job->x;
+      if( u_options & (1<<U_OPTION_VEXP) ) {
+	va[nv] = (double)(R * UNPACK_LAMBDA(i->lam) + tmp);
+	vb[nv] = (double)tmp;
+	if( ++nv == VEXP_BLOCK ) {
+	  vexp_sum_diff(va, vb, nv, &s, &comp);
+	  nv = 0;
+	}
+      } else {
+	KAHAN_ADD(s, comp, exp(R * UNPACK_LAMBDA(i->lam) + tmp) - exp(tmp));
+      }
+      break;
+    case mpDIVERGENCE:
+      KAHAN_ADD(s, comp, UNPACK_LAMBDA(i->lam) * (score_t)i->count);
+      break;
+    case mpLAMBDA:
+      if( job->marked_only && !i->dirty ) {
+	break;
+      }
+      old_lam = UNPACK_LAMBDA(i->lam);
 
-      t += UNPACK_LAMBDA(i->lam) * (score_t)i->count;
+      if( (i->typ.order == 1) || (i->count > ftreshold) ) {
+	/* "iterative scaling" lower bound */
+	new_lam = (log((score_t)i->count) - job->logXi -  
+		   UNPACK_RWEIGHTS(MINVARS(learner, i).dref))/R + job->x -
+	  UNPACK_LWEIGHTS(MINVARS(learner, i).ltrms);
+      } else {
+	new_lam = 0.0;
+      }
+      if( job->omega != 1.0 ) {
+	new_lam = old_lam + job->omega * (new_lam - old_lam);
+      }
 
-      if( ++c >= learner->fixed_order_unique_token_count[r] ) {
-	c = 0;
-	break;
+      if( isnan(new_lam) ) {
+	/* precision problem, just ignore, don't change lambda */
+	nan = 1;
+      } else {
+	/* this code shouldn't be necessary, but is crucial */
+	if( new_lam > (old_lam + MAX_LAMBDA_JUMP) ) {
+	  new_lam = (old_lam + MAX_LAMBDA_JUMP);
+	} else if( new_lam < (old_lam - MAX_LAMBDA_JUMP) ) {
+	  new_lam = (old_lam - MAX_LAMBDA_JUMP);
+	}
+
+	/* don't want negative weights */
+	if( new_lam < 0.0 ) { new_lam = 0.0; lzero++; }
+
+	if( m < fabs(new_lam - old_lam) ) {
+	  m = fabs(new_lam - old_lam);
+	}
+	i->lam = PACK_LAMBDA(new_lam);
       }
+      break;
+    default:
+      break;
     }
   }
 
-  return -logzonr + t/Xi;
+  if( nv > 0 ) {
+    vexp_sum_diff(va, vb, nv, &s, &comp);
+  }
+
+  job->sum[p] = s;
+  job->max[p] = m;
+  job->lzero[p] = lzero;
+  job->nan[p] = nan;
 }
 
-/* calculates the normalizing constant - fwd indicates the traversal
-   direction in the hash (alternate between them to reduce numerical
-   errors */
-score_t learner_logZ(learner_t *learner, token_order_t r, 
-		     score_t log_unchanging_part, bool_t fwd) {
-  register l_item_t *i, *e;
-  register token_count_t c = 0;
+void *minimize_worker_fun(void *arg) {
+  minimize_worker_t *w = (minimize_worker_t *)arg;
+  int p;
+  for(p = w->first; p < MINIMIZE_PARTITIONS; p += w->step) {
+    minimize_partition(w->job, p);
+  }
+  return NULL;
+}
 
-  score_t maxlogz, maxlogz2, tmp;
-  score_t t =0.0;
-  score_t R = (score_t)r;
+/* runs a pass on all partitions, with up to learn_threads threads, then
+   combines the partition results in a fixed order into sum[0], max[0],
+   lzero[0] and nan[0] */
+void minimize_pass(minimize_job_t *job) {
+  minimize_worker_t w[MAX_LEARN_THREADS];
+  pthread_t tid[MAX_LEARN_THREADS];
+  int n, t, p;
+  score_t s, comp, m;
+  token_count_t lzero;
+  bool_t nan;
+
+  /* the range of slots (or of order_index entries) to walk */
+  if( !job->learner->order_index ) {
+    job->lo = 0;
+    job->hi = job->learner->max_tokens;
+  } else if( job->r >= MAX_SUBMATCH ) {
+    job->lo = job->hi = 0;
+  } else if( job->pass == mpEXTRA_BITS ) {
+    job->lo = job->learner->order_start[0];
+    job->hi = job->learner->order_start[job->r];
+  } else {
+    job->lo = job->learner->order_start[job->r];
+    job->hi = job->learner->order_start[job->r + 1];
+  }
 
-/*   printf("learner_logZ(%d, %f)\n", r, log_unchanging_part); */
+  n = ((job->hi - job->lo) < MINIMIZE_THREADED_MIN) ? 1 : learn_threads;
+  if( n > MINIMIZE_PARTITIONS ) {
+    n = MINIMIZE_PARTITIONS;
+  }
+  for(t = 0; t < n; t++) {
+    w[t].job = job;
+    w[t].first = t;
+    w[t].step = n;
+  }
+  for(t = 1; t < n; t++) {
+    if( 0 != pthread_create(&tid[t], NULL, minimize_worker_fun, &w[t]) ) {
+      /* do its share here instead */
+      minimize_worker_fun(&w[t]);
+      w[t].job = NULL;
+    }
+  }
+  minimize_worker_fun(&w[0]);
+  for(t = 1; t < n; t++) {
+    if( w[t].job ) {
+      pthread_join(tid[t], NULL);
+    }
+  }
 
-  e = fwd ? (learner->hash + learner->max_tokens) : learner->hash - 1;
-  maxlogz = log_unchanging_part;
-  maxlogz2 = log(0.0);
-  for(i = fwd ? learner->hash : learner->hash + learner->max_tokens - 1; 
-      i != e; fwd ? i++ : i--) {
-    if( FILLEDP(i) && (i->typ.order == r) ) {
+  s = comp = 0.0;
+  m = job->max[0];
+  lzero = 0;
+  nan = 0;
+  for(t = 0; t < MINIMIZE_PARTITIONS; t++) {
+    p = job->fwd ? t : MINIMIZE_PARTITIONS - 1 - t;
+    KAHAN_ADD(s, comp, job->sum[p]);
+    if( m < job->max[p] ) {
+      m = job->max[p];
+    }
+    lzero += job->lzero[p];
+    nan |= job->nan[p];
+  }
+  job->sum[0] = s;
+  job->max[0] = m;
+  job->lzero[0] = lzero;
+  job->nan[0] = nan;
+}
 
-      tmp = R * UNPACK_LAMBDA(i->lam) + R * UNPACK_LWEIGHTS(i->tmp.min.ltrms) + 
-	UNPACK_RWEIGHTS(i->tmp.min.dref);
+/* calculates the rth-order divergence but needs normalizing constant
+   note: this isn't the full divergence from digref, just the bits
+   needed for the r-th optimization - fwd indicates the traversal
+   direction in the hash (alternate between them to reduce numerical
+   errors */
+score_t learner_divergence(learner_t *learner, 
+			   score_t logzonr, score_t Xi,
+			   token_order_t r, bool_t fwd) {
+  minimize_job_t job;
 
-      if( maxlogz < tmp ) {
-	maxlogz2 = maxlogz;
-	maxlogz = tmp;
-      }
+  job.learner = learner;
+  job.marked_only = 0;
+  job.pass = mpDIVERGENCE;
+  job.r = r;
+  job.fwd = fwd;
+  minimize_pass(&job);
 
-      if( ++c >= learner->fixed_order_unique_token_count[r] ) {
-	c = 0;
-	break;
-      }
-    }
-  }
+  return -logzonr + job.sum[0]/Xi;
+}
 
-  t =  exp(log_unchanging_part - maxlogz);
-  for(i = fwd ? learner->hash : learner->hash + learner->max_tokens - 1; 
-      i != e; fwd ? i++ : i--) {
-    if( FILLEDP(i) && (i->typ.order == r) ) {
+/* calculates the normalizing constant - fwd indicates the traversal
+   direction in the hash (alternate between them to reduce numerical
+   errors */
+score_t learner_logZ(learner_t *learner, token_order_t r, 
+		     score_t log_unchanging_part, bool_t fwd) {
+  minimize_job_t job;
+  score_t maxlogz, tmp;
+  score_t t =0.0;
+  score_t R = (score_t)r;
 
-      tmp = R * UNPACK_LWEIGHTS(i->tmp.min.ltrms) + 
-	UNPACK_RWEIGHTS(i->tmp.min.dref) - maxlogz;
-      t += (exp(R * UNPACK_LAMBDA(i->lam) + tmp) - exp(tmp)); 
+/*   printf("learner_logZ(%d, %f)\n", r, log_unchanging_part); */
 
-      if( ++c >= learner->fixed_order_unique_token_count[r] ) {
-	c = 0;
-	break;
-      }
-    }
+  job.learner = learner;
+  job.marked_only = 0;
+  job.pass = mpMAXLOGZ;
+  job.r = r;
+  job.fwd = fwd;
+  minimize_pass(&job);
+  maxlogz = log_unchanging_part;
+  if( maxlogz < job.max[0] ) {
+    maxlogz = job.max[0];
   }
 
+  job.pass = mpSUMZ;
+  job.x = maxlogz;
+  minimize_pass(&job);
+  t =  exp(log_unchanging_part - maxlogz) + job.sum[0];
+
   tmp =  (maxlogz + log(t))/R;
 /*   printf("t =%f maxlogz = %f logZ/R = %f\n", t, maxlogz, tmp); */
 
@@ -3146,10 +5161,10 @@ void fill_ref_vars(learner_t *learner, l_item_t *k, char *tok) {
   l_item_t *l;
 
   /* weight of the r-th order excursion */
-  k->tmp.min.dref = PACK_RWEIGHTS(calc_learner_digramic_excursion(learner,tok));
+  MINVARS(learner, k).dref = PACK_RWEIGHTS(calc_learner_digramic_excursion(learner,tok));
 
   /* for each suffix of tok, add its weight */
-  k->tmp.min.ltrms = PACK_LWEIGHTS(0.0);
+  MINVARS(learner, k).ltrms = PACK_LWEIGHTS(0.0);
 
   if( tok && *tok ) {
     e = strchr(tok + 1, EOTOKEN);
@@ -3158,7 +5173,7 @@ void fill_ref_vars(learner_t *learner, l_item_t *k, char *tok) {
 	id = hash_partial_token(t, e - t, e);
 	l = find_in_learner(learner, id); 
 	if( l ) {
-	  k->tmp.min.ltrms += PACK_LWEIGHTS(UNPACK_LAMBDA(l->lam));
+	  MINVARS(learner, k).ltrms += PACK_LWEIGHTS(UNPACK_LAMBDA(l->lam));
 	}
       }
     }
@@ -3192,25 +5207,130 @@ void fill_ref_vars(learner_t *learner, l_item_t *k, char *tok) {
  * orders < r (not r). On return, kappa contains the reference probability
  * mass of the set of all features <= r (including r).
  */
+/* reads the temporary token file once and remembers, for each token,
+   its hash slot, its digramic excursion and the slots of its suffixes.
+   recalculate_reference_measure() then needs no string work. Needs the
+   final digrams and a hash that no longer changes. */
+/* adds the slot of suffix id sid, if learned, to rt. Returns false
+   (having freed the cache) if out of memory. */
+static bool_t ref_cache_add_suffix(learner_t *learner, ref_token_t *rt,
+				   hash_value_t sid) {
+  l_item_t *l;
+  hash_count_t *sp;
+
+  l = find_in_learner(learner, sid);
+  if( l ) {
+    if( learner->ref.suf_count >= learner->ref.suf_max ) {
+      sp = (hash_count_t *)
+	realloc(learner->ref.suf, 
+		(2 * learner->ref.suf_max + 64) * sizeof(hash_count_t));
+      if( !sp ) {
+	myfree_ref_cache(learner);
+	return 0;
+      }
+      learner->ref.suf = sp;
+      learner->ref.suf_max = 2 * learner->ref.suf_max + 64;
+    }
+    learner->ref.suf[learner->ref.suf_count++] = l - learner->hash;
+    rt->nsuf++;
+  }
+  return 1;
+}
+
+void build_ref_cache(learner_t *learner) {
+  hash_value_t id;
+  byte_t buf[BUFSIZ+1];
+  char tok[(MAX_TOKEN_LEN+1)*MAX_SUBMATCH+EXTRA_TOKEN_LEN];
+  size_t n = 0;
+  const byte_t *p;
+  char *q, *t, *e;
+  l_item_t *k;
+  ref_token_t *rt;
+  intern_entry_t *ie;
+  int x;
+
+  myfree_ref_cache(learner);
+  learner->ref.tok = (ref_token_t *)
+    malloc((learner->unique_token_count + 1) * sizeof(ref_token_t));
+  if( !learner->ref.tok || !tmp_seek_start(learner) ) {
+    myfree_ref_cache(learner);
+    return;
+  }
+
+  q = tok;
+  while( (n = tmp_read_block(learner, buf, BUFSIZ, &p)) > 0 ) {
+    while( n-- > 0 ) {
+      if( *p != TOKENSEP ) {
+	if( q < tok + sizeof(tok) - 1 ) {
+	  *q++ = *p; /* copy into tok */
+	}
+      } else { /* interword space */ 
+	*q = 0; /* append NUL to tok */
+	id = hash_full_token(tok);
+	k = find_in_learner(learner, id); 
+	if( k && (get_token_order(tok) == k->typ.order) &&
+	    (learner->ref.count <= learner->unique_token_count) ) {
+	  rt = &learner->ref.tok[learner->ref.count++];
+	  rt->slot = k - learner->hash;
+	  rt->dref = calc_learner_digramic_excursion(learner, tok);
+	  rt->suf = learner->ref.suf_count;
+	  rt->nsuf = 0;
+
+	  /* same suffixes as fill_ref_vars(), another category may
+	     already have hashed them */
+	  ie = intern_token(tok, id);
+	  if( ie && (ie->nsuf != INTERN_NOSUF) ) {
+	    for(x = 0; x < ie->nsuf; x++) {
+	      if( !ref_cache_add_suffix(learner, rt, ie->suf[x]) ) {
+		return;
+	      }
+	    }
+	  } else {
+	    e = tok[0] ? strchr(tok + 1, EOTOKEN) : NULL;
+	    for( t = tok + 1; e && (t + 1 < e); t++ ) {
+	      if( (*t == DIAMOND) &&
+		  !ref_cache_add_suffix(learner, rt, 
+					hash_partial_token(t, e - t, e)) ) {
+		return;
+	      }
+	    }
+	  }
+	}
+	q = tok; /* reset q */
+      }
+      p++;
+    }
+  }
+}
+
+void myfree_ref_cache(learner_t *learner) {
+  if( learner->ref.tok ) {
+    free(learner->ref.tok);
+  }
+  if( learner->ref.suf ) {
+    free(learner->ref.suf);
+  }
+  memset(&learner->ref, 0, sizeof(learner->ref));
+}
+
 score_t recalculate_reference_measure(learner_t *learner, token_order_t r, score_t *kappa) {
   hash_value_t id;
   byte_t buf[BUFSIZ+1];
-  //char tok[(MAX_TOKEN_LEN+1)*MAX_SUBMATCH+EXTRA_TOKEN_LEN];
-  char tok[8192];
+  char tok[(MAX_TOKEN_LEN+1)*MAX_SUBMATCH+EXTRA_TOKEN_LEN];
   size_t n = 0;
-  int counter =0, max_val=0;
   const byte_t *p;
   char *q;
 
   l_item_t *k, *i;
+  hash_count_t c, e;
+  ref_token_t *rt;
+  hash_count_t *sp;
 
   score_t tmp, lunch;
   score_t R = (score_t)r;
   score_t max = 0.0;
   score_t mykappa = 0.0;
 
-  max_val = (MAX_TOKEN_LEN+1)*MAX_SUBMATCH+EXTRA_TOKEN_LEN;
-
 #ifdef DEBUG
   LOG(stderr,"recalculate_reference_measure: called \n");
 #endif
@@ -3221,7 +5341,32 @@ score_t recalculate_reference_measure(learner_t *learner, token_order_t r, score
 
   /* now we calculate the logarithmic word weight
      from the digram model, for each token in the hash */
-  if( !tmp_seek_start(learner) ) {
+  if( learner->ref.tok ) {
+    for(rt = learner->ref.tok; rt < learner->ref.tok + learner->ref.count; rt++) {
+      k = learner->hash + rt->slot;
+      if( k->typ.order == r ) {
+	/* as fill_ref_vars() */
+	MINVARS(learner, k).dref = PACK_RWEIGHTS(rt->dref);
+	MINVARS(learner, k).ltrms = PACK_LWEIGHTS(0.0);
+	for(sp = learner->ref.suf + rt->suf; 
+	    sp < learner->ref.suf + rt->suf + rt->nsuf; sp++) {
+	  MINVARS(learner, k).ltrms += 
+	    PACK_LWEIGHTS(UNPACK_LAMBDA(learner->hash[*sp].lam));
+	}
+      } else if( (k->typ.order < r) && NOTNULL(k->lam) ) {
+	/* assume ref_vars were already filled */
+	tmp = R * UNPACK_LAMBDA(k->lam) + 
+	  R * UNPACK_LWEIGHTS(MINVARS(learner, k).ltrms) +
+	  UNPACK_RWEIGHTS(MINVARS(learner, k).dref);
+	if( max < tmp ) {
+	  max = tmp;
+	}
+      }
+      if( k->typ.order <= r ) {
+	mykappa += exp(UNPACK_RWEIGHTS(MINVARS(learner, k).dref));
+      }
+    }
+  } else if( !tmp_seek_start(learner) ) {
     errormsg(E_ERROR, "cannot seek in temporary token file, reference weights not calculated.\n");
   } else {
 
@@ -3229,10 +5374,11 @@ score_t recalculate_reference_measure(learner_t *learner, token_order_t r, score
     while( (n = tmp_read_block(learner, buf, BUFSIZ, &p)) > 0 ) {
 /*       p = buf; */
 /*       p[n] = '\0'; */
-      while( n-- > 0 && counter < max_val  ) {
+      while( n-- > 0 ) {
 	if( *p != TOKENSEP) {
-          counter++; 
-	  *q++ = *p; /* copy into tok */
+	  if( q < tok + sizeof(tok) - 1 ) {
+	    *q++ = *p; /* copy into tok, long tokens are truncated */
+	  }
 	} else { /* interword space */ 
 	  *q = 0; /* append NUL to tok */
 	  /* now write weight in hash */
@@ -3246,14 +5392,14 @@ score_t recalculate_reference_measure(learner_t *learner, token_order_t r, score
 		/* assume ref_vars were already filled */
 		if( NOTNULL(k->lam) ) {
 		  tmp = R * UNPACK_LAMBDA(k->lam) + 
-		    R * UNPACK_LWEIGHTS(k->tmp.min.ltrms) +
-		    UNPACK_RWEIGHTS(k->tmp.min.dref);
+		    R * UNPACK_LWEIGHTS(MINVARS(learner, k).ltrms) +
+		    UNPACK_RWEIGHTS(MINVARS(learner, k).dref);
 		  if( max < tmp ) {
 		    max = tmp;
 		  }
 		}
 	      }
-	      mykappa += exp(UNPACK_RWEIGHTS(k->tmp.min.dref));
+	      mykappa += exp(UNPACK_RWEIGHTS(MINVARS(learner, k).dref));
 	    }
 	  }
 	  q = tok; /* reset q */
@@ -3264,13 +5410,15 @@ score_t recalculate_reference_measure(learner_t *learner, token_order_t r, score
   }
 
   lunch = 1.0;
-  k = learner->hash + learner->max_tokens;
-  for(i = learner->hash; i != k; i++) {
+  e = learner->order_index ? learner->order_start[(r < MAX_SUBMATCH) ? r : MAX_SUBMATCH] :
+    learner->max_tokens;
+  for(c = 0; c < e; c++) {
+    i = learner->hash + (learner->order_index ? learner->order_index[c] : c);
     if( FILLEDP(i) ) {
       if( i->typ.order < r ) {
 	if( NOTNULL(i->lam) ) {
-	  tmp = -max + R * UNPACK_LWEIGHTS(i->tmp.min.ltrms) + 
-	    UNPACK_RWEIGHTS(i->tmp.min.dref);
+	  tmp = -max + R * UNPACK_LWEIGHTS(MINVARS(learner, i).ltrms) + 
+	    UNPACK_RWEIGHTS(MINVARS(learner, i).dref);
 	  lunch += (exp(R * UNPACK_LAMBDA(i->lam) + tmp) - exp(tmp));
 	}
       }
@@ -3302,15 +5450,15 @@ void print_score(learner_t *learner, token_order_t r) {
       logprob += learner->hash[i].count * (learner->hash[i].lam);
       if( learner->hash[i].typ.order == 1 ) {
 	logprob += learner->hash[i].count * 
-	  UNPACK_RWEIGHTS(learner->hash[i].tmp.min.dref)/((weight_t)r);
+	  UNPACK_RWEIGHTS(learner->mins[i].dref)/((weight_t)r);
       }
     }
     if( FILLEDP(&learner->hash[i]) &&
 	(learner->hash[i].typ.order == r) ) {
       lpapprox += learner->hash[i].count * 
 	((learner->hash[i].lam) + 
-	 UNPACK_LWEIGHTS(learner->hash[i].tmp.min.ltrms) + 
-	 UNPACK_RWEIGHTS(learner->hash[i].tmp.min.dref)/((weight_t)r));
+	 UNPACK_LWEIGHTS(learner->mins[i].ltrms) + 
+	 UNPACK_RWEIGHTS(learner->mins[i].dref)/((weight_t)r));
     }
 
   }
@@ -3331,8 +5479,8 @@ void print_score(learner_t *learner, token_order_t r) {
 
 /* experimental: this sounded like a good idea, but isn't ?? */
 void theta_rescale(learner_t *learner, token_order_t r, score_t logupz, score_t Xi, bool_t fwd) {
-  register l_item_t *i, *e;
-  register token_count_t c = 0;
+  l_item_t *i, *e;
+  token_count_t c = 0;
 
   score_t tmp;
   score_t theta =0.0;
@@ -3350,8 +5498,8 @@ void theta_rescale(learner_t *learner, token_order_t r, score_t logupz, score_t
     if( FILLEDP(i) && (i->typ.order == r) ) {
       if( NOTNULL(i->lam) ) {
 	s += i->count;
-	tmp = R * UNPACK_LWEIGHTS(i->tmp.min.ltrms) + 
-	  UNPACK_RWEIGHTS(i->tmp.min.dref);
+	tmp = R * UNPACK_LWEIGHTS(MINVARS(learner, i).ltrms) + 
+	  UNPACK_RWEIGHTS(MINVARS(learner, i).dref);
 	if( tmp > msum1 ) {
 	  msum1 = tmp;
 	}
@@ -3379,8 +5527,8 @@ void theta_rescale(learner_t *learner, token_order_t r, score_t logupz, score_t
       i != e; fwd ? i++ : i--) {
     if( FILLEDP(i) && (i->typ.order == r) ) {
       if( NOTNULL(i->lam) ) {
-	tmp = R * UNPACK_LWEIGHTS(i->tmp.min.ltrms) + 
-	  UNPACK_RWEIGHTS(i->tmp.min.dref);
+	tmp = R * UNPACK_LWEIGHTS(MINVARS(learner, i).ltrms) + 
+	  UNPACK_RWEIGHTS(MINVARS(learner, i).dref);
 	sum1 += exp(tmp - msum1);
 	tmp += R * UNPACK_LAMBDA(i->lam);
 	sum2 += exp(tmp - msum2);
@@ -3418,17 +5566,20 @@ void theta_rescale(learner_t *learner, token_order_t r, score_t logupz, score_t
 /* minimizes the divergence by solving for lambda one 
    component at a time.  */
 void minimize_learner_divergence(learner_t *learner) {
-  l_item_t *i, *e;
+  minimize_job_t job;
   token_order_t r;
-  token_count_t lzero, c = 0;
+  token_count_t lzero;
   int itcount, mcount;
-  score_t d, dd, b;
-  score_t lam_delta, old_lam, new_lam;
+  score_t d, dd;
+  score_t lam_delta;
   score_t logzonr, old_logzonr;
   score_t logupz, div_extra_bits, kappa, thresh;
   score_t R, Xi, logXi;
   score_t mp_logz;
   bool_t fwd = 1;
+  bool_t marked_only, converged;
+  int marked_its, total_its = 0;
+  score_t omega;
 
   if( u_options & (1<<U_OPTION_VERBOSE) ) {
     LOG(stdout, "now maximizing model entropy\n");
@@ -3448,7 +5599,6 @@ void minimize_learner_divergence(learner_t *learner) {
     qtol_multipass = 0;
   }
 
-  e = learner->hash + learner->max_tokens;
   for(mcount = 0; mcount < (qtol_multipass ? 50 : 1); mcount++) {
     for(r = 1; 
 	r <= ((m_options & (1<<M_OPTION_MULTINOMIAL)) ? 1 : learner->max_order); 
@@ -3467,14 +5617,13 @@ void minimize_learner_divergence(learner_t *learner) {
 	div_extra_bits = 0.0;
       } else {
       /* calculate extra bits for divergence score display */
-	b = 0.0;
-
-	for(i = learner->hash; i != e; i++) {
-	  if( FILLEDP(i) && (i->typ.order < r) ) {
-	    b += UNPACK_LAMBDA(i->lam) * (score_t)i->count;
-	  }
-	}
-	div_extra_bits = b/Xi;
+	job.learner = learner;
+	job.pass = mpEXTRA_BITS;
+	job.r = r;
+	job.fwd = 1;
+	job.marked_only = 0;
+	minimize_pass(&job);
+	div_extra_bits = job.sum[0]/Xi;
       }
 
       if( m_options & (1<<M_OPTION_REFMODEL) ) {
@@ -3496,6 +5645,11 @@ void minimize_learner_divergence(learner_t *learner) {
 
       itcount = 0;
       thresh = 0.0;
+      /* when warm, the unmarked lambdas are already close, so we
+	 first settle the marked ones, then go on with everything */
+      marked_only = learner->warm;
+      marked_its = 0;
+      omega = (u_options & (1<<U_OPTION_OVERRELAX)) ? OVERRELAX_OMEGA : 1.0;
       do {
 	itcount++;
 	lzero= 0;
@@ -3506,51 +5660,20 @@ void minimize_learner_divergence(learner_t *learner) {
 	lam_delta = 0.0;
 
 
-	c = 0;
-	for(i = learner->hash; i != e; i++) {
-	  if( FILLEDP(i) && (i->typ.order == r) 
-/* 	    && (rand() > RAND_MAX/2)  */
-	      ) { 
-
-	    old_lam = UNPACK_LAMBDA(i->lam);
-
-	    if( (i->typ.order == 1) || (i->count > ftreshold) ) {
-	      /* "iterative scaling" lower bound */
-	      new_lam = (log((score_t)i->count) - logXi -  
-			 UNPACK_RWEIGHTS(i->tmp.min.dref))/R + logzonr -
-		UNPACK_LWEIGHTS(i->tmp.min.ltrms);
-	    } else {
-	      new_lam = 0.0;
-	    }
-
-	    if( isnan(new_lam) ) {
-	      /* precision problem, just ignore, don't change lambda */
-	      logzonr = learner_logZ(learner, r, logupz, fwd);
-	      thresh = 0.0;
-	    } else {
-	      
-	      /* this code shouldn't be necessary, but is crucial */
-	      if( new_lam > (old_lam + MAX_LAMBDA_JUMP) ) {
-		new_lam = (old_lam + MAX_LAMBDA_JUMP);
-	      } else if( new_lam < (old_lam - MAX_LAMBDA_JUMP) ) {
-		new_lam = (old_lam - MAX_LAMBDA_JUMP);
-	      }
-
-	      /* don't want negative weights */
-	      if( new_lam < 0.0 ) { new_lam = 0.0; lzero++; }
-
-	      if( lam_delta < fabs(new_lam - old_lam) ) {
-		lam_delta = fabs(new_lam - old_lam);
-	      }
-	      i->lam = PACK_LAMBDA(new_lam);
-	    }
-
-	    if( ++c >= learner->fixed_order_unique_token_count[r] ) {
-	      c = 0;
-	      break;
-	    }
-	  }
-
+	job.learner = learner;
+	job.pass = mpLAMBDA;
+	job.r = r;
+	job.x = logzonr;
+	job.logXi = logXi;
+	job.fwd = fwd;
+	job.marked_only = marked_only;
+	job.omega = omega;
+	minimize_pass(&job);
+	lam_delta = job.max[0];
+	lzero = job.lzero[0];
+	if( job.nan[0] ) {
+	  /* some lambdas were left unchanged, logZ is recomputed below */
+	  thresh = 0.0;
 	}
 
 /* 	theta_rescale(r, logupz, Xi, fwd); */
@@ -3563,16 +5686,44 @@ void minimize_learner_divergence(learner_t *learner) {
 	if( u_options & (1<<U_OPTION_VERBOSE) ) {
 /* 	LOG(stdout, "lzero = %ld\n", lzero); */
 	  LOG(stdout, "entropy change %" FMT_printf_score_t \
-		  " --> %" FMT_printf_score_t " (%10f, %10f)\n", 
+		  " --> %" FMT_printf_score_t " (%10f, %10f)", 
 		  d + div_extra_bits, 
 		  dd + div_extra_bits,
 		  lam_delta, fabs(logzonr - old_logzonr));
+	  if( u_options & (1<<U_OPTION_OVERRELAX) ) {
+	    LOG(stdout, " omega %.2f zero %ld", (double)omega, (long)lzero);
+	  }
+	  LOG(stdout, "\n");
+	}
+
+	if( (omega != 1.0) && (dd < d) ) {
+	  /* overshot (entropy went down), fall back to plain scaling */
+	  omega = 1.0;
+#ifdef STATS
+	  minimize_fallbacks++;
+#endif
 	}
 
 	process_pending_signal(NULL);
+
+	converged = !((fabs(d - dd) > qtol_div) || (lam_delta > qtol_lam) ||
+		      (fabs(logzonr - old_logzonr) > qtol_logz));
+	if( marked_only && (converged || (itcount >= 50)) ) {
+	  /* the marked items have settled, or never will, either way
+	     everything must get its full passes */
+	  marked_only = 0;
+	  converged = 0;
+	  marked_its = itcount;
+	  itcount = 0;
+	}
       
-      } while( ((fabs(d - dd) > qtol_div) || (lam_delta > qtol_lam) ||
-		(fabs(logzonr - old_logzonr) > qtol_logz)) && (itcount < 50) );
+      } while( !converged && (itcount < 50) );
+
+      total_its += itcount + marked_its;
+      if( u_options & (1<<U_OPTION_VERBOSE) ) {
+	LOG(stdout, "order %d %s after %d iterations (%d on changed weights only)\n",
+	    r, converged ? "converged" : "stopped", itcount + marked_its, marked_its);
+      }
 
       learner->logZ = logzonr;
       learner->divergence = dd + div_extra_bits;
@@ -3583,6 +5734,12 @@ void minimize_learner_divergence(learner_t *learner) {
     }
     mp_logz = learner->logZ;
   }
+  if( u_options & (1<<U_OPTION_VERBOSE) ) {
+    LOG(stdout, "%d lambda iterations in total\n", total_its);
+  }
+#ifdef STATS
+  minimize_iterations += total_its;
+#endif
 #ifdef DEBUG
   LOG(stderr,"Exiting minimize_learner_divergence \n");
 #endif
@@ -3661,7 +5818,7 @@ void dump_model(learner_t *learner, FILE *out, FILE *in) {
 	  k = find_in_learner(learner, id); /* guaranteed to be found */
 	  fprintf(out, MAGIC_DUMPTBL_o, 
 		  (weight_t)UNPACK_LAMBDA(k->lam), 
-		  UNPACK_RWEIGHTS(k->tmp.min.dref), k->count, 
+		  UNPACK_RWEIGHTS(MINVARS(learner, k).dref), k->count, 
 		  (long unsigned int)k->id);
 	  print_token(out, tok);
 	  fprintf(out, "\n");
@@ -3695,7 +5852,8 @@ void dump_model(learner_t *learner, FILE *out, FILE *in) {
    
    WARNING: THIS USES cat[0], SO IS NOT COMPATIBLE WITH CLASSIFYING.
  */
-void learner_prefill_lambdas(learner_t *learner, category_t **pxcat) {
+void learner_prefill_lambdas(learner_t *learner, category_t **pxcat,
+			     bool_t prefill) {
   hash_count_t c;
   c_item_t *i, *e;
   l_item_t *k;
@@ -3703,13 +5861,16 @@ void learner_prefill_lambdas(learner_t *learner, category_t **pxcat) {
 
   *pxcat = NULL;
   xcat->fullfilename = strdup(learner->filename);
-  if( open_category(cat) ) {
+  /* without prefilling, only the shadow metadata is needed */
+  if( prefill ? open_category(xcat) : open_category_header(xcat) ) {
     if( xcat->m_options & (1<<M_OPTION_WARNING_BAD) ) {
       if( u_options & (1<<U_OPTION_VERBOSE) ) {
 	errormsg(E_WARNING, "old category file %s may have bad data\n",
 		xcat->fullfilename);
       }
-    } else if( (xcat->m_options == m_options) &&
+    } else if( prefill &&
+	       (xcat->id_width == NATIVE_ID_WIDTH) &&
+	       (xcat->m_options == m_options) &&
 	       (xcat->retype == learner->retype) &&
 	       (fabs((xcat->model_unique_token_count/
 		      (double)learner->unique_token_count) - 1.0) < 0.15) ) {
@@ -3754,17 +5915,198 @@ void learner_prefill_lambdas(learner_t *learner, category_t **pxcat) {
 }
 
 
+/* the persistent heap chunk holding the lambda cache of this learner.
+   Returns the full name to check, or NULL if it can't be cached */
+static const char *lambda_cache_rqst(learner_t *learner, 
+				     struct rqst_struct *rqst) {
+  const char *fn = learner->filename ? learner->filename : "";
+  hash_value_t name;
+
+  if( strlen(fn) >= LAMBDA_CACHE_NAME ) {
+    return NULL;
+  }
+  name = (hash_value_t)::hash((unsigned char *)fn, strlen(fn), 0);
+  memset(rqst, 0, sizeof(*rqst));
+  rqst->pid = PROC_ID;
+  rqst->id = LAMBDA_CACHE_CHUNK + (name % LAMBDA_CACHE_CHUNKS);
+  return fn;
+}
+
+/* the persistent heap bookkeeping isn't safe for concurrent
+   learners, e.g. the forked ones of the driver */
+static int lambda_cache_lock() {
+  int fd;
+
+  fd = open(LAMBDA_CACHE_LOCK, O_RDWR|O_CREAT, 0644);
+  if( (fd >= 0) && (flock(fd, LOCK_EX) < 0) ) {
+    close(fd);
+    fd = -1;
+  }
+  return fd;
+}
+
+static void lambda_cache_unlock(int fd) {
+  flock(fd, LOCK_UN);
+  close(fd);
+}
+
+/* an existing cache chunk, whether or not it holds valid lambdas */
+static lambda_cache_t *lambda_cache_chunk(struct rqst_struct *rqst) {
+  lambda_cache_t *lc;
+
+  lc = (lambda_cache_t *)pnvread(sizeof(lambda_cache_t), rqst);
+  if( !lc || (lc->max_tokens == 0) || 
+      (lc->max_tokens & (lc->max_tokens - 1)) ) {
+    return NULL;
+  }
+  return (lambda_cache_t *)
+    pnvread(sizeof(lambda_cache_t) + 
+	    lc->max_tokens * sizeof(lambda_cache_item_t), rqst);
+}
+
+/* gives each item which has no lambda yet the one it had after the
+   last optimization of this category, if any. Unlike
+   learner_prefill_lambdas(), this doesn't care how much the category
+   has changed since. */
+void learner_seed_lambdas(learner_t *learner) {
+#ifdef USE_NVMALLOC
+  struct rqst_struct rqst;
+  const char *name;
+  lambda_cache_t *lc;
+  lambda_cache_item_t *li;
+  hash_count_t c, j, mask;
+  l_item_t *k, *e;
+  long seeded = 0;
+  int fd;
+
+  if( !(u_options & (1<<U_OPTION_LAMBDA_CACHE)) ||
+      !(name = lambda_cache_rqst(learner, &rqst)) ||
+      ((fd = lambda_cache_lock()) < 0) ) {
+    return;
+  }
+  lc = lambda_cache_chunk(&rqst);
+  if( lc && (lc->magic == LAMBDA_CACHE_MAGIC) && !strcmp(lc->name, name) ) {
+    li = (lambda_cache_item_t *)(lc + 1);
+    mask = lc->max_tokens - 1;
+
+    e = learner->hash + learner->max_tokens;
+    for(k = learner->hash; k != e; k++) {
+      if( FILLEDP(k) && !NOTNULL(k->lam) ) {
+	for(c = 0, j = k->id & mask; (c <= mask) && li[j].id; c++, j = (j + 1) & mask) {
+	  if( li[j].id == k->id ) {
+	    k->lam = PACK_LAMBDA(li[j].lam);
+	    seeded++;
+	    break;
+	  }
+	}
+      }
+    }
+  }
+  lambda_cache_unlock(fd);
+
+  if( u_options & (1<<U_OPTION_VERBOSE) ) {
+    fprintf(stdout, "seeded %ld token weights from the lambda cache\n", seeded);
+  }
+#ifdef STATS
+  lambda_cache_seeded += seeded;
+#endif
+#endif
+}
+
+/* saves the optimized lambdas of all the learner's items. An existing
+   chunk is reused, and keeps only as many items as it has room for */
+void learner_store_lambdas(learner_t *learner) {
+#ifdef USE_NVMALLOC
+  struct rqst_struct rqst;
+  const char *name;
+  lambda_cache_t *lc;
+  lambda_cache_item_t *li;
+  hash_count_t j, mask, max;
+  l_item_t *k, *e;
+  int fd;
+
+  if( !(u_options & (1<<U_OPTION_LAMBDA_CACHE)) ||
+      !(name = lambda_cache_rqst(learner, &rqst)) ||
+      ((fd = lambda_cache_lock()) < 0) ) {
+    return;
+  }
+
+  lc = lambda_cache_chunk(&rqst);
+  if( lc ) {
+    if( (lc->magic == LAMBDA_CACHE_MAGIC) && strcmp(lc->name, name) ) {
+      if( u_options & (1<<U_OPTION_VERBOSE) ) {
+	errormsg(E_WARNING, "the lambda cache of %s is used by %s\n",
+		 name, lc->name);
+      }
+      lambda_cache_unlock(fd);
+      return;
+    }
+    max = lc->max_tokens;
+  } else {
+    /* load factor at most 1/4 to begin with, as the chunk can't grow */
+    for(max = 64; max < 4 * learner->unique_token_count; max *= 2);
+    rqst.bytes = sizeof(lambda_cache_t) + max * sizeof(lambda_cache_item_t);
+    lc = (lambda_cache_t *)pnvmalloc(rqst.bytes, &rqst);
+    if( !lc ) {
+      if( u_options & (1<<U_OPTION_VERBOSE) ) {
+	errormsg(E_WARNING, "could not allocate the lambda cache\n");
+      }
+      lambda_cache_unlock(fd);
+      return;
+    }
+    lc->max_tokens = max;
+  }
+  lc->magic = 0; /* so a torn write isn't used */
+
+  li = (lambda_cache_item_t *)(lc + 1);
+  memset(li, 0, max * sizeof(lambda_cache_item_t));
+  mask = max - 1;
+  lc->count = 0;
+
+  e = learner->hash + learner->max_tokens;
+  for(k = learner->hash; k != e; k++) {
+    if( FILLEDP(k) && NOTNULL(k->lam) && (lc->count < max/2) ) {
+      for(j = k->id & mask; li[j].id; j = (j + 1) & mask);
+      li[j].id = k->id;
+      li[j].lam = UNPACK_LAMBDA(k->lam);
+      lc->count++;
+    }
+  }
+  strcpy(lc->name, name);
+  lc->magic = LAMBDA_CACHE_MAGIC; /* last */
+  pnvcommit(&rqst);
+  lambda_cache_unlock(fd);
+#endif
+}
+
 void optimize_and_save(learner_t *learner) {
 
   hash_count_t i;
   token_order_t c;
   category_t *opencat = NULL;
+  weight_t *digram_copy = NULL;
+  weight_t *d, t;
+#ifdef STATS
+  struct timeval start, end;
+  gettimeofday(&start, NULL);
+#endif
 
 #ifdef NVRAM
-  create_online_file();
-  initialize_tmp_file(); 
+  if( !main_learner || (learner == main_learner) ) {
+    create_online_file();
+    initialize_tmp_file(); 
+  }
 #endif
 
+  sort_count_finish(learner);
+
+  /* from here on, we walk the hash table directly */
+  if( learner->old.hash ) {
+    migrate_learner_hash(learner, learner->old.max_tokens);
+  }
+  flush_digram_counts(learner);
+  compact_token_list(learner);
+
 #ifdef STATS
     //number of tokens generated for input
     //all input test file sizes are same, so lets not
@@ -3798,15 +6140,21 @@ void optimize_and_save(learner_t *learner) {
 	    "calculating reference word weights\n");
   }
 
+  /* the online dump is written after minimization, so that the next
+     run can start from these lambdas. It needs the digram counts,
+     which the smoothing below replaces. Without unigrams the orders
+     are collapsed below, and the dump must keep the real ones, so
+     then it is written now and holds no solution */
   if( *online ) {
-
-#ifdef DEBUG
-    LOG(stderr, "WRITING ONLINE STRUCTURE \n");
-#endif
-    write_online_learner_struct(learner, online);
-#ifdef DEBUG
-    LOG(stderr, "After write_online_learner_struct \n");
-#endif
+    if( learner->fixed_order_token_count[1] > 0 ) {
+      digram_copy = (weight_t *)malloc(sizeof(learner->dig));
+    }
+    if( digram_copy ) {
+      memcpy(digram_copy, learner->dig, sizeof(learner->dig));
+    } else {
+      learner->warm = 0;
+      write_online_learner_struct(learner, online);
+    }
   }
 
   /* transposition smoothing */
@@ -3837,6 +6185,8 @@ void optimize_and_save(learner_t *learner) {
 	    "         because I don't!\n\n");
 
     m_options |= (1<<M_OPTION_MULTINOMIAL);
+    learn_word = select_learn_word();
+    learner->warm = 0; /* orders changed */
     for(c = 2; c <= learner->max_order; c++) {
       learner->fixed_order_token_count[1] += learner->fixed_order_token_count[c];
       learner->fixed_order_unique_token_count[1] += 
@@ -3856,11 +6206,51 @@ void optimize_and_save(learner_t *learner) {
 
   /* if the category already exists, we read its lambda values.
      this should speed up the minimization slightly */
-  if( u_options & (1<<U_OPTION_NOZEROLEARN) ) {
-    learner_prefill_lambdas(learner, &opencat);
+  if( u_options & ((1<<U_OPTION_NOZEROLEARN)|(1<<U_OPTION_SHADOW)) ) {
+    learner_prefill_lambdas(learner, &opencat, 
+			    (u_options & (1<<U_OPTION_NOZEROLEARN)) ? 1 : 0);
+  }
+  learner_seed_lambdas(learner);
+
+  learner->mins = (l_min_t *)calloc(learner->max_tokens, sizeof(l_min_t));
+  if( !learner->mins ) {
+    errormsg(E_FATAL, "not enough memory for minimization (%li bytes)\n",
+	     (sizeof(l_min_t) * ((long int)learner->max_tokens)));
   }
 
+  build_order_index(learner);
+#ifndef NO_REF_CACHE
+  build_ref_cache(learner);
+#endif
   minimize_learner_divergence(learner);
+  myfree_ref_cache(learner);
+  myfree_order_index(learner);
+
+  /* every lambda is now up to date */
+  for(i = 0; i < learner->max_tokens; i++) {
+    learner->hash[i].dirty = 0;
+  }
+  learner_store_lambdas(learner);
+
+  if( *online && digram_copy ) {
+    learner->warm = 1;
+    /* swap the counts back in for the dump */
+    d = &learner->dig[0][0];
+    for(i = 0; i < ASIZE * ASIZE; i++) {
+      t = digram_copy[i];
+      digram_copy[i] = d[i];
+      d[i] = t;
+    }
+#ifdef DEBUG
+    LOG(stderr, "WRITING ONLINE STRUCTURE \n");
+#endif
+    write_online_learner_struct(learner, online);
+#ifdef DEBUG
+    LOG(stderr, "After write_online_learner_struct \n");
+#endif
+    memcpy(learner->dig, digram_copy, sizeof(learner->dig));
+    free(digram_copy);
+  }
 
 #ifdef DEBUG
    LOG(stderr,"before calc_shannon \n");
@@ -3871,6 +6261,8 @@ void optimize_and_save(learner_t *learner) {
   if( u_options & (1<<U_OPTION_DUMP) ) {
     dump_model(learner, stdout, learner->tmp.file);
   }
+  free(learner->mins);
+  learner->mins = NULL;
 
   tmp_close(learner);
 
@@ -3892,10 +6284,19 @@ void optimize_and_save(learner_t *learner) {
  #endif 
     save_learner(learner);    
 #else
-    nvram_save_learner(learner);
+    if( learner->outfp ) {
+      nvram_save_learner(learner);
+    } else {
+      save_learner(learner);
+    }
 #endif
   }
   if( opencat ) { free_category(opencat); }
+#ifdef STATS
+  gettimeofday(&end, NULL);
+  optimize_time += (end.tv_sec - start.tv_sec) * 1000000 +
+    (end.tv_usec - start.tv_usec);
+#endif
 }
 
 /***********************************************************
@@ -3940,27 +6341,190 @@ char *handle_indents_and_appends(char *textbuf) {
 /***********************************************************
  * MAIN FUNCTIONS                                          *
  ***********************************************************/
+/* parses a -Y argument ORDER:BITS:SMOOTHING:CATEGORY, where the first
+   three fields may be left empty to use the -w, -h and -L settings */
+void add_extra_model(char *arg) {
+  extra_model_t *m;
+  char *f[4];
+  int k;
+
+  if( extra_model_count >= MAX_EXTRA_MODELS ) {
+    errormsg(E_FATAL, "at most %d -Y models can be learned at once\n",
+	     MAX_EXTRA_MODELS);
+  }
+  f[0] = arg;
+  for(k = 1; k < 4; k++) {
+    f[k] = f[k-1] ? strchr(f[k-1], ':') : NULL;
+    if( f[k] ) { *f[k]++ = '\0'; }
+  }
+  if( !f[3] || !*f[3] ) {
+    errormsg(E_FATAL, "the -Y switch needs ORDER:BITS:SMOOTHING:CATEGORY\n");
+  }
+
+  m = &extra_models[extra_model_count];
+  memset(m, 0, sizeof(extra_model_t));
+  m->order = *f[0] ? atoi(f[0]) : 0;
+  if( (m->order < 0) || (m->order > 7) ) {
+    errormsg(E_FATAL, "the -Y order must be a number between 0 and 7, "
+	     "0 keeps the -w order\n");
+  }
+  m->bits = *f[1] ? atoi(f[1]) : 0;
+  if( m->bits > MAX_HASH_BITS ) {
+    errormsg(E_WARNING, "maximum hash size will be 2^%d\n", MAX_HASH_BITS);
+    m->bits = MAX_HASH_BITS;
+  }
+  if( !*f[2] ) {
+    m->smoothing = 0;
+  } else if( !strcmp(f[2], "uniform") ) {
+    m->smoothing = U_OPTION_LAPLACE;
+  } else if( !strcmp(f[2], "dirichlet") ) {
+    m->smoothing = U_OPTION_DIRICHLET;
+  } else if( !strcmp(f[2], "maxent") ) {
+    m->smoothing = U_OPTION_JAYNES;
+  } else {
+    errormsg(E_FATAL, "-Y smoothing must be \"uniform\", \"dirichlet\" or \"maxent\"\n");
+  }
+  m->filename = sanitize_path(f[3], extn);
+  if( !*m->filename ) {
+    errormsg(E_FATAL, "category needs a name\n");
+  }
+  extra_model_count++;
+}
+
+/* runs fun on the learner of model m, with the global options it was
+   set up with. The online file and the default hash size belong to
+   the -l learner only. */
+static void with_extra_model(extra_model_t *m, void (*fun)(learner_t *)) {
+  int u = u_options, mo = m_options;
+  char *o = online;
+  hash_bit_count_t hb = default_max_hash_bits;
+  hash_count_t ht = default_max_tokens;
+
+  online = (char *)"";
+  if( m->learner->u_options ) {
+    /* set up already, init_learner() kept a copy of the options */
+    u_options = m->learner->u_options;
+    m_options = m->learner->m_options;
+  } else {
+    if( m->smoothing ) {
+      u_options &= ~((1<<U_OPTION_LAPLACE)|(1<<U_OPTION_DIRICHLET)|
+		     (1<<U_OPTION_JAYNES));
+      u_options |= (1<<m->smoothing);
+    }
+    if( m->bits ) {
+      default_max_hash_bits = m->bits;
+      default_max_tokens = (1<<m->bits);
+    }
+  }
+  (*fun)(m->learner);
+
+  online = o;
+  u_options = u;
+  m_options = mo;
+  default_max_hash_bits = hb;
+  default_max_tokens = ht;
+}
+
+static void init_extra_learner(learner_t *l) {
+  init_learner(l);
+}
+
 void learner_preprocess_fun() {
+  int k;
+  extra_model_t *m;
+
   init_learner(&learner);
+  for(k = 0; k < extra_model_count; k++) {
+    m = &extra_models[k];
+    m->learner = (learner_t *)calloc(1, sizeof(learner_t));
+    if( !m->learner ) {
+      errormsg(E_FATAL, "not enough memory for -Y model %s\n", m->filename);
+    }
+    m->learner->filename = m->filename;
+    m->learner->retype = learner.retype;
+    with_extra_model(m, init_extra_learner);
+  }
+  main_learner = extra_model_count ? &learner : NULL;
+  /* init_learner() may have taken the options from the online dump,
+     or dropped some for lack of memory */
+  learn_word = select_learn_word();
 }
 
 void learner_post_line_fun(char *buf) {
-  count_mbox_messages(&learner, mbox.state, buf);
+  int k;
+  bool_t skip = 0;
+
+  /* all the models learn the same documents */
+  if( buf && (mbox.state == msHEADER) && learner.doc.not_header &&
+      (u_options & (1<<U_OPTION_DECIMATE)) ) {
+    skip = ( rand() > (int)(RAND_MAX>>decimation) );
+  }
+  count_mbox_messages(&learner, mbox.state, buf, skip);
+  for(k = 0; k < extra_model_count; k++) {
+    count_mbox_messages(extra_models[k].learner, mbox.state, buf, skip);
+  }
+}
+
+static void optimize_extra_learner(learner_t *l) {
+  /* the digram counts were all made by the -l learner */
+  memcpy(l->dig, learner.dig, sizeof(learner.dig));
+  optimize_and_save(l);
 }
 
 void learner_postprocess_fun() {
+  int k;
+  if( extra_model_count ) {
+    flush_digram_counts(&learner);
+    for(k = 0; k < extra_model_count; k++) {
+      with_extra_model(&extra_models[k], optimize_extra_learner);
+    }
+  }
   optimize_and_save(&learner);
 }
 
 void learner_cleanup_fun() {
+  int k;
+  for(k = 0; k < extra_model_count; k++) {
+    if( extra_models[k].learner ) {
+      myfree_learner(extra_models[k].learner);
+      free(extra_models[k].learner);
+      extra_models[k].learner = NULL;
+    }
+  }
+  if( extra_model_count ) {
+    ngram_order = main_ngram_order;
+  }
+  extra_model_count = 0;
+  main_learner = NULL;
   myfree_learner(&learner);
 }
 
 void learner_word_fun(char *tok, token_type_t tt, regex_count_t re) {
+  int k;
 #ifdef DEBUG
   //LOG(stderr, "calling learner_word_fun \n");
 #endif
-  hash_word_and_learn(&learner, tok, tt, re);
+  /* one draw per token, shared by all the models */
+  if( (u_options & (1<<U_OPTION_DECIMATE)) &&
+      !(m_options & (1<<M_OPTION_MBOX_FORMAT)) &&
+      (rand() > (int)(RAND_MAX>>decimation)) ) {
+    return;
+  }
+  if( !extra_model_count ) {
+    learn_word(&learner, tok, tt, re);
+  } else {
+    /* the tokenizer runs at the highest order any model needs */
+    if( !(m_options & (1<<M_OPTION_USE_STDTOK)) || 
+	(tt.order <= main_ngram_order) ) {
+      learn_word(&learner, tok, tt, re);
+    }
+    for(k = 0; k < extra_model_count; k++) {
+      if( !(m_options & (1<<M_OPTION_USE_STDTOK)) || 
+	  (tt.order <= extra_models[k].order) ) {
+	learn_word(extra_models[k].learner, tok, tt, re);
+      }
+    }
+  }
 #ifdef DEBUG
   //LOG(stderr, "After learner_word_fun \n");
 #endif
@@ -4201,6 +6765,31 @@ int nvram_set_option(int op, char *optarg, FILE* input, struct MAPLIST  *maplist
   case 'd':
     u_options |= (1<<U_OPTION_DUMP);
     break;
+  case 'K': /* vectorized exp in the partition function */
+    u_options |= (1<<U_OPTION_VEXP);
+    break;
+  case 'O': /* over-relaxed lambda updates */
+    u_options |= (1<<U_OPTION_OVERRELAX);
+    break;
+  case 'B': /* admit frequent tokens into a full hash */
+    u_options |= (1<<U_OPTION_ADMIT);
+    break;
+  case 'b': /* count tokens by sorting, not hashing */
+    u_options |= (1<<U_OPTION_SORTCOUNT);
+    break;
+  case 'C': /* seed and keep lambdas in the persistent lambda cache */
+    u_options |= (1<<U_OPTION_LAMBDA_CACHE);
+    break;
+  case 'W': /* update categories in place, in shadow regions */
+    u_options |= (1<<U_OPTION_SHADOW);
+    break;
+  case 'k': /* size the learner hash from a sample of the input */
+    u_options |= (1<<U_OPTION_ESTIMATE);
+    break;
+  case 'Y': /* learn another model from the same tokens */
+    add_extra_model(optarg);
+    c++;
+    break;
   case 'h': /* select memory size in powers of 2 */
     default_max_hash_bits = atoi(optarg);
     if( default_max_hash_bits > MAX_HASH_BITS ) {
@@ -4212,9 +6801,22 @@ int nvram_set_option(int op, char *optarg, FILE* input, struct MAPLIST  *maplist
     default_max_tokens = (1<<default_max_hash_bits);
     c++;
     break;
+  case 'J': /* number of learning threads */
+    learn_threads = atoi(optarg);
+    if( (learn_threads < 1) || (learn_threads > MAX_LEARN_THREADS) ) {
+      errormsg(E_WARNING,
+	       "the -J switch needs a number between 1 and %d\n",
+	       MAX_LEARN_THREADS);
+      learn_threads = 1;
+    }
+    c++;
+    break;
   case 'H': /* select memory size in powers of 2 */
     default_max_grow_hash_bits = atoi(optarg);
-    if( default_max_grow_hash_bits > MAX_HASH_BITS ) {
+    if( default_max_grow_hash_bits <= 0 ) {
+      /* -H 0 grows up to the default limit */
+      default_max_grow_hash_bits = DEFAULT_MAX_GROW_HASH_BITS;
+    } else if( default_max_grow_hash_bits > MAX_HASH_BITS ) {
       errormsg(E_WARNING,
 	       "maximum hash size will be 2^%d\n", 
 	       MAX_HASH_BITS);
@@ -4594,6 +7196,31 @@ void sanitize_options() {
     }
   }
 
+  if( extra_model_count > 0 ) {
+    if( !(u_options & (1<<U_OPTION_LEARN)) ) {
+      errormsg(E_WARNING, "option -Y ignored, applies only when learning.\n");
+      extra_model_count = 0;
+    } else {
+      if( u_options & ((1<<U_OPTION_SORTCOUNT)|(1<<U_OPTION_ADMIT)|
+		       (1<<U_OPTION_ESTIMATE)) ) {
+	errormsg(E_WARNING, 
+		 "options -b, -B and -k cannot be used with -Y, disabling them.\n");
+	u_options &= ~((1<<U_OPTION_SORTCOUNT)|(1<<U_OPTION_ADMIT)|
+		       (1<<U_OPTION_ESTIMATE));
+      }
+      /* tokenize once, at the highest order */
+      main_ngram_order = ngram_order;
+      for(c = 0; c < extra_model_count; c++) {
+	if( !extra_models[c].order ) {
+	  extra_models[c].order = main_ngram_order;
+	}
+	if( ngram_order < extra_models[c].order ) {
+	  ngram_order = extra_models[c].order;
+	}
+      }
+    }
+  }
+
   if( m_options & (1<<M_OPTION_I18N) ) {
     /* I've removed the internationalized regex code, because it makes
        the code too complex to handle both multibyte and wide char regexes
@@ -4800,6 +7427,7 @@ int create_online_file() {
   
    learner.mmap_start = (byte_t*)addr;
   }
+  return 1;
 }
 
 
@@ -4807,7 +7435,10 @@ int initialize_tmp_file() {
 
 	size_t offset =0;
 
-   if(learner.tmp.file){
+   if(learner.tmp.arena){
+	/* tokens are in memory, nothing to map */
+	return 1;
+   }else if(learner.tmp.file){
 
 	learner.tmp.mmap_length = learner.tmp.avail + system_pagesize + region_size;
     learner.tmp.mmap_start =
@@ -4892,7 +7523,7 @@ int learn_or_classify_data(int argc, char **argv, FILE *input, FILE *output_fp,
 
 		  /* parse the options */
 		  while( (op = getopt(argc, argv, 
-			      "01Aac:Dde:f:G:g:H:h:ijL:l:mMNno:q:RrST:UVvw:x:Xz:")) > -1 ) {
+			      "01AaBbCc:Dde:f:G:g:H:h:ijJ:kKL:l:mMNnOo:q:RrST:UVvWw:x:XY:z:")) > -1 ) {
 
 			   	//LOG(stderr,"CALLING GETOPT\n");
 			     nvram_set_option(op, optarg, input, maplist);
@@ -4911,18 +7542,11 @@ int learn_or_classify_data(int argc, char **argv, FILE *input, FILE *output_fp,
   /* end option processing */
   sanitize_options();
 
-  temp_file = imc_mem_obj_create(region_size * 10);
-   if(temp_file < 0){
-        LOG(stderr,"creating memory object failed \n");
-    return -1;
-   }
-  learner.tmp.file = fdopen(temp_file,"w");
-
   /* set up callbacks */
   if( u_options & (1<<U_OPTION_CLASSIFY) ) {
 
     preprocess_fun = classifier_preprocess_fun;
-    word_fun = score_word;
+    word_fun = select_score_word();
     if( u_options & (1<<U_OPTION_FILTER) ) {
       u_options |= (1<<U_OPTION_FASTEMP);
       empirical.track_features = 1; 
@@ -4939,6 +7563,7 @@ int learn_or_classify_data(int argc, char **argv, FILE *input, FILE *output_fp,
 
     preprocess_fun = learner_preprocess_fun;
     word_fun = learner_word_fun;
+    learn_word = select_learn_word();
     if( m_options & (1<<M_OPTION_MBOX_FORMAT) ) {
       post_line_fun = learner_post_line_fun;
     } else {
@@ -5006,6 +7631,15 @@ int learn_or_classify_data(int argc, char **argv, FILE *input, FILE *output_fp,
 					fprintf(stdout, "processing file %s\n", argv[optind]);
 		      }
 
+#ifdef NVRAM
+		      if( (u_options & (1<<U_OPTION_LEARN)) &&
+			  (u_options & (1<<U_OPTION_ESTIMATE)) ) {
+			size_learner_from_sample(&learner, input, datasize, 
+						 input_map, line_filter, 
+						 character_filter, pre_line_fun);
+		      }
+#endif
+
 		      /* set some initial options */
 		      reset_xml_character_filter(&xml, xmlRESET);
       
@@ -5020,8 +7654,12 @@ int learn_or_classify_data(int argc, char **argv, FILE *input, FILE *output_fp,
 #ifdef DEBUG
 		       LOG(stderr, "Going to process file \n");
  #endif
-		       nvram_process_file(input, line_filter, character_filter,
-        		      word_fun, pre_line_fun, post_line_fun, datasize, input_map);
+		       if( !((u_options & (1<<U_OPTION_LEARN)) &&
+			     parallel_learn_file(&learner, datasize, input_map)) ) {
+			 nvram_process_file(input, line_filter, character_filter,
+					    word_fun, pre_line_fun, post_line_fun, 
+					    datasize, input_map);
+		       }
 #endif
 
 #ifndef NVRAM
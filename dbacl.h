@@ -28,8 +28,13 @@
 //#define DEBUG
 #define STATS
 //#define NACL
+/* define CLASSIFY_DATA to build the classifier instead */
+#ifndef CLASSIFY_DATA
 #define LEARN_DATA
+#endif
+#ifndef NUM_CATEGORIES
 #define NUM_CATEGORIES 16 
+#endif
 
 
 struct MAPLIST {
@@ -86,10 +91,11 @@ typedef uint64_t u_int64_t;
 /* we define several memory models, which differ basically 
    in the number of bytes used for the hash tables. Adjust to taste */
 
-/* use this for 64-bit hashes */
-#undef HUGE_MEMORY_MODEL
+/* use this for 64-bit hashes (-DHUGE_MEMORY_MODEL) */
+#ifndef HUGE_MEMORY_MODEL
 /* use this for 32-bit hashes */
 #define NORMAL_MEMORY_MODEL 
+#endif
 /* use this for 16-bit hashes */
 #undef SMALL_MEMORY_MODEL
 /* use this for 8-bit hashes */
@@ -105,6 +111,13 @@ typedef uint64_t u_int64_t;
 #define DIGITIZE_LAMBDA
 /* learner.hash digitization: avg loss of precision = 0.01 */
 #define DIGITIZE_LWEIGHTS
+
+/* learner probes scan a dense array of ids rather than the wide
+   l_item_t slots; with SSE2 and 32-bit hashes, four ids are compared
+   at a time */
+#if defined __SSE2__ && defined NORMAL_MEMORY_MODEL
+#define SSE2_PROBE
+#endif
 #if defined HAVE_MBRTOWC
 
 #include <wctype.h>
@@ -126,6 +139,7 @@ typedef uint64_t u_int64_t;
 #if defined HAVE_NETINET_IN_H
 #include <netinet/in.h>
 #endif
+#include <endian.h>
 
 #ifndef htonl
 #define htonl(x) (x)
@@ -410,6 +424,16 @@ typedef u_int16_t digitized_weight_t;
 
 /* this is common to all memory models */
 
+/* learner items saturate their counts at K_ITEM_COUNT_MAX, which
+   keeps l_item_t small in the huge model */
+#if defined HUGE_MEMORY_MODEL
+typedef u_int32_t item_count_t;
+#define K_ITEM_COUNT_MAX ((item_count_t)4294967295U)
+#else
+typedef token_count_t item_count_t;
+#define K_ITEM_COUNT_MAX K_TOKEN_COUNT_MAX
+#endif
+
 #if defined OS_DARWIN
 /* the system I tested this on didn't seem to like packed structures */
 #define PACK_STRUCTS
@@ -488,6 +512,7 @@ typedef u_int16_t digitized_weight_t;
 #define U_OPTION_POSTERIOR              8
 #define U_OPTION_FILTER                 9
 #define U_OPTION_DEBUG                  10
+#define U_OPTION_LAMBDA_CACHE           11
 #define U_OPTION_DUMP                   12
 #define U_OPTION_APPEND                 13
 #define U_OPTION_DECIMATE               14
@@ -502,6 +527,12 @@ typedef u_int16_t digitized_weight_t;
 #define U_OPTION_VAR                    23
 
 #define U_OPTION_HM_ADDRESSES           24
+#define U_OPTION_VEXP                   25
+#define U_OPTION_OVERRELAX              26
+#define U_OPTION_ADMIT                  27
+#define U_OPTION_SORTCOUNT              28
+#define U_OPTION_ESTIMATE               29
+#define U_OPTION_SHADOW                 30
 
 /* model options */
 #define M_OPTION_REFMODEL               1
@@ -538,6 +569,8 @@ typedef u_int16_t digitized_weight_t;
 
 /* category options */
 #define C_OPTION_MMAPPED_HASH            1
+#define C_OPTION_ROBINHOOD               2
+#define C_OPTION_SHADOW                  3
 
 
 typedef u_int32_t options_t; /* make sure big enough for all options */
@@ -622,6 +655,23 @@ typedef enum {gcUNDEF = 0, gcDISCARD, gcTOKEN, gcTOKEN_END, gcIGNORE} good_char_
 #define UNSETMARK(a) ((a)->typ.mark = (unsigned int)0)
 #define MARKEDP(a) ((a)->typ.mark == (unsigned int)1)
 
+/* minimization scratch of the learner item a, while optimizing */
+#define MINVARS(l,a) ((l)->mins[(a) - (l)->hash])
+
+/* how far slot is from the home slot of id, in a table of size mask + 1 */
+#define PROBE_DISTANCE(slot,id,mask) (((slot) - ((id) & (mask))) & (mask))
+
+#if defined STATS
+/* probe length histograms, the last bucket counts all longer probes */
+#define PROBE_HISTOGRAM 32
+#define PROBE_BUCKET(n) (((n) < PROBE_HISTOGRAM) ? (n) : PROBE_HISTOGRAM - 1)
+#define LEARNER_PROBE_STATS(n) (learner_probe_hist[PROBE_BUCKET(n)]++)
+#define CATEGORY_PROBE_STATS(n) (category_probe_hist[PROBE_BUCKET(n)]++)
+#else
+#define LEARNER_PROBE_STATS(n)
+#define CATEGORY_PROBE_STATS(n)
+#endif
+
 #define NOTNULL(x) ((x) > 0)
 
 #if defined PORTABLE_CATS
@@ -674,6 +724,9 @@ typedef enum {gcUNDEF = 0, gcDISCARD, gcTOKEN, gcTOKEN_END, gcIGNORE} good_char_
 #define MAGIC9    "# binned_features %ld max_feature_count %ld\n" 
 #define RESTARTPOS 8
 #define MAGIC6    "#\n"
+#define MAGIC10   "# hash_probe robinhood\n"
+#define MAGIC11   "# shadow_regions 2\n"
+#define MAGIC12   "# hash_width %d\n"
 #define MAGIC8_i  "# shannon %" FMT_scanf_score_t \
                   " alpha %" FMT_scanf_score_t \
                   " beta %" FMT_scanf_score_t \
@@ -716,14 +769,45 @@ typedef struct {
   int hashfull_warning;
 } empirical_t;
 
-typedef struct {
-  hash_value_t id;
+/* category files record the width of their ids (MAGIC12), and the
+   category code is instantiated for 32 and 64 bit ids whatever
+   hash_value_t is. Files without the line have hash_value_t ids */
+template <typename ID>
+struct c_item_w {
+  ID id;
 #if defined DIGITIZE_LAMBDA
   digitized_weight_t lam;
 #else
   weight_t lam;
 #endif
-} PACK_STRUCTS c_item_t;
+} PACK_STRUCTS;
+
+typedef c_item_w<hash_value_t> c_item_t;
+
+#define NATIVE_ID_WIDTH ((int)(8 * sizeof(hash_value_t)))
+#define CATEGORY_ITEM_SIZE(cat) \
+  (sizeof(c_item_t) - sizeof(hash_value_t) + (size_t)(cat)->id_width / 8)
+
+/* ids of the other widths follow the byte order of the native ones */
+template <typename ID> inline ID ntoh_id_w(ID x) { return NTOH_ID(x); }
+#if !defined NORMAL_MEMORY_MODEL
+template <> inline u_int32_t ntoh_id_w<u_int32_t>(u_int32_t x) {
+#if defined PORTABLE_CATS
+  return ntohl(x);
+#else
+  return x;
+#endif
+}
+#endif
+#if !defined HUGE_MEMORY_MODEL
+template <> inline u_int64_t ntoh_id_w<u_int64_t>(u_int64_t x) {
+#if defined PORTABLE_CATS
+  return be64toh(x);
+#else
+  return x;
+#endif
+}
+#endif
 
 typedef enum {simple, sequential} mtype;
 
@@ -756,9 +840,14 @@ typedef struct {
   score_t s2;
   options_t m_options;
   options_t c_options;
+  int id_width; /* of the ids in hash, which is a c_item_w array */
   c_item_t *hash;
   byte_t *mmap_start;
   long mmap_offset;
+  /* see shadow_record_t */
+  long shadow_offset; /* of the first region */
+  int shadow_region; /* the one which was loaded */
+  u_int32_t shadow_generation;
 #if defined DIGITIZE_DIGRAMS
   digitized_weight_t dig[ASIZE][ASIZE];
 #else
@@ -766,31 +855,71 @@ typedef struct {
 #endif
 } category_t;
 
+/* crash consistent category updates (-W): after the headers, the
+   category holds two regions, each a shadow_record_t followed by the
+   digrams and the hash. An update rewrites the region which wasn't
+   loaded and writes its record last, the loader picks the valid region
+   with the latest generation. The header statistics are zero, the
+   record has the real ones */
+#define SHADOW_MAGIC 0x73686477
+#define SHADOW_REGION_SIZE(tokens,isize) (sizeof(shadow_record_t) + \
+  ASIZE * ASIZE * SIZEOF_DIGRAMS + (size_t)(tokens) * (isize))
+
 typedef struct {
-  token_count_t count;
-  weight_t B; /* mustn't digitize this :-( */
+  u_int32_t magic;
+  u_int32_t generation;
+  u_int32_t checksum; /* of this record, with checksum 0, after the data */
+  u_int32_t unused;
+  score_t divergence;
+  score_t logZ;
+  score_t shannon;
+  score_t alpha;
+  score_t beta;
+  score_t mu;
+  score_t s2;
+  u_int64_t full_token_count;
+  u_int64_t unique_token_count;
+  u_int64_t num_docs;
+} shadow_record_t;
+
+/* learner hash item. It isn't packed, so that the slots stay
+   naturally aligned: the data needed only by document statistics
+   lives in a side table, see side_in_learner(), and the minimization
+   scratch is in learner->mins, see MINVARS(). Probes only read
+   learner->ids. The count, lambda and type stay together because
+   every pass which reads one of them reads the others too (learning
+   updates count and dirty, the minimization and save loops read count,
+   lam and order), so separate arrays would only add streams */
+typedef struct {
+  hash_value_t id;
+  item_count_t count;
 #if defined DIGITIZE_LAMBDA
   digitized_weight_t lam; 
 #else
   weight_t lam;
 #endif
-  union {
-    struct {
+  token_type_t typ;
+  unsigned char dirty; /* count changed since lambdas were optimized,
+			  fits in the padding. typ.mark is SETMARK's */
+} l_item_t;
+
+/* per item minimization scratch, one for each hash slot */
+typedef struct {
 #if defined DIGITIZE_LWEIGHTS
-      digitized_weight_t ltrms;
-      digitized_weight_t dref;
+  digitized_weight_t ltrms;
+  digitized_weight_t dref;
 #else
-      weight_t ltrms;
-      weight_t dref;
+  weight_t ltrms;
+  weight_t dref;
 #endif
-    } min;
-    struct {
-      token_count_t eff;
-    } read;
-  } tmp;
+} l_min_t;
+
+/* per token document statistics, keyed by id */
+typedef struct {
   hash_value_t id;
-  token_type_t typ;
-} PACK_STRUCTS l_item_t;
+  token_count_t eff; /* occurrences in the current document */
+  weight_t B; /* mustn't digitize this :-( */
+} l_side_t;
 
 typedef struct {
   hash_value_t *stack;
@@ -799,6 +928,16 @@ typedef struct {
   score_t shannon;
 } emplist_t;
 
+/* what recalculate_reference_measure() needs to know about a token of
+   the temporary token file, so that it needn't be reread. Define
+   NO_REF_CACHE to reread the file on every pass instead */
+typedef struct {
+  hash_count_t slot; /* the token's learner hash slot */
+  weight_t dref; /* digramic excursion */
+  long suf; /* first suffix slot in learner->ref.suf */
+  token_order_t nsuf; /* number of suffixes in the hash */
+} ref_token_t;
+
 typedef struct {
   char *filename;
   //file to which output would be written
@@ -816,6 +955,7 @@ typedef struct {
     long mmap_offset;
     size_t mmap_length;
     long mmap_cursor;
+    byte_t *arena; /* in memory token list, mmap_start points here */
   } tmp;
   re_bitfield retype;
   token_order_t max_order;
@@ -829,6 +969,8 @@ typedef struct {
   token_count_t b_count;
   score_t logZ;
   score_t divergence;
+  /* the lambdas are a previous solution, only marked items changed */
+  bool_t warm;
   score_t shannon;
   score_t alpha;
   score_t beta;
@@ -840,7 +982,47 @@ typedef struct {
   long mmap_learner_offset;
   long mmap_hash_offset;
   l_item_t *hash;
+  hash_value_t *ids; /* dense copy of hash[].id, used for probing */
+  struct {
+    /* while the hash is growing, the previous table stays here
+       until all of its slots have been moved, see migrate_learner_hash() */
+    l_item_t *hash;
+    hash_value_t *ids;
+    hash_count_t max_tokens;
+    hash_count_t cursor;
+  } old;
+  /* minimization scratch, only allocated by optimize_and_save() */
+  l_min_t *mins;
+  /* document statistics of the tokens seen, see side_in_learner() */
+  struct {
+    l_side_t *item;
+    hash_count_t max; /* a power of 2, or zero */
+    hash_count_t count;
+    document_count_t docs; /* documents summed into the table */
+  } side;
+  /* the -B sketch, and the number of items it has had evicted since
+     the token list was last compacted, see admit_in_learner() */
+  struct {
+    token_count_t *sketch;
+    hash_count_t evictions;
+  } admit;
+  /* filled slots grouped by order, see build_order_index() */
+  hash_count_t *order_index;
+  hash_count_t order_start[MAX_SUBMATCH + 1];
+  /* per token reference data, see build_ref_cache() */
+  struct {
+    ref_token_t *tok;
+    hash_count_t count;
+    hash_count_t *suf; /* suffix slots of all tokens, back to back */
+    long suf_count;
+    long suf_max;
+  } ref;
   weight_t dig[ASIZE][ASIZE];
+  /* unigram digram counts not yet in dig, see flush_digram_counts() */
+  struct {
+    token_count_t (*count)[ASIZE];
+    token_count_t pending;
+  } digrams;
   long int regex_token_count[MAX_RE + 1];
   struct {
     score_t A;
@@ -848,6 +1030,7 @@ typedef struct {
     document_count_t count;
     document_count_t nullcount;
     bool_t skip;
+    bool_t not_header; /* mbox state of this learner's last line */
 #define RESERVOIR_SIZE 25
 /*       #define RESERVOIR_SIZE 12 */
     /* the reservoir size constrains the accuracy of the variance
@@ -860,8 +1043,236 @@ typedef struct {
     emplist_t reservoir[RESERVOIR_SIZE];
   } doc;
 } learner_t;
+
+/* per token callbacks, see select_score_word() and select_learn_word() */
+typedef void (*word_fun_t)(char *, token_type_t, regex_count_t);
+typedef void (*learn_word_fun_t)(learner_t *, char *, token_type_t, regex_count_t);
 /* this is used when minimizing learner divergence */
 #define MAX_LAMBDA_JUMP 100
+/* over-relaxation factor for the lambda updates (-O). It is dropped
+   back to 1 (plain iterative scaling) for the rest of an order as soon
+   as an iteration makes the divergence worse */
+#define OVERRELAX_OMEGA 1.5
+/* unigram digrams are counted in integers, and folded into
+   learner->dig at least this often (so the counters can't wrap) */
+#define DIGRAM_FLUSH_COUNT ((token_count_t)1<<30)
+/* old hash slots moved per learned token while the learner hash grows */
+#define GROW_MIGRATE_STEP 8
+/* how far -H lets the learner hash grow when no size is given. Growth
+   is spread over later tokens, so large tables no longer stall */
+#define DEFAULT_MAX_GROW_HASH_BITS \
+  ((MAX_HASH_BITS < 22) ? MAX_HASH_BITS : (hash_bit_count_t)22)
+
+/* admission when the learner hash is full and can't grow (-B): a
+   count-min sketch estimates how often each token that didn't fit has
+   been seen, and it replaces the rarest of the items near its home
+   slot once it is seen more often */
+#define ADMIT_SKETCH_DEPTH 4 /* one seed each in admit_seeds */
+#define ADMIT_SKETCH_BITS 16
+#define ADMIT_EVICT_WINDOW 8
+
+/* initial size of the learner side table, see side_in_learner() */
+#define SIDE_MIN_ITEMS 1024
+
+/* lambdas of the last optimization of a category, kept in the
+   persistent heap and used to seed the next one (-C). The chunk id is
+   derived from the category name, the items form an open addressing
+   table of max_tokens (a power of 2) slots after the header. A chunk
+   is allocated once and rewritten in place, since the heap can't free
+   it. Learners running at once take the lock file in turn */
+#define LAMBDA_CACHE_MAGIC 0x6c616d63
+#define LAMBDA_CACHE_CHUNK 50000
+#define LAMBDA_CACHE_CHUNKS 4096
+#define LAMBDA_CACHE_NAME 256
+#define LAMBDA_CACHE_LOCK "/tmp/dbacl.lambda_cache.lock"
+
+typedef struct {
+  unsigned int magic;
+  hash_count_t max_tokens; /* set when the chunk is allocated */
+  hash_count_t count;
+  char name[LAMBDA_CACHE_NAME]; /* the category, chunk ids can collide */
+} lambda_cache_t;
+
+typedef struct {
+  hash_value_t id;
+  weight_t lam;
+} lambda_cache_item_t;
+
+/* learner sizing (-k): before learning, a HyperLogLog sketch per
+   token order counts the distinct tokens in a sample at the start of
+   the input. The counts after half and all of the sample give a growth
+   rate, which extrapolates them to the whole input, and the hash is
+   sized for SIZE_LOAD_TARGET percent of that */
+#define HLL_BITS 12
+#define HLL_MIX 0x9e3779b97f4a7c15ULL
+#define SIZE_SAMPLE_DIV 16
+#define SIZE_SAMPLE_MIN (1<<20)
+#define SIZE_LOAD_TARGET 50
+#define SIZE_MIN_HASH_BITS 10
+
+/* parallel learning (-J): each worker counts the tokens of its share
+   of the input in a private table, which is then merged into the
+   learner in input order */
+#define MAX_LEARN_THREADS 64
+
+typedef struct {
+  hash_value_t id;
+  token_count_t count;
+  token_type_t typ;
+  long tokoff; /* token string, in the worker's toks buffer */
+} w_item_t;
+
+typedef struct {
+  char *start;
+  char *end;
+  w_item_t *items; /* in order of first appearance */
+  hash_count_t item_count;
+  hash_count_t item_max;
+  hash_count_t *index; /* item number + 1, or 0 if empty */
+  hash_count_t index_max;
+  char *toks;
+  long toks_used;
+  long toks_max;
+  token_count_t *dig; /* ASIZE * ASIZE digram counts */
+} learn_worker_t;
+
+/* the passes of minimize_learner_divergence() work on a fixed
+   partition of the learner hash, and the partial sums are combined in
+   partition order, so the model doesn't depend on the thread count */
+#define MINIMIZE_PARTITIONS 64
+/* below this many hash slots, threads cost more than they save */
+#define MINIMIZE_THREADED_MIN (1<<16)
+/* with -K, partition function sums go through vexp() in blocks
+   of this many doubles */
+#define VEXP_BLOCK 256
+/* compensated (Kahan) summation step */
+#define KAHAN_ADD(s,c,x) do { score_t y_ = (x) - (c); score_t t_ = (s) + y_; \
+    (c) = (t_ - (s)) - y_; (s) = t_; } while(0)
+
+typedef enum {
+  mpMAXLOGZ, mpSUMZ, mpDIVERGENCE, mpEXTRA_BITS, mpLAMBDA
+} minimize_pass_t;
+
+typedef struct {
+  learner_t *learner;
+  minimize_pass_t pass;
+  token_order_t r;
+  score_t x; /* maxlogz for mpSUMZ, logzonr for mpLAMBDA */
+  score_t logXi;
+  bool_t fwd;
+  hash_count_t lo, hi; /* set by minimize_pass() */
+  /* per partition results */
+  score_t sum[MINIMIZE_PARTITIONS];
+  score_t max[MINIMIZE_PARTITIONS];
+  token_count_t lzero[MINIMIZE_PARTITIONS];
+  bool_t nan[MINIMIZE_PARTITIONS];
+  bool_t marked_only; /* mpLAMBDA skips unmarked items */
+  score_t omega; /* mpLAMBDA over-relaxation factor */
+} minimize_job_t;
+
+typedef struct {
+  minimize_job_t *job;
+  int first;
+  int step;
+} minimize_worker_t;
+
+/* process wide token interner, in shared memory so that all the
+   category learners of learn_data(), forked or not, use the same one.
+   It only caches the suffix ids of build_ref_cache(), so that the
+   suffixes of a token shared by several categories are hashed once.
+   Each learner still keeps its own hash and token list, keyed by
+   hash_full_token(). Entries are matched on their full text and never
+   removed. No locks are taken, see intern_token(). */
+#define INTERN_SLOTS (1<<20)
+#define INTERN_TEXT (1<<25)
+#define INTERN_SUFFIXES (MAX_SUBMATCH - 1)
+#define INTERN_NOSUF 0xffff /* too many suffixes, nsuf isn't usable */
+
+/* intern_entry_t states */
+#define INTERN_EMPTY 0
+#define INTERN_BUSY 1 /* being filled in */
+#define INTERN_READY 2
+#define INTERN_DEAD 3 /* claimed when the interner was full */
+
+typedef struct {
+  unsigned int state;
+  hash_value_t id;
+  unsigned int text; /* offset of the NUL terminated token */
+  unsigned short len;
+  unsigned short nsuf;
+  hash_value_t suf[INTERN_SUFFIXES];
+} intern_entry_t;
+
+typedef struct {
+  hash_count_t max;
+  hash_count_t count;
+  size_t text_max;
+  size_t text_used;
+  intern_entry_t *entry; /* these two point into the same mapping */
+  char *text;
+} intern_table_t;
+
+/* extra models learned from the same token stream (-Y) */
+#define MAX_EXTRA_MODELS 16
+
+typedef struct {
+  char *filename;
+  token_order_t order; /* 0 for the -w order */
+  hash_bit_count_t bits; /* 0 for the -h size */
+  int smoothing; /* U_OPTION_LAPLACE etc., 0 for the -L choice */
+  learner_t *learner;
+} extra_model_t;
+
+/* sorted counting (-b): token occurrences are collected into runs of
+   records, each run is radix sorted by id, aggregated and spilled to a
+   temporary file, and the learner hash is built from a merge of the
+   runs once all the input has been read */
+#define SORT_RUN_RECORDS (1<<20)
+#define SORT_RUN_TEXT (1<<24)
+#define SORT_READ_BUF (1<<16)
+#define SORT_TOKEN_MAX ((MAX_TOKEN_LEN+1)*MAX_SUBMATCH+EXTRA_TOKEN_LEN)
+
+typedef struct {
+  hash_value_t id;
+  token_type_t typ;
+  unsigned int off; /* of the token text in the run */
+} sort_rec_t;
+
+/* a spilled token, followed by len bytes of text */
+typedef struct {
+  hash_value_t id;
+  token_type_t typ;
+  token_count_t count;
+  unsigned short len;
+} sort_item_t;
+
+typedef struct {
+  off_t pos, end;
+  size_t at, have;
+  bool_t live;
+  sort_item_t item;
+  char tok[SORT_TOKEN_MAX + 1];
+  byte_t buf[SORT_READ_BUF];
+} sort_reader_t;
+
+/* save_learner() converts the hash to c_item_t this many slots at a
+   time, then writes the block with a single writev() */
+#define SAVE_BLOCK_ITEMS (1<<18)
+
+typedef struct {
+  learner_t *learner;
+  c_item_t *out;
+  hash_count_t lo, hi;
+} convert_job_t;
+
+/* calc_shannon() hash sums */
+typedef struct {
+  learner_t *learner;
+  bool_t calcentropy;
+  score_t mu;
+  score_t jensen;
+  score_t shannon;
+} shannon_job_t;
 
 typedef struct {
   double alpha;
@@ -986,16 +1397,49 @@ extern "C"
   void free_learner(learner_t *learner);
 
   void reset_mbox_messages(learner_t *learner, MBOX_State *mbox);
-  void count_mbox_messages(learner_t *learner, Mstate mbox_state, char *buf);
+  void count_mbox_messages(learner_t *learner, Mstate mbox_state, char *buf,
+			   bool_t skip);
   void calc_shannon(learner_t *learner);
   void update_shannon_partials(learner_t *learner);
   void optimize_and_save(learner_t *learner);
+  void learner_seed_lambdas(learner_t *learner);
+  void learner_store_lambdas(learner_t *learner);
 
   l_item_t *find_in_learner(learner_t *learner, hash_value_t id);
+  bool_t side_reserve(learner_t *learner, hash_count_t n);
+  l_side_t *side_in_learner(learner_t *learner, hash_value_t id);
+  l_side_t *find_side_in_learner(learner_t *learner, hash_value_t id);
+  l_item_t *insert_in_learner(learner_t *learner, hash_value_t id);
+  bool_t admit_in_learner(learner_t *learner, hash_value_t id, 
+			  token_count_t n, token_count_t *prior);
+  void compact_token_list(learner_t *learner);
+  bool_t sort_count_token(hash_value_t id, token_type_t tt, const char *tok);
+  bool_t intern_init(hash_count_t slots, size_t text);
+  intern_entry_t *intern_find(const char *tok, hash_value_t id);
+  intern_entry_t *intern_token(const char *tok, hash_value_t id);
+  hash_count_t intern_count();
+  void sort_count_finish(learner_t *learner);
+  token_order_t get_token_order(char *tok);
   bool_t grow_learner_hash(learner_t *learner);
+  void migrate_learner_hash(learner_t *learner, hash_count_t step);
+  void build_learner_ids(learner_t *learner);
+  void build_order_index(learner_t *learner);
+  void myfree_order_index(learner_t *learner);
+  void build_ref_cache(learner_t *learner);
+  void myfree_ref_cache(learner_t *learner);
   void hash_word_and_learn(learner_t *learner, 
 			   char *tok, token_type_t tt, regex_count_t re);
-
+  learn_word_fun_t select_learn_word();
+  bool_t parallel_learn_file(learner_t *learner, size_t datasize, 
+			     char *input_map);
+  void size_learner_from_sample(learner_t *learner, FILE *input,
+				size_t datasize, char *input_map,
+				int (*line_filter)(MBOX_State *, char *),
+				void (*character_filter)(XML_State *, char *),
+				char *(*pre_line_fun)(char *));
+  void minimize_pass(minimize_job_t *job);
+
+  void flush_digram_counts(learner_t *learner);
   void make_dirichlet_digrams(learner_t *learner);
   void make_uniform_digrams(learner_t *learner);
   void transpose_digrams(learner_t *learner);
@@ -1024,10 +1468,17 @@ extern "C"
   void init_purely_random_text_category(category_t *cat);
   error_code_t load_category(category_t *cat);
   error_code_t load_category_header(FILE *input, category_t *cat);
+  u_int32_t shadow_checksum(const byte_t *p, size_t n, u_int32_t h);
+  u_int32_t shadow_record_checksum(const shadow_record_t *rec, u_int32_t h);
+  bool_t select_shadow_region(category_t *cat, FILE *input);
+  bool_t nvram_select_shadow_region(category_t *cat, char *start, 
+				    size_t datasize, long *offset);
   error_code_t open_category(category_t *cat);
+  error_code_t open_category_header(category_t *cat);
   void reload_all_categories();
 
   void score_word(char *tok, token_type_t tt, regex_count_t re);
+  word_fun_t select_score_word();
   confidence_t gamma_pvalue(category_t *cat, double obs);
 
   /* file format handling in fh.c */
@@ -1035,6 +1486,8 @@ extern "C"
   void cleanup_file_handling();
 
   token_class_t get_token_class();
+  token_type_t get_token_type(token_order_t o);
+  void reset_current_token(char *tokbuf, char **q, token_order_t *how_many);
   regex_count_t load_regex(char *buf);
   void free_all_regexes();
 
@@ -1126,7 +1579,7 @@ extern "C"
    void LOG( FILE *fp,  const char* format, ... );	
 	
 #ifndef NACL
-	int imc_mem_obj_create(size_t mapsize);
+	int imc_mem_obj_create(size_t mapsize, int idx);
 
 #endif
 	
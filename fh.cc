@@ -606,7 +606,7 @@ void nvram_process_file(FILE *input,
 	map_addr = input_map;
 
 	/* initialize the norex state */
-	//reset_current_token(tokbuf, &q, &how_many);
+	reset_current_token(tokbuf, &q, &how_many);
 	//set_iobuf_mode(input);
 	inputline = 0;
 
@@ -67,8 +67,8 @@ charbuf_len_t aux_textbuf_len = 0;
 hash_bit_count_t default_max_hash_bits = 15;
 hash_count_t default_max_tokens = (1<<15);
 
-hash_bit_count_t default_max_grow_hash_bits = 16;
-hash_count_t default_max_grow_tokens = (1<<16);
+hash_bit_count_t default_max_grow_hash_bits = DEFAULT_MAX_GROW_HASH_BITS;
+hash_count_t default_max_grow_tokens = (1<<DEFAULT_MAX_GROW_HASH_BITS);
 
 void *in_iobuf = NULL; /* only used for input stream */
 void *out_iobuf = NULL; /* used for all category/learner file operations */
@@ -119,8 +119,8 @@ void init_fram_var() {
         default_max_hash_bits = 15;
         default_max_tokens = (1<<15);
 
-        default_max_grow_hash_bits = 16;
-        default_max_grow_tokens = (1<<16);
+        default_max_grow_hash_bits = DEFAULT_MAX_GROW_HASH_BITS;
+        default_max_grow_tokens = (1<<DEFAULT_MAX_GROW_HASH_BITS);
 
         in_iobuf = NULL; /* only used for input stream */
         out_iobuf = NULL; /* used for all category/learner file operations */
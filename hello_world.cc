@@ -15,6 +15,7 @@
 #include <fcntl.h>
 #include <sys/time.h>
 #include <stdarg.h>
+#include <sys/wait.h>
 #include "ptmalloc.h"
 #include "dbacl.h"
 #include "IOtimer.h"
@@ -41,6 +42,10 @@ using namespace std;
 //Max file path len
 #define FILE_PATH_LEN 256
 #define LEARN_FILE1 "22.txt"
+//Number of categories learned at once, 0 means one per online cpu
+#ifndef LEARN_JOBS
+#define LEARN_JOBS 0
+#endif
 
 //indicates list of mapped documents 
 int *map_list;
@@ -63,6 +68,12 @@ size_t online_size = 100 * region_size;
 #ifdef STATS
 unsigned int nv_alloc_bytes = 0;
 unsigned long learner_write_bytes =0;
+unsigned long learner_probe_hist[PROBE_HISTOGRAM];
+unsigned long category_probe_hist[PROBE_HISTOGRAM];
+unsigned long minimize_iterations = 0;
+unsigned long lambda_cache_seeded = 0;
+long optimize_time = 0;
+unsigned long minimize_fallbacks = 0;
 unsigned long learner_read_bytes = 0;
 long glob_read_time = 0;
 struct timeval start_learn_time;
@@ -291,17 +302,16 @@ int get_outsize(){
 
 #ifndef NACL
 
-int imc_mem_obj_create(size_t mapsize){
+/* the file behind the online dump of category idx. The name must be
+   unique, as categories learned at once each map their own */
+int imc_mem_obj_create(size_t mapsize, int idx){
 
-	char s[10];
-	int len = 9;
 	int fd = -1;
 	char fullpath[FILE_PATH_LEN ];
 
-	gen_random(s,  len);
 	bzero(fullpath, FILE_PATH_LEN );
-	strcpy(fullpath,"/tmp/");
-	strcat(fullpath, s);
+	snprintf(fullpath, FILE_PATH_LEN, "/tmp/dbacl.%ld.%d.online",
+			(long)getpid(), idx);
 	fd=  setup_map_file1(fullpath, mapsize);
 	return fd;
 }
@@ -331,6 +341,84 @@ void* allocate_nvmem(size_t mapsize){
 }
 
 #ifdef STATS
+/* probe lengths, the last bucket counts all longer probes */
+void print_probe_hist(const char *name, unsigned long *hist) {
+	int i;
+
+	fprintf(stdout, "%s probe lengths :", name);
+	for(i = 0; i < PROBE_HISTOGRAM; i++) {
+		if( hist[i] ) {
+			fprintf(stdout, " %d%s:%lu", i, 
+					(i == PROBE_HISTOGRAM - 1) ? "+" : "", hist[i]);
+		}
+	}
+	fprintf(stdout, "\n");
+}
+
+/* the counters of a category learned in a child process, which the
+   parent adds to its own */
+typedef struct {
+	unsigned int nv_alloc_bytes;
+	unsigned long learner_write_bytes;
+	unsigned long learner_read_bytes;
+	unsigned long learner_probe_hist[PROBE_HISTOGRAM];
+	unsigned long category_probe_hist[PROBE_HISTOGRAM];
+	unsigned long minimize_iterations;
+	unsigned long lambda_cache_seeded;
+	unsigned long minimize_fallbacks;
+	long optimize_time;
+	long glob_read_time;
+	unsigned int hash_tokens;
+} learn_stats_t;
+
+/* called in the child right after the fork, so that it only counts
+   its own category */
+void clear_stats() {
+	nv_alloc_bytes = 0;
+	learner_write_bytes = 0;
+	learner_read_bytes = 0;
+	memset(learner_probe_hist, 0, sizeof(learner_probe_hist));
+	memset(category_probe_hist, 0, sizeof(category_probe_hist));
+	minimize_iterations = 0;
+	lambda_cache_seeded = 0;
+	minimize_fallbacks = 0;
+	optimize_time = 0;
+	glob_read_time = 0;
+	hash_tokens = 0;
+}
+
+void save_stats(learn_stats_t *s) {
+	s->nv_alloc_bytes = nv_alloc_bytes;
+	s->learner_write_bytes = learner_write_bytes;
+	s->learner_read_bytes = learner_read_bytes;
+	memcpy(s->learner_probe_hist, learner_probe_hist, sizeof(learner_probe_hist));
+	memcpy(s->category_probe_hist, category_probe_hist, sizeof(category_probe_hist));
+	s->minimize_iterations = minimize_iterations;
+	s->lambda_cache_seeded = lambda_cache_seeded;
+	s->minimize_fallbacks = minimize_fallbacks;
+	s->optimize_time = optimize_time;
+	s->glob_read_time = glob_read_time;
+	s->hash_tokens = hash_tokens;
+}
+
+void add_stats(learn_stats_t *s) {
+	int i;
+
+	nv_alloc_bytes += s->nv_alloc_bytes;
+	learner_write_bytes += s->learner_write_bytes;
+	learner_read_bytes += s->learner_read_bytes;
+	for(i = 0; i < PROBE_HISTOGRAM; i++) {
+		learner_probe_hist[i] += s->learner_probe_hist[i];
+		category_probe_hist[i] += s->category_probe_hist[i];
+	}
+	minimize_iterations += s->minimize_iterations;
+	lambda_cache_seeded += s->lambda_cache_seeded;
+	minimize_fallbacks += s->minimize_fallbacks;
+	optimize_time += s->optimize_time;
+	glob_read_time += s->glob_read_time;
+	hash_tokens += s->hash_tokens;
+}
+
 void print_stats() {
 
 	fprintf(stdout, "nvmalloc total : %u\n", nv_alloc_bytes);
@@ -340,18 +428,43 @@ void print_stats() {
 	//fprintf(stdout, "time %ld \n", simulation_time(strt_classify, end_classify));
 	fprintf(stdout, "global read time: %ld \n", glob_read_time);
 	fprintf(stdout,"total learn time : %ld \n", tot_learn_time);
+	fprintf(stdout,"optimize time : %ld \n", optimize_time);
+	fprintf(stdout,"lambda iterations : %lu \n", minimize_iterations);
+	fprintf(stdout,"over-relaxation fallbacks : %lu \n", minimize_fallbacks);
+	fprintf(stdout,"lambdas seeded from cache : %lu \n", lambda_cache_seeded);
+	fprintf(stdout,"interned tokens : %lu \n", (unsigned long)intern_count());
+	print_probe_hist("learner", learner_probe_hist);
+	print_probe_hist("category", category_probe_hist);
 }
 #endif
 
 int argc =0;
 char **argv;
+//switches from our own command line, passed on to every dbacl run
+int extra_argc = 0;
+char **extra_argv = NULL;
+
+//puts the extra switches at argv[at], which must come before -o, where
+//dbacl stops parsing options. argv must have room for them
+void add_extra_args(int at) {
+	int idx;
+
+	for( idx = argc - 1; idx >= at; idx-- ) {
+		argv[idx + extra_argc] = argv[idx];
+	}
+	for( idx = 0; idx < extra_argc; idx++ ) {
+		argv[at + idx] = extra_argv[idx];
+	}
+	argc += extra_argc;
+	argv[argc] = NULL;
+}
 
 int create_learning_args(int idx) {
 
 #ifdef NVRAM
-	argv = (char **)nvmalloc(sizeof(char *) * 7);
+	argv = (char **)nvmalloc(sizeof(char *) * (8 + extra_argc));
 #else
-	argv = (char **)malloc(sizeof(char *) * 4);
+	argv = (char **)malloc(sizeof(char *) * (5 + extra_argc));
 #endif	
 	argv[0] = (char *)nvmalloc(sizeof(char) * 56);
 	argv[1] = (char *)nvmalloc(sizeof(char) * 56);
@@ -383,6 +496,9 @@ int create_learning_args(int idx) {
 #else
 	argc   = 4;
 #endif
+	//learn_category() finds the output and the input at argv[2], argv[3]
+	add_extra_args(4);
+	return 0;
 }
 
 
@@ -406,7 +522,7 @@ int create_classify_args(int num_categories) {
 	rqst.id = chunk_no;
 
 
-	argv = (char **)malloc(sizeof(char *) * (num_categories * 2 + 6) );
+	argv = (char **)malloc(sizeof(char *) * (num_categories * 2 + 7 + extra_argc) );
 	for ( idx =0; idx < (num_categories * 2 + 6); idx++)
 		argv[idx] = (char *)malloc(sizeof(char) * 256);
 
@@ -464,6 +580,7 @@ int create_classify_args(int num_categories) {
 	strcpy(argv[idx++],( char*)"three_online");
 	argv[idx]= NULL;
 	argc   = idx;  //(int)(sizeof(argv) / sizeof(argv[0])) - 1;
+	add_extra_args(1);
 #ifdef DEBUG
 	LOG(stderr," total arguments %d \n", argc);
 #endif	
@@ -472,158 +589,288 @@ int create_classify_args(int num_categories) {
 }
 
 
-int learn_data(int num_categories)
+/*
+ * learns category idx into out_addr. All the learner state is global, so
+ * when several categories are learned at once each one runs in its own
+ * child process, which gives it a private copy of that state.
+ */
+int learn_category(int idx, char *out_addr)
 {
 		int output_fd = -1;
-		int data_len = 0;		
-		int cntr =0, idx = 0;
-		char filepath[FILE_PATH_LEN ];
+		int data_len = 0;
 		FILE *input = NULL;
-		int fd = -1;
 		int input_fd = -1;
 		struct stat buf;
-
-		//process id
-		unsigned int tid =1;
-		//ids of data input nvmallocs
-		unsigned int input_id = 1;
-		//ids of learning data output nvmallocs
-		//set to default starting value of 100
-		unsigned int output_id = 100;
 		//output file pointer
 		FILE *output_fp = NULL;
 		//input addr
 		char *addr = NULL;
 		//output addr
 		char *outaddr = NULL;
-		size_t size = 0;
-		//If data needs to be persisted in NVRAM
-		int flgPersist =0;
-		//Message from browser
-	
-		char *out_addr_arr[num_categories];
-
 
-#ifdef USE_NVMALLOC	
-		  for (  idx = 1; idx <= num_categories; idx ++) {
-                out_addr_arr[idx] = (char *)allocate_nvmem(output_size);
-				memset(out_addr_arr[idx], 0, output_size);
-           }
-#endif
-
-#ifdef STATS
-			gettimeofday(&start_learn_time, NULL);
-#endif
-
-			for (  idx = 1; idx <= num_categories; idx ++) {
-
-				init();
+		init();
 
-				create_learning_args(idx);
+		create_learning_args(idx);
 #ifdef DEBUG
-				fprintf(stderr,"before opening file \n");
+		fprintf(stderr,"before opening file \n");
 #endif
 
 #ifdef NVRAM
-				input_fd =  open( argv[3] ,0666);
+		input_fd =  open( argv[3] ,0666);
 #else
-				input_fd =  open(LEARN_FILE1,0666);
+		input_fd =  open(LEARN_FILE1,0666);
 #endif //NVRAM
 
-				if(input_fd < 0){
-					LOG(stderr,"creating memory object failed %s\n",(char *)LEARN_FILE1);
-					return -1;
-				}
+		if(input_fd < 0){
+			LOG(stderr,"creating memory object failed %s\n",(char *)LEARN_FILE1);
+			return -1;
+		}
 #ifdef NVRAM
-				fstat(input_fd, &buf);
-				data_len = buf.st_size;
-				input_size =  data_len;
-				LOG(stdout,"data len %d \n", data_len);
-				addr = (char *)mmap(0,  input_size, PROT_READ | PROT_WRITE, MAP_SHARED, input_fd, 0);
-				if (addr == MAP_FAILED) {
-					LOG(stderr, "mmap failed \n");
-					close(input_fd);
-					exit(-1);
-				}
-				LOG(stdout,"after mmap\n");
+		fstat(input_fd, &buf);
+		data_len = buf.st_size;
+		input_size =  data_len;
+		LOG(stdout,"data len %d \n", data_len);
+		addr = (char *)mmap(0,  input_size, PROT_READ | PROT_WRITE, MAP_SHARED, input_fd, 0);
+		if (addr == MAP_FAILED) {
+			LOG(stderr, "mmap failed \n");
+			close(input_fd);
+			exit(-1);
+		}
+		LOG(stdout,"after mmap\n");
 #ifdef STATS
-				nv_alloc_bytes +=  input_size;
+		nv_alloc_bytes +=  input_size;
 #endif
-				LOG(stderr," After generate_random_text \n");
-				input =  fmemopen(addr, data_len, "r");
-				if(!input) {
-					LOG(stderr,"creating file input from memory stream failed \n");
-					return -1;
-				}
-
-				online_fd = imc_mem_obj_create(online_size);
-				if(online_fd < 0){
-					LOG(stderr,"creating memory object failed \n");
-					return -1;
-				}
+		LOG(stderr," After generate_random_text \n");
+		input =  fmemopen(addr, data_len, "r");
+		if(!input) {
+			LOG(stderr,"creating file input from memory stream failed \n");
+			return -1;
+		}
 
-				temp_file = imc_mem_obj_create(temp_size);
-				if(temp_file < 0){
-					LOG(stderr,"creating memory object failed \n");
-					return -1;
-				}
+		online_fd = imc_mem_obj_create(online_size, idx);
+		if(online_fd < 0){
+			LOG(stderr,"creating memory object failed \n");
+			return -1;
+		}
 
-				LOG(stdout," After temp file creation %s \n", argv[2]);
-				output_fd = -1;
-				output_fd = setup_map_file1(argv[2], output_size *10);
-				output_fp = fdopen(output_fd,"w");
-				if(!output_fp){
-					LOG(stderr,"opening output file failed \n");
-					return -1;
-				}
+		LOG(stdout," After temp file creation %s \n", argv[2]);
+		output_fd = -1;
+		output_fd = setup_map_file1(argv[2], output_size *10);
+		output_fp = fdopen(output_fd,"w");
+		if(!output_fp){
+			LOG(stderr,"opening output file failed \n");
+			return -1;
+		}
 
 #ifdef USE_NVMALLOC
 
-				outaddr = NULL;
-				//outaddr = (char *)allocate_nvmem(output_size);
-				outaddr = out_addr_arr[idx];
-				LOG(stdout,"outaddr %s \n", outaddr);
-				//continue;
+		outaddr = NULL;
+		//outaddr = (char *)allocate_nvmem(output_size);
+		outaddr = out_addr;
+		LOG(stdout,"outaddr %s \n", outaddr);
+		//continue;
 #else
-				outaddr = (char *)mmap(0, output_size *10, PROT_READ | PROT_WRITE, MAP_SHARED, output_fd, 0);
+		outaddr = (char *)mmap(0, output_size *10, PROT_READ | PROT_WRITE, MAP_SHARED, output_fd, 0);
 #endif
-				if (outaddr == MAP_FAILED) {
-					LOG(stderr, "mmap failed \n");
-					close(output_fd);
-					exit(-1);
-				}
+		if (outaddr == MAP_FAILED) {
+			LOG(stderr, "mmap failed \n");
+			close(output_fd);
+			exit(-1);
+		}
 #ifdef STATS
-				nv_alloc_bytes += output_size;
+		nv_alloc_bytes += output_size;
 #endif
-				output_id++;
 #else	
-				//also update the input file pointer
-				input = fdopen(input_fd, "r");
-				if(!input) {
-					LOG(stderr, "unable to open file %s \n", argv[3]);
-					goto error;
-				}
+		//also update the input file pointer
+		input = fdopen(input_fd, "r");
+		if(!input) {
+			LOG(stderr, "unable to open file %s \n", argv[3]);
+			goto error;
+		}
 #endif
 
 #ifdef DEBUG
-				LOG(stdout,"before learn_or_classify_data \n");
+		LOG(stdout,"before learn_or_classify_data \n");
 #endif
-				learn_or_classify_data(argc, argv, input, output_fp, data_len, NULL, addr, outaddr );
+		learn_or_classify_data(argc, argv, input, output_fp, data_len, NULL, addr, outaddr );
 
 #ifdef NVRAM
-				LOG(stdout,"successfuly learnt data  %s\n\n\n\n\n\n", argv[6]);
+		LOG(stdout,"successfuly learnt data  %s\n\n\n\n\n\n", argv[argc - 1]);
 #endif
 
 #ifndef NVRAM
-				close(output_fd);
+		close(output_fd);
+#endif
+		return 0;
+		error:
+		return -1;
+}
+
+/* collects a finished child: its output goes to the category's
+   persistent buffer, its counters to ours */
+static int reap_category(pid_t *pids, int num_categories, char **out_addr_arr,
+		char *shared_out, void *shared_stats) {
+	int idx, status;
+	pid_t pid;
+
+	pid = wait(&status);
+	if( pid <= 0 ) {
+		return -1;
+	}
+	for(idx = 1; (idx <= num_categories) && (pids[idx] != pid); idx++);
+	if( idx > num_categories ) {
+		return 0;
+	}
+	pids[idx] = 0;
+	if( !(WIFEXITED(status) && (WEXITSTATUS(status) == 0)) ) {
+		return -1;
+	}
+	if( out_addr_arr[idx] && shared_out ) {
+		memcpy(out_addr_arr[idx], shared_out + (idx - 1) * output_size, 
+				output_size);
+	}
+#ifdef STATS
+	if( shared_stats ) {
+		add_stats((learn_stats_t *)shared_stats + idx);
+	}
+#endif
+	return 0;
+}
+
+int learn_data(int num_categories)
+{
+		int idx = 0;
+		int status = 0;
+		int failed = 0;
+		long jobs = LEARN_JOBS;
+		long running = 0;
+		pid_t pid;
+		pid_t pids[num_categories + 1];
+		/* children can't write to our private buffers, they write
+		   here and we copy when they are done */
+		char *shared_out = NULL;
+		void *shared_stats = NULL;
+		//Message from browser
+	
+		char *out_addr_arr[num_categories + 1];
+
+		for (  idx = 0; idx <= num_categories; idx ++) {
+			out_addr_arr[idx] = NULL;
+			pids[idx] = 0;
+		}
+
+#ifdef USE_NVMALLOC	
+		  for (  idx = 1; idx <= num_categories; idx ++) {
+                out_addr_arr[idx] = (char *)allocate_nvmem(output_size);
+				memset(out_addr_arr[idx], 0, output_size);
+           }
 #endif
+
+		if( jobs <= 0 ) {
+			jobs = sysconf(_SC_NPROCESSORS_ONLN);
+		}
+
+		if( num_categories > 1 ) {
+			/* the categories share most of their vocabulary, whether
+			   they're learned here or in forked children */
+			intern_init(INTERN_SLOTS, INTERN_TEXT);
+		}
+
+		if( (jobs > 1) && (num_categories > 1) ) {
+			shared_out = (char *)mmap(0, output_size * num_categories,
+					PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+#ifdef STATS
+			shared_stats = mmap(0, sizeof(learn_stats_t) * (num_categories + 1),
+					PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+#endif
+			if( (shared_out == MAP_FAILED) || (shared_stats == MAP_FAILED) ) {
+				LOG(stderr, "no shared memory, learning one category at a time\n");
+				if( shared_out != MAP_FAILED ) {
+					munmap(shared_out, output_size * num_categories);
+				}
+				shared_out = NULL;
+				shared_stats = NULL;
+				jobs = 1;
 			}
+		}
+
+#ifdef STATS
+			gettimeofday(&start_learn_time, NULL);
+#endif
+
+			for (  idx = 1; idx <= num_categories; idx ++) {
+
+				if( (jobs <= 1) || (num_categories == 1) ) {
+					if( learn_category(idx, out_addr_arr[idx]) < 0 ) {
+						goto error;
+					}
+					continue;
+				}
+
+				/* don't let the children inherit unflushed output */
+				fflush(NULL);
+				pid = fork();
+				if( pid == 0 ) {
+#ifdef STATS
+					clear_stats();
+#endif
+					status = learn_category(idx, out_addr_arr[idx] ? 
+							shared_out + (idx - 1) * output_size : NULL);
+#ifdef STATS
+					if( shared_stats ) {
+						save_stats((learn_stats_t *)shared_stats + idx);
+					}
+#endif
+					fflush(NULL);
+					_exit((status < 0) ? 1 : 0);
+				} else if( pid < 0 ) {
+					LOG(stderr, "fork failed, learning category %d here\n", idx);
+					if( learn_category(idx, out_addr_arr[idx]) < 0 ) {
+						failed = 1;
+					}
+					continue;
+				}
+				pids[idx] = pid;
+
+				if( ++running >= jobs ) {
+					if( reap_category(pids, num_categories, out_addr_arr,
+							shared_out, shared_stats) < 0 ) {
+						failed = 1;
+					}
+					running--;
+				}
+			}
+
+			while( running > 0 ) {
+				if( reap_category(pids, num_categories, out_addr_arr,
+						shared_out, shared_stats) < 0 ) {
+					failed = 1;
+				}
+				running--;
+			}
+
+			if( shared_out ) {
+				munmap(shared_out, output_size * num_categories);
+			}
+#ifdef STATS
+			if( shared_stats ) {
+				munmap(shared_stats, sizeof(learn_stats_t) * (num_categories + 1));
+			}
+#endif
 
 #ifdef STATS
 			gettimeofday(&end_learn_time, NULL);
-			//tot_learn_time = simulation_time(start_learn_time, end_learn_time);
+			tot_learn_time = (end_learn_time.tv_sec - start_learn_time.tv_sec) * 1000000 +
+				(end_learn_time.tv_usec - start_learn_time.tv_usec);
 #endif //STATS
 
+			if( failed ) {
+				goto error;
+			}
+#ifdef STATS
+			print_stats();
+#endif
+
 ret:
 		return 0;
 		error:
@@ -743,19 +990,27 @@ ret:
 		close(temp_file);				
 #endif
 	       	
+		return 0;
 }
 
 
 #ifdef NACL
 int main_test(std::string message) {
 #else
-	int main() {
+	int main(int ac, char **av) {
 #endif
 
 	int num_categories = NUM_CATEGORIES;
 
+#ifndef NACL
+	extra_argc = ac - 1;
+	extra_argv = av + 1;
+#endif
+
 #ifdef LEARN_DATA
-		learn_data( num_categories);
+		if( learn_data( num_categories) < 0 ) {
+			goto error;
+		}
 #else // NOT LEARN_DATA 
 
 #ifdef NACL
@@ -10,7 +10,10 @@ You can use this free for any purpose.  It has no warranty.
 #include "config.h"
 #endif
 #include "dbacl.h"
-#if defined JENKINS4
+
+/* both this and the 64 bit hash in jenkins2.cc are always built, so
+   categories of either id width can be used. hash() in util.h is
+   the one which matches hash_value_t */
 
 typedef  unsigned long  int  ub4;   /* unsigned 4-byte quantities */
 typedef  unsigned       char ub1;   /* unsigned 1-byte quantities */
@@ -69,12 +72,12 @@ acceptable.  Do NOT use for cryptographic purposes.
 */
 
 
-ub4 hash(
-register ub1 *k,        /* the key */
-register ub4  length,   /* the length of the key */
-register ub4  initval)  /* the previous hash, or an arbitrary value */
+ub4 hash_jenkins4(
+ub1 *k,        /* the key */
+ub4  length,   /* the length of the key */
+ub4  initval)  /* the previous hash, or an arbitrary value */
 {
-   register ub4 a,b,c,len;
+   ub4 a,b,c,len;
 
 
    /* Set up the internal state */
@@ -114,5 +117,3 @@ register ub4  initval)  /* the previous hash, or an arbitrary value */
    /*-------------------------------------------- report the result */
    return c;
 }
-
-#endif
@@ -10,7 +10,8 @@ You can use this free for any purpose.  It has no warranty.
 #include "config.h"
 #endif
 #include "dbacl.h"
-#if defined JENKINS8
+
+/* always built, see jenkins.cc */
 
 /* #include <stdio.h> */
 /* #include <stddef.h> */
@@ -86,12 +87,12 @@ is acceptable.  Do NOT use for cryptographic purposes.
 --------------------------------------------------------------------
 */
 
-ub8 hash( k, length, level)
-register ub1 *k;        /* the key */
-register ub8  length;   /* the length of the key */
-register ub8  level;    /* the previous hash, or an arbitrary value */
+ub8 hash_jenkins8(
+ub1 *k,        /* the key */
+ub8  length,   /* the length of the key */
+ub8  level)    /* the previous hash, or an arbitrary value */
 {
-  register ub8 a,b,c,len;
+  ub8 a,b,c,len;
 
   /* Set up the internal state */
   len = length;
@@ -155,12 +156,12 @@ register ub8  level;    /* the previous hash, or an arbitrary value */
  -- that the length be the number of ub8's in the key
 --------------------------------------------------------------------
 */
-ub8 hash2( k, length, level)
-register ub8 *k;        /* the key */
-register ub8  length;   /* the length of the key */
-register ub8  level;    /* the previous hash, or an arbitrary value */
+ub8 hash2(
+ub8 *k,        /* the key */
+ub8  length,   /* the length of the key */
+ub8  level)    /* the previous hash, or an arbitrary value */
 {
-  register ub8 a,b,c,len;
+  ub8 a,b,c,len;
 
   /* Set up the internal state */
   len = length;
@@ -200,12 +201,12 @@ register ub8  level;    /* the previous hash, or an arbitrary value */
 --------------------------------------------------------------------
 */
 
-ub8 hash3( k, length, level)
-register ub1 *k;        /* the key */
-register ub8  length;   /* the length of the key */
-register ub8  level;    /* the previous hash, or an arbitrary value */
+ub8 hash3(
+ub1 *k,        /* the key */
+ub8  length,   /* the length of the key */
+ub8  level)    /* the previous hash, or an arbitrary value */
 {
-  register ub8 a,b,c,d,len;
+  ub8 a,b,c,d,len;
 
   /* Set up the internal state */
   len = length;
@@ -273,5 +274,3 @@ register ub8  level;    /* the previous hash, or an arbitrary value */
   /*-------------------------------------------- report the result */
   return c;
 }
-
-#endif
@@ -253,7 +253,7 @@ static struct proc_obj * create_proc_obj(int pid) {
 #endif
       proc_map = setup_map_file_nv(file_name, METADATA_MAP_SIZE);
       if (proc_map < 1) {
-          printf("failed to create a map\n");
+          fprintf(stderr, "failed to create a map\n");
           return NULL;
       }
 
@@ -494,7 +494,7 @@ void* nv_mmap(struct rqst_struct *rqst) {
         //FIXME: this just addressies one process, since map_read field is global
 	    //proc_obj = read_map_from_pmem(pid);
     	if(!proc_obj){
-	       printf("getting proc object from pmem failed.create new process\n");
+	       fprintf(stderr, "getting proc object from pmem failed.create new process\n");
 	    }
 	}*/
 	if (!proc_obj) {
@@ -577,7 +577,7 @@ int nv_data_commit(struct rqst_struct *rqst) {
  
 	struct chunk *chunk = find_chunk(vma_id, proc_obj); 
 	if(!chunk) {
-		printf("nv_commit:finding chunk failed \n");
+		fprintf(stderr, "nv_commit:finding chunk failed \n");
 		goto error;
 	}
 
@@ -591,11 +591,11 @@ int nv_data_commit(struct rqst_struct *rqst) {
 
 	addr = wr_addr;
 	//imc_nvram_obj_create(addr, addr);
-	fprintf(stdout,"nv_map.c:before calling nvcommit \n");
+	fprintf(stderr,"nv_map.c:before calling nvcommit \n");
     //result = nvcommit(addr, size);
 	
     if(result) {
-		fprintf(stdout,"nv_map.c:flush result %d \n",result);
+		fprintf(stderr,"nv_map.c:flush result %d \n",result);
 		return -1;
     }
 
@@ -666,7 +666,7 @@ int update_offset(UINT proc_id, unsigned int offset, struct rqst_struct *rqst) {
     	   if(rqst->var){ 
 				vma_id = generate_vmaid((const char*)rqst->var);
             }else{
-				printf("nv_commit:error generating vma id \n");
+				fprintf(stderr, "nv_commit:error generating vma id \n");
                 goto error;  
  			}
        }
@@ -903,7 +903,7 @@ void* nv_map_read(struct rqst_struct *rqst, void* map ) {
 	    //FIXME: this just addressies one process, since map_read field is global
 	    proc_obj = read_map_from_pmem(process_id);
     	if(!proc_obj){
-	       printf("getting proc object from pmem failed\n");
+	       fprintf(stderr, "getting proc object from pmem failed\n");
     	   goto error;
 	    }
 	}
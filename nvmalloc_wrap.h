@@ -12,7 +12,10 @@ extern "C" {
 #define CHUNK_ID 1
 #define MAXSIZE 200 * 1024 * 1024
 
+/* define NO_NVMALLOC to run on a plain file system, without nvmap */
+#ifndef NO_NVMALLOC
 #define USE_NVMALLOC
+#endif
 //#define ALLOCATE
 //#define FASTA_DELETE_ME
 
@@ -4793,7 +4793,7 @@ void* dlpnvmalloc(size_t bytes, struct rqst_struct *rqst) {
 	//This will also create a new
 	//process object structure if they do not exist
 	if(nv_mmap(rqst)) {
-		fprintf(stdout, "updating process object failed");
+		fprintf(stderr, "updating process object failed");
 	}
 
 //void* dlmalloc(size_t bytes) {
@@ -20,6 +20,9 @@
 
 #include <math.h>
 #include "util.h"
+#if defined __SSE2__
+#include <emmintrin.h>
+#endif
 
 /* returns the logarithm of a Poisson distribution 
    (calculations based on Stirling's formula) */
@@ -45,3 +48,210 @@ double gamma_tail(double a, double b, double x) {
 double normal_cdf(double x) {
   return ndtr(x);
 }
+
+/* replaces x[0..n-1] by their exponentials. This uses Cody-Waite
+   range reduction and a degree 11 Taylor polynomial on |r| <= log(2)/2,
+   which is good to about 1e-15 relative error. Below VEXP_MIN the
+   result is 0, where libm would still return a subnormal (less than
+   3.3e-308), and above VEXP_MAX it is exp(VEXP_MAX). NaNs go through.
+   The SSE2 loop and the scalar tail do the same operations, so each
+   x[j] gets the same result whichever one handles it. */
+#define VEXP_MIN (-708.0)
+#define VEXP_MAX 709.0
+#define VEXP_LOG2E 1.4426950408889634
+#define VEXP_LN2HI 6.93145751953125e-1
+#define VEXP_LN2LO 1.42860682030941723212e-6
+#define VEXP_POLY(r) \
+  (1.0 + (r) * (1.0 + (r) * (1.0/2 + (r) * (1.0/6 + (r) * (1.0/24 + \
+  (r) * (1.0/120 + (r) * (1.0/720 + (r) * (1.0/5040 + (r) * (1.0/40320 + \
+  (r) * (1.0/362880 + (r) * (1.0/3628800 + (r) * (1.0/39916800))))))))))))
+
+void vexp(double *x, int n) {
+  int j = 0;
+  double v, k, r;
+
+#if defined __SSE2__
+  __m128d vv, vk, vr, vp, vz;
+  __m128i ki, ke;
+  const __m128d lo = _mm_set1_pd(VEXP_MIN);
+  const __m128d hi = _mm_set1_pd(VEXP_MAX);
+  const __m128d log2e = _mm_set1_pd(VEXP_LOG2E);
+  const __m128d ln2hi = _mm_set1_pd(VEXP_LN2HI);
+  const __m128d ln2lo = _mm_set1_pd(VEXP_LN2LO);
+  const __m128d one = _mm_set1_pd(1.0);
+
+  for(; j + 2 <= n; j += 2) {
+    vv = _mm_loadu_pd(x + j);
+    vz = _mm_cmplt_pd(vv, lo); /* false for NaN */
+    /* NaN is the second operand, so it survives the clamp */
+    vv = _mm_min_pd(hi, _mm_max_pd(lo, vv));
+    ki = _mm_cvtpd_epi32(_mm_mul_pd(vv, log2e)); /* rounds to nearest */
+    vk = _mm_cvtepi32_pd(ki);
+    vr = _mm_sub_pd(_mm_sub_pd(vv, _mm_mul_pd(vk, ln2hi)), 
+		    _mm_mul_pd(vk, ln2lo));
+
+    vp = _mm_set1_pd(1.0/39916800);
+    vp = _mm_add_pd(_mm_mul_pd(vp, vr), _mm_set1_pd(1.0/3628800));
+    vp = _mm_add_pd(_mm_mul_pd(vp, vr), _mm_set1_pd(1.0/362880));
+    vp = _mm_add_pd(_mm_mul_pd(vp, vr), _mm_set1_pd(1.0/40320));
+    vp = _mm_add_pd(_mm_mul_pd(vp, vr), _mm_set1_pd(1.0/5040));
+    vp = _mm_add_pd(_mm_mul_pd(vp, vr), _mm_set1_pd(1.0/720));
+    vp = _mm_add_pd(_mm_mul_pd(vp, vr), _mm_set1_pd(1.0/120));
+    vp = _mm_add_pd(_mm_mul_pd(vp, vr), _mm_set1_pd(1.0/24));
+    vp = _mm_add_pd(_mm_mul_pd(vp, vr), _mm_set1_pd(1.0/6));
+    vp = _mm_add_pd(_mm_mul_pd(vp, vr), _mm_set1_pd(1.0/2));
+    vp = _mm_add_pd(_mm_mul_pd(vp, vr), one);
+    vp = _mm_add_pd(_mm_mul_pd(vp, vr), one);
+
+    /* build 2^k directly in the exponent bits */
+    ke = _mm_add_epi32(ki, _mm_set1_epi32(1023));
+    ke = _mm_slli_epi64(_mm_unpacklo_epi32(ke, _mm_setzero_si128()), 52);
+    _mm_storeu_pd(x + j, 
+		  _mm_andnot_pd(vz, _mm_mul_pd(vp, _mm_castsi128_pd(ke))));
+  }
+#endif
+
+  for(; j < n; j++) {
+    v = x[j];
+    if( v < VEXP_MIN ) {
+      x[j] = 0.0;
+      continue;
+    } else if( v > VEXP_MAX ) {
+      v = VEXP_MAX;
+    }
+    k = nearbyint(v * VEXP_LOG2E);
+    r = (v - k * VEXP_LN2HI) - k * VEXP_LN2LO;
+    x[j] = isnan(v) ? v : ldexp(VEXP_POLY(r), (int)k);
+  }
+}
+
+/* pairwise sum of x[0..n-1], overwrites x */
+double pairwise_sum(double *x, int n) {
+  int j, w;
+  if( n <= 0 ) {
+    return 0.0;
+  }
+  for(w = 1; w < n; w *= 2) {
+    for(j = 0; j + w < n; j += 2 * w) {
+      x[j] += x[j + w];
+    }
+  }
+  return x[0];
+}
+
+/* replaces x[0..n-1] by their logarithms. Each x = m 2^e with m in
+   [sqrt(1/2), sqrt(2)), and log(m) = 2 atanh((m-1)/(m+1)) is summed
+   to the s^19 term, about 1e-16 relative error. Zero, negative,
+   subnormal and non finite values go to libm's log(). As in vexp(),
+   the SSE2 loop and the scalar path agree on every element. */
+#define VLOG_LN2HI 6.93147180369123816490e-01
+#define VLOG_LN2LO 1.90821492927058770002e-10
+#define VLOG_SQRT2 1.4142135623730951
+#define VLOG_POLY(z) \
+  (2.0 + (z) * (2.0/3 + (z) * (2.0/5 + (z) * (2.0/7 + (z) * (2.0/9 + \
+  (z) * (2.0/11 + (z) * (2.0/13 + (z) * (2.0/15 + (z) * (2.0/17 + \
+  (z) * (2.0/19))))))))))
+
+void vlog(double *x, int n) {
+  int j = 0, e;
+  double m, u, z;
+
+#if defined __SSE2__
+  __m128d vm, vs, vz, vp, ve, big, vx;
+  __m128i bits, vei;
+  const __m128i mant = _mm_set1_epi64x(0x000fffffffffffffLL);
+  const __m128i bias = _mm_set1_epi64x(0x3ff0000000000000LL);
+  const __m128d one = _mm_set1_pd(1.0);
+  const __m128d half = _mm_set1_pd(0.5);
+  const __m128d sqrt2 = _mm_set1_pd(VLOG_SQRT2);
+  const __m128d minnorm = _mm_set1_pd(2.2250738585072014e-308);
+  const __m128d maxnorm = _mm_set1_pd(1.7976931348623157e308);
+
+  for(; j + 2 <= n; j += 2) {
+    vx = _mm_loadu_pd(x + j);
+    /* both must be positive normal numbers, else use the scalar path */
+    if( _mm_movemask_pd(_mm_and_pd(_mm_cmpge_pd(vx, minnorm), 
+				   _mm_cmple_pd(vx, maxnorm))) != 3 ) {
+      break;
+    }
+    bits = _mm_castpd_si128(vx);
+    vm = _mm_castsi128_pd(_mm_or_si128(_mm_and_si128(bits, mant), bias));
+    vei = _mm_sub_epi32(_mm_srli_epi64(bits, 52), _mm_set1_epi32(1023));
+    /* the exponents sit in the low halves of the two 64 bit lanes */
+    ve = _mm_cvtepi32_pd(_mm_shuffle_epi32(vei, _MM_SHUFFLE(3,1,2,0)));
+    big = _mm_cmpge_pd(vm, sqrt2);
+    vm = _mm_or_pd(_mm_and_pd(big, _mm_mul_pd(vm, half)), 
+		   _mm_andnot_pd(big, vm));
+    ve = _mm_add_pd(ve, _mm_and_pd(big, one));
+
+    vs = _mm_div_pd(_mm_sub_pd(vm, one), _mm_add_pd(vm, one));
+    vz = _mm_mul_pd(vs, vs);
+    vp = _mm_set1_pd(2.0/19);
+    vp = _mm_add_pd(_mm_mul_pd(vp, vz), _mm_set1_pd(2.0/17));
+    vp = _mm_add_pd(_mm_mul_pd(vp, vz), _mm_set1_pd(2.0/15));
+    vp = _mm_add_pd(_mm_mul_pd(vp, vz), _mm_set1_pd(2.0/13));
+    vp = _mm_add_pd(_mm_mul_pd(vp, vz), _mm_set1_pd(2.0/11));
+    vp = _mm_add_pd(_mm_mul_pd(vp, vz), _mm_set1_pd(2.0/9));
+    vp = _mm_add_pd(_mm_mul_pd(vp, vz), _mm_set1_pd(2.0/7));
+    vp = _mm_add_pd(_mm_mul_pd(vp, vz), _mm_set1_pd(2.0/5));
+    vp = _mm_add_pd(_mm_mul_pd(vp, vz), _mm_set1_pd(2.0/3));
+    vp = _mm_add_pd(_mm_mul_pd(vp, vz), _mm_set1_pd(2.0));
+
+    _mm_storeu_pd(x + j, 
+		  _mm_add_pd(_mm_add_pd(_mm_mul_pd(ve, _mm_set1_pd(VLOG_LN2LO)),
+					_mm_mul_pd(vs, vp)),
+			     _mm_mul_pd(ve, _mm_set1_pd(VLOG_LN2HI))));
+  }
+#endif
+
+  for(; j < n; j++) {
+    if( !(x[j] >= 2.2250738585072014e-308) || 
+	!(x[j] <= 1.7976931348623157e308) ) {
+      x[j] = log(x[j]);
+      continue;
+    }
+    m = 2.0 * frexp(x[j], &e); /* m in [1, 2) */
+    e--;
+    if( m >= VLOG_SQRT2 ) {
+      m *= 0.5;
+      e++;
+    }
+    u = (m - 1.0)/(m + 1.0);
+    z = u * u;
+    x[j] = ((double)e * VLOG_LN2LO + u * VLOG_POLY(z)) + (double)e * VLOG_LN2HI;
+  }
+}
+
+/* sum of 1/k for k = 1..n, exact summation for small n, 
+   else the asymptotic expansion */
+double harmonic_sum(long n) {
+  double t = 0.0, x, x2;
+  long k;
+  if( n < 32 ) {
+    for(k = n; k > 0; k--) {
+      t += 1.0/k;
+    }
+    return t;
+  }
+  x = (double)n;
+  x2 = 1.0/(x * x);
+  return log(x) + 0.57721566490153286061 + 0.5/x - 
+    x2 * (1.0/12 - x2 * (1.0/120 - x2 * (1.0/252)));
+}
+
+/* sum of 1/k^2 for k = 1..n */
+double harmonic2_sum(long n) {
+  double t = 0.0, x, x2;
+  long k;
+  if( n < 32 ) {
+    for(k = n; k > 0; k--) {
+      t += 1.0/((double)k * k);
+    }
+    return t;
+  }
+  /* pi^2/6 - trigamma(n + 1) */
+  x = (double)(n + 1);
+  x2 = 1.0/(x * x);
+  return 1.64493406684822643647 - 
+    (1.0/x + x2 * (0.5 + (1.0/x) * (1.0/6 - x2 * (1.0/30 - x2 * (1.0/42)))));
+}
@@ -0,0 +1,37 @@
+#!/bin/sh
+# Learns categories with 32-bit hashes, then classifies them with the
+# normal build and with a 64-bit hash build (HUGE_MEMORY_MODEL), which
+# must read them through their hash_width header and give the same
+# scores.
+# Run from the top directory.
+
+. tests/plain.sh
+
+work=`mktemp -d /tmp/hash_width.XXXXXX` || exit 1
+trap 'rm -rf $work' 0
+
+build_objects $work/o || exit 1
+build_objects $work/oh -DHUGE_MEMORY_MODEL || exit 1
+build_dbacl $work/learn $work/o -DNUM_CATEGORIES=2 -DLEARN_JOBS=1 || exit 1
+build_dbacl $work/classify $work/o -DNUM_CATEGORIES=2 -DCLASSIFY_DATA || exit 1
+build_dbacl $work/classifyh $work/oh -DNUM_CATEGORIES=2 -DCLASSIFY_DATA \
+	-DHUGE_MEMORY_MODEL || exit 1
+
+mkdir $work/c
+make_text 1 2000 > $work/c/1.txt
+make_text 2 2000 > $work/c/2.txt
+make_text 1 50 > $work/c/22.txt
+learn_into $work/c $work/learn -h 16 || exit 1
+if ! grep -aq "^# hash_width 32" $work/c/1_out; then
+	echo "hash_width: the category has no hash_width header"; exit 1
+fi
+
+ref=`classify_in $work/c $work/classify` || exit 1
+out=`classify_in $work/c $work/classifyh` || exit 1
+if [ -z "$ref" ] || [ "$ref" != "$out" ]; then
+	echo "hash_width: 64-bit build scores 32-bit categories differently"
+	echo "$ref"; echo "$out"; exit 1
+fi
+
+echo "hash_width: ok"
+exit 0
@@ -0,0 +1,58 @@
+#!/bin/sh
+# Learns two categories in parallel and checks that each child left its
+# own output and its own online dump behind, and that the outputs match
+# those of learning the categories one at a time.
+# Run from the top directory.
+
+. tests/plain.sh
+
+top=`pwd`
+work=`mktemp -d /tmp/learn_jobs.XXXXXX` || exit 1
+trap 'rm -rf $work' 0
+
+build_objects $work/o || exit 1
+for j in 1 2; do
+	build_dbacl $work/dbacl$j $work/o -DNUM_CATEGORIES=2 -DLEARN_JOBS=$j || exit 1
+done
+
+for j in 1 2; do
+	mkdir $work/run$j
+	cd $work/run$j
+	make_text 1 2000 > 1.txt
+	make_text 2 2000 > 2.txt
+	touch start
+
+	../dbacl$j > log 2>&1
+	if [ $? -ne 0 ]; then
+		echo "learn_jobs: dbacl failed with $j jobs"; cat log; exit 1
+	fi
+
+	for i in 1 2; do
+		if ! grep -q "successfuly learnt data  ${i}_online" log; then
+			echo "learn_jobs: category $i was not learned"; exit 1
+		fi
+		if [ ! -s ${i}_out ]; then
+			echo "learn_jobs: no output for category $i"; exit 1
+		fi
+		dump=`find /tmp -maxdepth 1 -name "dbacl.*.$i.online" -newer start | head -1`
+		if [ -z "$dump" ] || [ ! -s "$dump" ]; then
+			echo "learn_jobs: no online dump for category $i"; exit 1
+		fi
+		eval dump$i=$dump
+	done
+
+	if cmp -s $dump1 $dump2; then
+		echo "learn_jobs: both categories left the same online dump"; exit 1
+	fi
+	rm -f $dump1 $dump2
+	cd $top
+done
+
+for i in 1 2; do
+	if ! cmp -s $work/run1/${i}_out $work/run2/${i}_out; then
+		echo "learn_jobs: category $i differs when learned in parallel"; exit 1
+	fi
+done
+
+echo "learn_jobs: ok"
+exit 0
@@ -0,0 +1,33 @@
+#!/bin/sh
+# Learns the same categories serially and with -J1 and -J4, which must
+# all leave byte for byte identical outputs.
+# Run from the top directory.
+
+. tests/plain.sh
+
+work=`mktemp -d /tmp/learn_threads.XXXXXX` || exit 1
+trap 'rm -rf $work' 0
+
+build_objects $work/o || exit 1
+build_dbacl $work/learn $work/o -DNUM_CATEGORIES=2 -DLEARN_JOBS=1 || exit 1
+
+for run in serial J1 J4; do
+	mkdir $work/$run
+	make_text 1 20000 > $work/$run/1.txt
+	make_text 2 20000 > $work/$run/2.txt
+done
+
+learn_into $work/serial $work/learn || exit 1
+learn_into $work/J1 $work/learn -J 1 || exit 1
+learn_into $work/J4 $work/learn -J 4 || exit 1
+
+for run in J1 J4; do
+	for i in 1 2; do
+		if ! cmp -s $work/serial/${i}_out $work/$run/${i}_out; then
+			echo "learn_threads: category $i differs with -${run}"; exit 1
+		fi
+	done
+done
+
+echo "learn_threads: ok"
+exit 0
@@ -0,0 +1,75 @@
+# Sourced by the tests, from the top directory. Builds dbacl without
+# nvmap (NO_NVMALLOC), so that it runs on a plain file system, and
+# makes up the category texts.
+
+objs="dbacl fram catfun fh util probs jenkins jenkins2 mtherr igam gamma \
+	const polevl isnan ndtr nv_map oswego_malloc nvmalloc_wrap ptmalloc"
+
+# build_objects DIR [FLAGS]: compiles the objects into DIR
+build_objects() {
+	dir=$1; shift
+	mkdir -p $dir || return 1
+	pids=""
+	for o in $objs; do
+		g++ -DHAVE_CONFIG_H -DNO_NVMALLOC -O2 -w "$@" -c $o.cc -o $dir/$o.o &
+		pids="$pids $!"
+	done
+	# mbw.cc compares pointers with integers, which g++ now rejects
+	for m in MB WIDE; do
+		g++ -DHAVE_CONFIG_H -DNO_NVMALLOC -O2 -fpermissive -w "$@" \
+			-DMBW_$m -c mbw.cc -o $dir/$m.o &
+		pids="$pids $!"
+	done
+	fail=0
+	for p in $pids; do
+		wait $p || fail=1
+	done
+	return $fail
+}
+
+# build_dbacl OUT DIR [FLAGS]: links the harness against the objects in DIR
+build_dbacl() {
+	out=$1; dir=$2; shift 2
+	g++ -DNO_NVMALLOC -O2 -w "$@" hello_world.cc -o $out \
+		`for o in $objs MB WIDE; do echo $dir/$o.o; done` -lm -lpthread
+}
+
+# make_text SEED LINES: prints LINES lines of made up words, each
+# category (seed) favouring its own letters
+make_text() {
+	awk -v seed=$1 -v lines=$2 'BEGIN {
+		srand(seed);
+		for(l = 0; l < lines; l++) {
+			line = "";
+			for(w = 0; w < 12; w++) {
+				word = "";
+				n = 2 + int(rand() * 6);
+				for(k = 0; k < n; k++) {
+					c = (rand() < 0.6) ? (seed * 5 + int(rand() * 6)) : int(rand() * 26);
+					word = word sprintf("%c", 97 + c % 26);
+				}
+				line = line word " ";
+			}
+			print line;
+		}
+	}'
+}
+
+# learn_into DIR PROG [SWITCHES]: learns DIR/1.txt, DIR/2.txt ... with the
+# harness PROG, passing SWITCHES on to dbacl
+learn_into() {
+	dir=$1; prog=$2; shift 2
+	(cd $dir && $prog "$@" > learn.log 2>&1) || {
+		echo "dbacl failed to learn in $dir"; cat $dir/learn.log; return 1
+	}
+}
+
+# classify_in DIR PROG [SWITCHES]: classifies DIR/22.txt against the
+# categories learned in DIR, printing only the scores
+classify_in() {
+	dir=$1; prog=$2; shift 2
+	(cd $dir && $prog -n "$@" > classify.log 2> classify.err) || {
+		echo "dbacl failed to classify in $dir" >&2; return 1
+	}
+	grep "_out.tmp.0" $dir/classify.log
+}
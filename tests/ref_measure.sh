@@ -0,0 +1,54 @@
+#!/bin/sh
+# Learns 3-gram categories with words longer than MAX_TOKEN_LEN, once
+# with the reference measure taken from build_ref_cache() and once
+# rereading the token file on every pass (NO_REF_CACHE). Both must
+# read every token and leave byte for byte identical categories.
+# Run from the top directory.
+
+. tests/plain.sh
+
+work=`mktemp -d /tmp/ref_measure.XXXXXX` || exit 1
+trap 'rm -rf $work' 0
+
+build_objects $work/o || exit 1
+build_objects $work/on -DNO_REF_CACHE || exit 1
+build_dbacl $work/learn $work/o -DNUM_CATEGORIES=2 -DLEARN_JOBS=1 || exit 1
+build_dbacl $work/learnn $work/on -DNUM_CATEGORIES=2 -DLEARN_JOBS=1 \
+	-DNO_REF_CACHE || exit 1
+
+for run in cache file; do
+	mkdir $work/$run
+	# about a third of the words are 25 to 64 letters long
+	awk 'BEGIN {
+		srand(7);
+		for(l = 0; l < 1500; l++) {
+			line = "";
+			for(w = 0; w < 8; w++) {
+				n = (rand() < 0.3) ? 25 + int(rand() * 40) : 2 + int(rand() * 6);
+				word = "";
+				for(k = 0; k < n; k++) {
+					word = word sprintf("%c", 97 + int(rand() * rand() * 26));
+				}
+				line = line word " ";
+			}
+			print line;
+		}
+	}' > $work/$run/1.txt
+	make_text 2 1500 > $work/$run/2.txt
+done
+
+learn_into $work/cache $work/learn -w 3 || exit 1
+learn_into $work/file $work/learnn -w 3 || exit 1
+
+for i in 1 2; do
+	if ! grep -aq "max_order 3" $work/cache/${i}_out; then
+		echo "ref_measure: category $i is not a 3-gram model"; exit 1
+	fi
+	if ! cmp -s $work/cache/${i}_out $work/file/${i}_out; then
+		echo "ref_measure: the cached reference measure differs for category $i"
+		exit 1
+	fi
+done
+
+echo "ref_measure: ok"
+exit 0
@@ -0,0 +1,98 @@
+#!/bin/sh
+# Checks that a category learned with -W loads like one learned without
+# it, and that a corrupt region falls back to the other one: region 1 of
+# category A gets the region of category B, then region 0 of A is
+# damaged, and A must classify as B did. With both regions damaged the
+# category must not load.
+# Run from the top directory.
+
+. tests/plain.sh
+
+top=`pwd`
+work=`mktemp -d /tmp/shadow_regions.XXXXXX` || exit 1
+trap 'rm -rf $work' 0
+
+bits=16
+
+build_objects $work/o || exit 1
+build_dbacl $work/learn $work/o -DNUM_CATEGORIES=2 -DLEARN_JOBS=1 || exit 1
+build_dbacl $work/classify $work/o -DNUM_CATEGORIES=2 -DCLASSIFY_DATA || exit 1
+
+# the size of a region, from the layout in dbacl.h
+cat > $work/rsize.cc <<'END'
+#include <stdlib.h>
+#include "dbacl.h"
+int main(int argc, char **argv) {
+	printf("%lu\n", (unsigned long)SHADOW_REGION_SIZE(1 << atoi(argv[1]),
+		sizeof(c_item_t)));
+	return 0;
+}
+END
+g++ -DHAVE_CONFIG_H -w -I$top $work/rsize.cc -o $work/rsize || exit 1
+size=`$work/rsize $bits`
+
+# flip FILE OFFSET: changes the byte at OFFSET
+flip() {
+	b=`od -An -tu1 -j$2 -N1 $1`
+	printf "\\`printf %o $(( (b + 1) % 256 ))`" |
+		dd of=$1 bs=1 seek=$2 conv=notrunc 2> /dev/null
+}
+
+for run in plain A B; do
+	mkdir $work/$run
+	make_text 1 50 > $work/$run/22.txt
+done
+make_text 1 2000 > $work/plain/1.txt; make_text 2 2000 > $work/plain/2.txt
+cp $work/plain/1.txt $work/plain/2.txt $work/A
+make_text 2 2000 > $work/B/1.txt; make_text 1 2000 > $work/B/2.txt
+
+learn_into $work/plain $work/learn -h $bits || exit 1
+learn_into $work/A $work/learn -h $bits -W || exit 1
+learn_into $work/B $work/learn -h $bits -W || exit 1
+grep "no room" $work/A/learn.log && exit 1
+
+ref=`classify_in $work/plain $work/classify` || exit 1
+refA=`classify_in $work/A $work/classify` || exit 1
+refB=`classify_in $work/B $work/classify` || exit 1
+if [ "$ref" != "$refA" ]; then
+	echo "shadow_regions: -W changed the classification"
+	echo "$ref"; echo "$refA"; exit 1
+fi
+if [ "$refA" = "$refB" ]; then
+	echo "shadow_regions: the two sets of categories classify the same"; exit 1
+fi
+
+for i in 1 2; do
+	# the headers end where region 0 starts
+	len=`grep -obUa wdhs $work/A/${i}_out | head -1 | cut -d: -f1`
+	if [ -z "$len" ] || ! cmp -s -n $len $work/A/${i}_out $work/B/${i}_out; then
+		echo "shadow_regions: category $i has no region 0"; exit 1
+	fi
+	dd if=$work/B/${i}_out of=$work/A/${i}_out bs=4096 conv=notrunc \
+		iflag=skip_bytes,count_bytes oflag=seek_bytes \
+		skip=$len seek=$(( len + size )) count=$size 2> /dev/null || exit 1
+	eval len$i=$len
+done
+out=`classify_in $work/A $work/classify` || exit 1
+if [ "$out" != "$refA" ]; then
+	echo "shadow_regions: an older region was loaded"; exit 1
+fi
+
+for i in 1 2; do
+	eval len=\$len$i
+	flip $work/A/${i}_out $(( len + size / 2 ))
+done
+out=`classify_in $work/A $work/classify` || exit 1
+if [ "$out" != "$refB" ]; then
+	echo "shadow_regions: a damaged region was not skipped"
+	echo "$refB"; echo "$out"; exit 1
+fi
+
+flip $work/A/1_out $(( len1 + size + size / 2 ))
+if classify_in $work/A $work/classify > /dev/null 2>&1 ||
+	! grep -q "no valid region" $work/A/classify.err; then
+	echo "shadow_regions: a category without a valid region was loaded"; exit 1
+fi
+
+echo "shadow_regions: ok"
+exit 0
@@ -0,0 +1,106 @@
+#!/bin/sh
+# Checks vexp() and vlog() against libm, and that the SSE2 loop and the
+# scalar tail agree on every element. Then learns the same categories
+# with and without -K, which must classify the same.
+# Run from the top directory.
+
+. tests/plain.sh
+
+top=`pwd`
+work=`mktemp -d /tmp/vexp.XXXXXX` || exit 1
+trap 'rm -rf $work' 0
+
+build_objects $work/o || exit 1
+
+cat > $work/accuracy.cc <<'END'
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "util.h"
+
+#define N 20001
+
+static double x[N], y[N], z[N];
+
+/* applies f to the whole of x[] into y[], and checks that it gives
+   the same as one element at a time */
+static void check(void (*f)(double *, int), const char *name) {
+  int j;
+
+  memcpy(y, x, sizeof(x));
+  f(y, N);
+  for(j = 0; j < N; j++) {
+    z[j] = x[j];
+    f(z + j, 1);
+    if( memcmp(y + j, z + j, sizeof(double)) ) {
+      printf("%s: %.17g gives %.17g in a block, %.17g alone\n",
+	     name, x[j], y[j], z[j]);
+      exit(1);
+    }
+  }
+}
+
+int main() {
+  int j;
+
+  for(j = 0; j < N; j++) {
+    x[j] = -708.0 + (709.0 + 708.0) * j / (N - 1);
+  }
+  check(vexp, "vexp");
+  for(j = 0; j < N; j++) {
+    if( fabs(y[j] - exp(x[j])) > 1e-14 * exp(x[j]) ) {
+      printf("vexp: %.17g gives %.17g\n", x[j], y[j]);
+      return 1;
+    }
+  }
+
+  for(j = 0; j < N; j++) {
+    x[j] = -750.0 + 42.0 * j / (N - 1) - ((j % 2) ? 1e-9 : 0.0);
+  }
+  memcpy(y, x, sizeof(x));
+  vexp(y, N);
+  for(j = 0; j < N; j++) {
+    if( (x[j] < -708.0) ? (y[j] != 0.0) : (y[j] < 3e-308) ) {
+      printf("vexp: %.17g gives %.17g\n", x[j], y[j]);
+      return 1;
+    }
+  }
+
+  for(j = 0; j < N; j++) {
+    x[j] = exp(-700.0 + 1400.0 * j / (N - 1));
+  }
+  check(vlog, "vlog");
+  for(j = 0; j < N; j++) {
+    if( fabs(y[j] - log(x[j])) > 1e-14 * fabs(log(x[j])) + 1e-16 ) {
+      printf("vlog: %.17g gives %.17g\n", x[j], y[j]);
+      return 1;
+    }
+  }
+  return 0;
+}
+END
+g++ -DHAVE_CONFIG_H -O2 -w -I$top $work/accuracy.cc -o $work/accuracy \
+	`for o in probs igam gamma mtherr const polevl isnan ndtr; do \
+	echo $work/o/$o.o; done` -lm || exit 1
+$work/accuracy || exit 1
+
+build_dbacl $work/learn $work/o -DNUM_CATEGORIES=2 -DLEARN_JOBS=1 || exit 1
+build_dbacl $work/classify $work/o -DNUM_CATEGORIES=2 -DCLASSIFY_DATA || exit 1
+for run in libm K; do
+	mkdir $work/$run
+	make_text 1 2000 > $work/$run/1.txt
+	make_text 2 2000 > $work/$run/2.txt
+	make_text 1 50 > $work/$run/22.txt
+done
+learn_into $work/libm $work/learn || exit 1
+learn_into $work/K $work/learn -K || exit 1
+
+ref=`classify_in $work/libm $work/classify` || exit 1
+out=`classify_in $work/K $work/classify` || exit 1
+if [ -z "$ref" ] || [ "$ref" != "$out" ]; then
+	echo "vexp: -K changed the classification"
+	echo "$ref"; echo "$out"; exit 1
+fi
+
+echo "vexp: ok"
+exit 0
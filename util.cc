@@ -162,6 +162,37 @@ hash_value_t hash_partial_token(const char *tok, int len, const char *extra) {
   return (hash_value_t)hash((unsigned char *)extra, EXTRA_CLASS_LEN, h);
 }
 
+/* hash_full_token() with 32 and 64 bit hash values */
+u_int32_t hash_full_token32(const char *tok) {
+  const char *q;
+  unsigned long int h;
+  q = strchr(tok,EOTOKEN);
+  if( q ) {
+    h = hash_jenkins4((unsigned char *)tok, q - tok, 0);
+    return (u_int32_t)hash_jenkins4((unsigned char *)q, EXTRA_CLASS_LEN, h);
+  } else {
+    errormsg(E_FATAL,
+	    "hash_full_token called with missing class [%s]\n",
+	     tok);
+  }
+  return 0;
+}
+
+u_int64_t hash_full_token64(const char *tok) {
+  const char *q;
+  unsigned long long h;
+  q = strchr(tok,EOTOKEN);
+  if( q ) {
+    h = hash_jenkins8((unsigned char *)tok, q - tok, 0);
+    return (u_int64_t)hash_jenkins8((unsigned char *)q, EXTRA_CLASS_LEN, h);
+  } else {
+    errormsg(E_FATAL,
+	    "hash_full_token called with missing class [%s]\n",
+	     tok);
+  }
+  return 0;
+}
+
 /***********************************************************
  * WEIGHT SIZE REDUCTION                                   *
  ***********************************************************/
@@ -184,7 +215,7 @@ weight_t undigitize_a_weight(digitized_weight_t d, token_order_t order) {
   return ((weight_t)d) / (order<<DIG_FACTOR);
 }
 
-double nats2bits(double score) {
+score_t nats2bits(score_t score) {
   return score/M_LN2;
 }
 
@@ -30,36 +30,71 @@
 
 /* in gcc, most calls to extern inline functions are inlined */
 
+/* string hash functions in jenkins.cc and jenkins2.cc. Both are
+   built, hash() is the one whose values fit hash_value_t */
+unsigned long int hash_jenkins4(unsigned char *k, 
+				unsigned long int length, 
+				unsigned long int initval);
+unsigned long long hash_jenkins8(unsigned char *k,
+				 unsigned long long length,
+				 unsigned long long initval);
+
 #if defined JENKINS4
 
 #define JENKINS_HASH_VALUE unsigned long int
-/* string hash function in jenkins.c */
-unsigned long int hash( unsigned char *k, 
-			unsigned long int length, 
-			unsigned long int initval);
+inline unsigned long int hash( unsigned char *k, 
+			       unsigned long int length, 
+			       unsigned long int initval) {
+  return hash_jenkins4(k, length, initval);
+}
 #elif defined JENKINS8
 
 #define JENKINS_HASH_VALUE unsigned long long
-unsigned long long hash( unsigned char *k,
-			 unsigned long long length,
-			 unsigned long long initval);
+inline unsigned long long hash( unsigned char *k,
+				unsigned long long length,
+				unsigned long long initval) {
+  return hash_jenkins8(k, length, initval);
+}
 #endif
 
 /* this should make them as fast as a macro */
 hash_value_t hash_full_token(const char *tok);
 hash_value_t hash_partial_token(const char *tok, int len, 
 				const char *extra);
+u_int32_t hash_full_token32(const char *tok);
+u_int64_t hash_full_token64(const char *tok);
+
+/* hash_full_token() for the ids of a c_item_w<ID> table */
+template <typename ID> inline ID hash_full_token_w(const char *tok) { 
+  return hash_full_token(tok);
+}
+#if !defined NORMAL_MEMORY_MODEL
+template <> inline u_int32_t hash_full_token_w<u_int32_t>(const char *tok) {
+  return hash_full_token32(tok);
+}
+#endif
+#if !defined HUGE_MEMORY_MODEL
+template <> inline u_int64_t hash_full_token_w<u_int64_t>(const char *tok) {
+  return hash_full_token64(tok);
+}
+#endif
 
 /* this should make them as fast as a macro */
 digitized_weight_t digitize_a_weight(weight_t w, token_order_t o);
 weight_t undigitize_a_weight(digitized_weight_t d, token_order_t o);
 
-double nats2bits(double score);
+score_t nats2bits(score_t score);
 
 double chi2_cdf(double df, double x);
 double gamma_tail(double a, double b, double x);
 double normal_cdf(double x);
 
+void vexp(double *x, int n);
+void vlog(double *x, int n);
+double pairwise_sum(double *x, int n);
+double harmonic_sum(long n);
+double harmonic2_sum(long n);
+
 extern double igamc(double, double);
 extern double ndtr(double);
 